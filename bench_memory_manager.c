@@ -0,0 +1,1446 @@
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "memory_manager.h"
+#include "common_defs.h"
+
+#include "gitdata.h"
+
+// Current time in nanoseconds
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Measures the latency of mem_alloc while the number of live blocks in the pool grows.
+ * The pool is filled with live_blocks blocks of mixed sizes, then probe_allocs more blocks are allocated and timed.
+ * With segregated free lists the latency should not depend on the number of live blocks.
+ */
+void bench_alloc_latency_vs_live_blocks()
+{
+    printf_yellow("  Benchmark \"mem_alloc latency vs live blocks\"\n");
+    printf("  %12s %14s\n", "live blocks", "ns/mem_alloc");
+
+    const int probe_allocs = 4096;
+    const size_t max_block_size = 128;
+
+    for (int shift = 8; shift <= 20; shift++)
+    {
+        size_t live_blocks = (size_t)1 << shift;
+        mem_init((live_blocks + probe_allocs) * max_block_size);
+
+        // Fill the pool with live blocks
+        srand(shift);
+        for (size_t i = 0; i < live_blocks; i++)
+        {
+            void *block = mem_alloc(1 + rand() % max_block_size);
+            my_assert(block != NULL);
+        }
+
+        // Time the probe allocations
+        uint64_t start = now_ns();
+        for (int i = 0; i < probe_allocs; i++)
+        {
+            void *block = mem_alloc(1 + rand() % max_block_size);
+            my_assert(block != NULL);
+        }
+        uint64_t elapsed = now_ns() - start;
+
+        printf("  %12zu %14.1f\n", live_blocks, (double)elapsed / probe_allocs);
+        mem_deinit();
+    }
+}
+
+/*
+ * Measures the latency of mem_free with a growing number of live blocks, for both block layouts.
+ * Every other live block is freed in random order and timed; the out-of-band layout looks every
+ * pointer up in its open-addressing address hash, the in-band layout finds the block from the
+ * pointer itself, so the two columns compare a hash probe with pointer arithmetic.
+ */
+void bench_free_latency_by_layout()
+{
+    printf_yellow("  Benchmark \"mem_free latency, out-of-band vs in-band metadata\"\n");
+    printf("  %12s %18s %18s\n", "live blocks", "out-of-band ns", "in-band ns");
+
+    const size_t block_size = 48;
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_IN_BAND};
+
+    for (int shift = 10; shift <= 15; shift++)
+    {
+        size_t live_blocks = (size_t)1 << shift;
+        size_t frees = live_blocks / 2;
+        void **blocks = malloc(live_blocks * sizeof(void *));
+        size_t *order = malloc(frees * sizeof(size_t));
+        double ns[2];
+
+        // Free every other block in a shuffled order
+        srand(shift);
+        for (size_t i = 0; i < frees; i++)
+            order[i] = 2 * i;
+        for (size_t i = frees - 1; i > 0; i--)
+        {
+            size_t j = rand() % (i + 1);
+            size_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+
+        for (int l = 0; l < 2; l++)
+        {
+            mem_init_ex(live_blocks * (block_size + 32), layouts[l]);
+            for (size_t i = 0; i < live_blocks; i++)
+            {
+                blocks[i] = mem_alloc(block_size);
+                my_assert(blocks[i] != NULL);
+            }
+
+            uint64_t start = now_ns();
+            for (size_t i = 0; i < frees; i++)
+                mem_free(blocks[order[i]]);
+            ns[l] = (double)(now_ns() - start) / frees;
+
+            mem_deinit();
+        }
+
+        printf("  %12zu %18.1f %18.1f\n", live_blocks, ns[0], ns[1]);
+        free(blocks);
+        free(order);
+    }
+}
+
+my_barrier_t barrier;
+
+// Data structure to pass arguments to benchmark threads
+typedef struct
+{
+    int thread_id;  // Unique ID for each thread
+    int iterations; // Number of alloc/free pairs
+    size_t max_block_size;
+    bool power_of_two; // Only allocate power-of-two sizes
+} bench_thread_t;
+
+// Random block size between 16 and max_block_size
+static size_t random_block_size(bench_thread_t *data, unsigned int *seed)
+{
+    if (data->power_of_two)
+        return (size_t)16 << (rand_r(seed) % (__builtin_ctzll(data->max_block_size) - 3));
+    return 16 + rand_r(seed) % (data->max_block_size - 16);
+}
+
+/*
+ * Keeps a small window of live blocks per thread and replaces one of them on every iteration,
+ * so each iteration is one mem_alloc and one mem_free of a random small size.
+ */
+void *thread_alloc_free_window(void *arg)
+{
+    bench_thread_t *data = (bench_thread_t *)arg;
+    unsigned int seed = data->thread_id;
+    void *window[32] = {NULL};
+
+    my_barrier_wait(&barrier);
+    for (int i = 0; i < data->iterations; i++)
+    {
+        int slot = i % 32;
+        mem_free(window[slot]);
+        window[slot] = mem_alloc(random_block_size(data, &seed));
+        my_assert(window[slot] != NULL);
+    }
+    for (int i = 0; i < 32; i++)
+        mem_free(window[i]);
+    return NULL;
+}
+
+// Runs thread_alloc_free_window on num_threads threads against the current pool, returns alloc/free pairs per second
+double run_alloc_free_threads(int num_threads, int iterations, size_t max_block_size, bool power_of_two)
+{
+    pthread_t threads[num_threads];
+    bench_thread_t data[num_threads];
+
+    my_barrier_init(&barrier, num_threads + 1);
+    for (int i = 0; i < num_threads; i++)
+    {
+        data[i].thread_id = i;
+        data[i].iterations = iterations / num_threads;
+        data[i].max_block_size = max_block_size;
+        data[i].power_of_two = power_of_two;
+        pthread_create(&threads[i], NULL, thread_alloc_free_window, &data[i]);
+    }
+
+    my_barrier_wait(&barrier);
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    my_barrier_destroy(&barrier);
+    double pairs = (double)(iterations / num_threads) * num_threads;
+    return pairs / (elapsed / 1e9);
+}
+
+/*
+ * Compares alloc/free throughput with and without the per-thread caches from 1 thread up to
+ * twice the number of cores. Both runs use the in-band layout so only the locking differs.
+ */
+void bench_thread_cache_scaling()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cores * 2 > 8 ? cores * 2 : 8;
+    const int iterations = 1 << 21;
+
+    printf_yellow("  Benchmark \"alloc/free scaling with per-thread caches\" (%ld cores)\n", cores);
+    printf("  %8s %20s %20s\n", "threads", "locked ops/sec", "cached ops/sec");
+
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        mem_init_ex((size_t)64 << 20, MEM_IN_BAND);
+        double locked = run_alloc_free_threads(threads, iterations, 256, false);
+        mem_deinit();
+        mem_init_ex((size_t)64 << 20, MEM_THREAD_CACHE);
+        double cached = run_alloc_free_threads(threads, iterations, 256, false);
+        mem_deinit();
+        printf("  %8d %20.0f %20.0f\n", threads, locked, cached);
+    }
+}
+
+/*
+ * Allocates and frees node sized objects through mem_alloc/mem_free and through a slab cache.
+ */
+void bench_slab_vs_mem_alloc()
+{
+    printf_yellow("  Benchmark \"16 byte objects, mem_alloc vs slab cache\"\n");
+    printf("  %10s %18s %18s %18s %18s\n", "objects", "mem_alloc ns", "mem_free ns", "slab_alloc ns", "slab_free ns");
+
+    const size_t object_size = 16;
+
+    for (int shift = 10; shift <= 14; shift += 2)
+    {
+        size_t count = (size_t)1 << shift;
+        void **objects = malloc(count * sizeof(void *));
+        uint64_t start;
+
+        mem_init(count * object_size);
+        start = now_ns();
+        for (size_t i = 0; i < count; i++)
+            objects[i] = mem_alloc(object_size);
+        double alloc_ns = (double)(now_ns() - start) / count;
+        start = now_ns();
+        for (size_t i = 0; i < count; i++)
+            mem_free(objects[i]);
+        double free_ns = (double)(now_ns() - start) / count;
+        mem_deinit();
+
+        mem_init(count * object_size);
+        mem_slab_cache *cache = mem_slab_create(object_size);
+        start = now_ns();
+        for (size_t i = 0; i < count; i++)
+            objects[i] = mem_slab_alloc(cache);
+        double slab_alloc_ns = (double)(now_ns() - start) / count;
+        start = now_ns();
+        for (size_t i = 0; i < count; i++)
+            mem_slab_free(cache, objects[i]);
+        double slab_free_ns = (double)(now_ns() - start) / count;
+        mem_slab_destroy(cache);
+        mem_deinit();
+
+        printf("  %10zu %18.1f %18.1f %18.1f %18.1f\n", count, alloc_ns, free_ns, slab_alloc_ns, slab_free_ns);
+        free(objects);
+    }
+}
+
+/*
+ * Runs the default first-fit layout and the buddy layout side by side: the pool is filled with
+ * live blocks of power-of-two sizes, then 4 threads churn through power-of-two allocations the
+ * way test_memory_fragmentation_multithread does. Metadata is what the pool took from malloc
+ * besides the pool itself.
+ */
+void bench_buddy_vs_first_fit()
+{
+    const size_t pool_size = (size_t)16 << 20;
+    const int live_blocks = 4096;
+    const int iterations = 1 << 16;
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_BUDDY};
+    const char *names[] = {"first-fit", "buddy"};
+    void **blocks = malloc(live_blocks * sizeof(void *));
+
+    printf_yellow("  Benchmark \"first-fit vs buddy, power-of-two churn with %d live blocks\"\n", live_blocks);
+    printf("  %10s %16s %16s %16s\n", "layout", "fill ns/alloc", "churn ops/sec", "metadata bytes");
+
+    for (int l = 0; l < 2; l++)
+    {
+        struct mallinfo2 before = mallinfo2();
+        mem_init_ex(pool_size, layouts[l]);
+
+        unsigned int seed = 1;
+        bench_thread_t sizes = {.max_block_size = 4096, .power_of_two = true};
+        uint64_t start = now_ns();
+        for (int i = 0; i < live_blocks; i++)
+        {
+            blocks[i] = mem_alloc(random_block_size(&sizes, &seed));
+            my_assert(blocks[i] != NULL);
+        }
+        double fill_ns = (double)(now_ns() - start) / live_blocks;
+
+        struct mallinfo2 after = mallinfo2();
+        size_t metadata = (after.uordblks + after.hblkhd) - (before.uordblks + before.hblkhd) - pool_size;
+
+        double churn = run_alloc_free_threads(4, iterations, 4096, true);
+        mem_deinit();
+
+        printf("  %10s %16.1f %16.0f %16zu\n", names[l], fill_ns, churn, metadata);
+    }
+    free(blocks);
+}
+
+#define RING_SLOTS 256
+
+// Single producer, single consumer ring handing objects from the producer to one consumer
+typedef struct
+{
+    void *slots[RING_SLOTS];
+    size_t head; // Next slot the producer writes
+    size_t tail; // Next slot the consumer reads
+} ring_t;
+
+typedef struct
+{
+    ring_t *rings;
+    int num_consumers;
+    int items;
+    bool use_slab;         // Slab cache with remote frees instead of mem_alloc/mem_free
+    mem_slab_cache *cache; // Created by the producer, so it owns the cache
+} pipeline_t;
+
+typedef struct
+{
+    pipeline_t *pipeline;
+    ring_t *ring;
+} consumer_t;
+
+static void ring_push(ring_t *ring, void *object)
+{
+    size_t head = ring->head;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SLOTS)
+        sched_yield();
+    ring->slots[head % RING_SLOTS] = object;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void *ring_pop(ring_t *ring)
+{
+    size_t tail = ring->tail;
+    while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+        sched_yield();
+    void *object = ring->slots[tail % RING_SLOTS];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return object;
+}
+
+/*
+ * Like thread_alloc_free in the tests, but split in two: the producer allocates every block
+ * and hands it over to the consumers round robin, the consumers free them. A NULL ends a consumer.
+ */
+void *thread_producer(void *arg)
+{
+    pipeline_t *pipeline = arg;
+    const size_t object_size = 64;
+
+    if (pipeline->use_slab)
+        pipeline->cache = mem_slab_create(object_size);
+    my_barrier_wait(&barrier);
+    for (int i = 0; i < pipeline->items; i++)
+    {
+        void *object = pipeline->use_slab ? mem_slab_alloc(pipeline->cache) : mem_alloc(object_size);
+        my_assert(object != NULL);
+        *(int *)object = i;
+        ring_push(&pipeline->rings[i % pipeline->num_consumers], object);
+    }
+    for (int c = 0; c < pipeline->num_consumers; c++)
+        ring_push(&pipeline->rings[c], NULL);
+    return NULL;
+}
+
+void *thread_consumer(void *arg)
+{
+    consumer_t *consumer = arg;
+    pipeline_t *pipeline = consumer->pipeline;
+
+    my_barrier_wait(&barrier);
+    void *object;
+    while ((object = ring_pop(consumer->ring)) != NULL)
+    {
+        if (pipeline->use_slab)
+            mem_slab_free(pipeline->cache, object);
+        else
+            mem_free(object);
+    }
+    return NULL;
+}
+
+// Runs one producer and num_consumers consumers against the current pool, returns objects per second
+double run_pipeline(int num_consumers, int items, bool use_slab)
+{
+    pipeline_t pipeline = {.num_consumers = num_consumers, .items = items, .use_slab = use_slab};
+    pipeline.rings = calloc(num_consumers, sizeof(ring_t));
+    consumer_t consumers[num_consumers];
+    pthread_t threads[num_consumers];
+    pthread_t producer;
+
+    my_barrier_init(&barrier, num_consumers + 2);
+    pthread_create(&producer, NULL, thread_producer, &pipeline);
+    for (int c = 0; c < num_consumers; c++)
+    {
+        consumers[c] = (consumer_t){.pipeline = &pipeline, .ring = &pipeline.rings[c]};
+        pthread_create(&threads[c], NULL, thread_consumer, &consumers[c]);
+    }
+
+    my_barrier_wait(&barrier);
+    uint64_t start = now_ns();
+    pthread_join(producer, NULL);
+    for (int c = 0; c < num_consumers; c++)
+        pthread_join(threads[c], NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    my_barrier_destroy(&barrier);
+    mem_slab_destroy(pipeline.cache);
+    free(pipeline.rings);
+    return items / (elapsed / 1e9);
+}
+
+/*
+ * Producer/consumer throughput with 1 to N consumers freeing what one producer allocates:
+ * mem_alloc/mem_free, where every free takes the pool mutex and searches the block list,
+ * against a slab cache owned by the producer, where every free is one CAS on the remote stack.
+ */
+void bench_remote_free_pipeline()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_consumers = cores * 2 > 8 ? cores * 2 : 8;
+    const int items = 1 << 18;
+
+    printf_yellow("  Benchmark \"producer/consumer, cross-thread frees\" (%ld cores)\n", cores);
+    printf("  %10s %20s %20s\n", "consumers", "mem_free objs/sec", "slab objs/sec");
+
+    for (int consumers = 1; consumers <= max_consumers; consumers *= 2)
+    {
+        // Room for every object that can be in flight
+        size_t pool_size = (size_t)(consumers + 1) * RING_SLOTS * 64 + 4096;
+        mem_init(pool_size);
+        double locked = run_pipeline(consumers, items, false);
+        mem_deinit();
+        mem_init(pool_size);
+        double remote = run_pipeline(consumers, items, true);
+        mem_deinit();
+        printf("  %10d %20.0f %20.0f\n", consumers, locked, remote);
+    }
+}
+
+// Resident set size of the process in bytes
+static size_t resident_bytes()
+{
+    size_t pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL)
+    {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Metadata cost of the out-of-band layout: the pool is split into live blocks without touching
+ * their memory, so what the process gains from libc malloc and in resident memory is metadata.
+ */
+void bench_metadata_per_block()
+{
+    printf_yellow("  Benchmark \"out-of-band metadata per block\"\n");
+    printf("  %12s %14s %16s %16s\n", "live blocks", "ns/mem_alloc", "libc bytes/block", "rss bytes/block");
+
+    const size_t block_size = 64;
+
+    for (int shift = 10; shift <= 18; shift += 2)
+    {
+        size_t live_blocks = (size_t)1 << shift;
+        mem_init(live_blocks * block_size);
+
+        struct mallinfo2 before = mallinfo2();
+        size_t rss_before = resident_bytes();
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < live_blocks; i++)
+            my_assert(mem_alloc(block_size) != NULL);
+        double alloc_ns = (double)(now_ns() - start) / live_blocks;
+        struct mallinfo2 after = mallinfo2();
+        size_t rss_after = resident_bytes();
+
+        double libc = ((double)(after.uordblks + after.hblkhd) - (double)(before.uordblks + before.hblkhd)) / live_blocks;
+        double rss = ((double)rss_after - (double)rss_before) / live_blocks;
+        printf("  %12zu %14.1f %16.1f %16.1f\n", live_blocks, alloc_ns, libc, rss);
+        mem_deinit();
+    }
+}
+
+typedef struct
+{
+    volatile uint64_t *counter;
+    uint64_t increments;
+} counter_thread_t;
+
+void *thread_increment_counter(void *arg)
+{
+    counter_thread_t *data = arg;
+    my_barrier_wait(&barrier);
+    for (uint64_t i = 0; i < data->increments; i++)
+        (*data->counter)++;
+    return NULL;
+}
+
+// Every thread increments its own counter, returns increments per second over all threads
+double run_counter_threads(int num_threads, volatile uint64_t **counters, uint64_t increments)
+{
+    pthread_t threads[num_threads];
+    counter_thread_t data[num_threads];
+
+    my_barrier_init(&barrier, num_threads + 1);
+    for (int i = 0; i < num_threads; i++)
+    {
+        data[i] = (counter_thread_t){.counter = counters[i], .increments = increments};
+        pthread_create(&threads[i], NULL, thread_increment_counter, &data[i]);
+    }
+    // Counting starts as soon as we arrive, take the time before
+    uint64_t start = now_ns();
+    my_barrier_wait(&barrier);
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    uint64_t elapsed = now_ns() - start;
+    my_barrier_destroy(&barrier);
+    return (double)increments * num_threads / (elapsed / 1e9);
+}
+
+/*
+ * False sharing between per-thread counters allocated back to back: plain mem_alloc packs
+ * them into one cache line, mem_alloc_aligned and a MEM_ALIGN_64 pool give each its own line.
+ */
+void bench_false_sharing()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cores > 8 ? cores : 8;
+    const uint64_t increments = 1 << 26;
+
+    printf_yellow("  Benchmark \"per-thread counters, packed vs cache line aligned\" (%ld cores)\n", cores);
+    printf("  %8s %18s %18s %18s\n", "threads", "mem_alloc inc/s", "aligned inc/s", "MEM_ALIGN_64 inc/s");
+
+    for (int threads = 2; threads <= max_threads; threads *= 2)
+    {
+        volatile uint64_t *counters[threads];
+        double results[3];
+
+        for (int variant = 0; variant < 3; variant++)
+        {
+            mem_init_ex(4096, variant == 2 ? MEM_ALIGN_64 : MEM_OUT_OF_BAND);
+            for (int i = 0; i < threads; i++)
+            {
+                counters[i] = variant == 1 ? mem_alloc_aligned(sizeof(uint64_t), 64) : mem_alloc(sizeof(uint64_t));
+                my_assert(counters[i] != NULL);
+                *counters[i] = 0;
+            }
+            results[variant] = run_counter_threads(threads, counters, increments / threads);
+            mem_deinit();
+        }
+        printf("  %8d %18.0f %18.0f %18.0f\n", threads, results[0], results[1], results[2]);
+    }
+}
+
+typedef struct
+{
+    int thread_id;
+    int requests;
+    bool batch;
+} handler_thread_t;
+
+/*
+ * A request handler: allocates 32 small blocks at once and frees them together, either one
+ * block at a time or with mem_alloc_batch and mem_free_batch.
+ */
+void *thread_request_handler(void *arg)
+{
+    handler_thread_t *data = arg;
+    unsigned int seed = data->thread_id;
+    void *blocks[32];
+    size_t sizes[32];
+
+    my_barrier_wait(&barrier);
+    for (int r = 0; r < data->requests; r++)
+    {
+        for (int i = 0; i < 32; i++)
+            sizes[i] = 16 + rand_r(&seed) % 240;
+        if (data->batch)
+        {
+            my_assert(mem_alloc_batch(blocks, sizes, 32));
+            mem_free_batch(blocks, 32);
+            continue;
+        }
+        for (int i = 0; i < 32; i++)
+        {
+            blocks[i] = mem_alloc(sizes[i]);
+            my_assert(blocks[i] != NULL);
+        }
+        for (int i = 0; i < 32; i++)
+            mem_free(blocks[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Requests per second for handlers allocating and freeing 32 blocks each, block by block
+ * against the batch entry points, with 1024 long lived blocks in the pool.
+ */
+void bench_batch_alloc_free()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cores * 2 > 8 ? cores * 2 : 8;
+    const int requests = 1 << 12;
+
+    printf_yellow("  Benchmark \"32 block requests, single vs batch calls\" (%ld cores)\n", cores);
+    printf("  %8s %18s %18s\n", "threads", "single req/sec", "batch req/sec");
+
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double results[2];
+        for (int batch = 0; batch < 2; batch++)
+        {
+            mem_init((size_t)(1024 + 32 * threads) * 256);
+            for (int i = 0; i < 1024; i++)
+                my_assert(mem_alloc(128) != NULL);
+
+            pthread_t tids[threads];
+            handler_thread_t data[threads];
+            my_barrier_init(&barrier, threads + 1);
+            for (int i = 0; i < threads; i++)
+            {
+                data[i] = (handler_thread_t){.thread_id = i, .requests = requests / threads, .batch = batch};
+                pthread_create(&tids[i], NULL, thread_request_handler, &data[i]);
+            }
+            uint64_t start = now_ns();
+            my_barrier_wait(&barrier);
+            for (int i = 0; i < threads; i++)
+                pthread_join(tids[i], NULL);
+            uint64_t elapsed = now_ns() - start;
+            my_barrier_destroy(&barrier);
+            mem_deinit();
+
+            results[batch] = (double)(requests / threads) * threads / (elapsed / 1e9);
+        }
+        printf("  %8d %18.0f %18.0f\n", threads, results[0], results[1]);
+    }
+}
+
+typedef struct
+{
+    int thread_id;
+    int resizes;
+    int moved;          // Resizes that returned a different address
+    size_t copied;      // Bytes those had to copy
+} resize_thread_t;
+
+/*
+ * Like thread_resize in the tests, but each thread keeps growing a handful of buffers by random
+ * amounts, trims them now and then and starts over once they get large, the way growable
+ * buffers do.
+ */
+void *thread_resize_buffers(void *arg)
+{
+    resize_thread_t *data = arg;
+    unsigned int seed = data->thread_id;
+    void *buffers[4];
+    size_t sizes[4];
+
+    for (int i = 0; i < 4; i++)
+    {
+        sizes[i] = 64;
+        buffers[i] = mem_alloc(sizes[i]);
+        my_assert(buffers[i] != NULL);
+    }
+    my_barrier_wait(&barrier);
+    for (int r = 0; r < data->resizes; r++)
+    {
+        int i = rand_r(&seed) % 4;
+        if (sizes[i] > 16384)
+        {
+            // Done with this buffer, start a new one
+            mem_free(buffers[i]);
+            sizes[i] = 64;
+            buffers[i] = mem_alloc(sizes[i]);
+            my_assert(buffers[i] != NULL);
+        }
+        // Mostly growing, now and then trimmed to what is in use
+        size_t size = rand_r(&seed) % 64 == 0 ? 64 + rand_r(&seed) % sizes[i] : sizes[i] + rand_r(&seed) % 512;
+        void *resized = mem_resize(buffers[i], size);
+        my_assert(resized != NULL);
+        if (resized != buffers[i])
+        {
+            data->moved++;
+            data->copied += sizes[i] < size ? sizes[i] : size;
+        }
+        buffers[i] = resized;
+        sizes[i] = size;
+    }
+    for (int i = 0; i < 4; i++)
+        mem_free(buffers[i]);
+    return NULL;
+}
+
+/*
+ * Resize throughput and the share of resizes that had to move the data, per layout.
+ */
+void bench_resize_buffers()
+{
+    const int resizes = 1 << 20;
+    const int threads = 4;
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_IN_BAND, MEM_BUDDY};
+    const char *names[] = {"out-of-band", "in-band", "buddy"};
+
+    printf_yellow("  Benchmark \"growing and shrinking buffers with mem_resize\" (%d threads)\n", threads);
+    printf("  %12s %16s %12s %12s\n", "layout", "resizes/sec", "moved", "MiB copied");
+
+    for (int l = 0; l < 3; l++)
+    {
+        pthread_t tids[threads];
+        resize_thread_t data[threads];
+
+        mem_init_ex((size_t)4 << 20, layouts[l]);
+        my_barrier_init(&barrier, threads + 1);
+        for (int i = 0; i < threads; i++)
+        {
+            data[i] = (resize_thread_t){.thread_id = i, .resizes = resizes / threads};
+            pthread_create(&tids[i], NULL, thread_resize_buffers, &data[i]);
+        }
+        uint64_t start = now_ns();
+        my_barrier_wait(&barrier);
+        int moved = 0;
+        size_t copied = 0;
+        for (int i = 0; i < threads; i++)
+        {
+            pthread_join(tids[i], NULL);
+            moved += data[i].moved;
+            copied += data[i].copied;
+        }
+        uint64_t elapsed = now_ns() - start;
+        my_barrier_destroy(&barrier);
+        mem_deinit();
+
+        printf("  %12s %16.0f %11.1f%% %12.1f\n", names[l], (double)resizes / (elapsed / 1e9), 100.0 * moved / resizes, copied / 1048576.0);
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Latency percentiles of single mem_free calls with 10^3 to 10^6 live blocks in the default
+ * layout. 1000 randomly picked blocks are freed and each free is timed on its own.
+ */
+void bench_free_percentiles()
+{
+    const int samples = 1000;
+    uint64_t latencies[samples];
+
+    printf_yellow("  Benchmark \"mem_free latency percentiles vs live blocks\"\n");
+    printf("  %12s %12s %12s\n", "live blocks", "p50 ns", "p99 ns");
+
+    for (size_t live_blocks = 1000; live_blocks <= 1000000; live_blocks *= 10)
+    {
+        void **blocks = malloc(live_blocks * sizeof(void *));
+        mem_init(live_blocks * 64);
+        srand(1);
+        for (size_t i = 0; i < live_blocks; i++)
+        {
+            blocks[i] = mem_alloc(32 + rand() % 32);
+            my_assert(blocks[i] != NULL);
+        }
+
+        // Pick distinct blocks by shuffling the first samples entries
+        for (int i = 0; i < samples; i++)
+        {
+            size_t j = i + (size_t)rand() % (live_blocks - i);
+            void *tmp = blocks[i];
+            blocks[i] = blocks[j];
+            blocks[j] = tmp;
+        }
+        for (int i = 0; i < samples; i++)
+        {
+            uint64_t start = now_ns();
+            mem_free(blocks[i]);
+            latencies[i] = now_ns() - start;
+        }
+        qsort(latencies, samples, sizeof(uint64_t), compare_u64);
+
+        printf("  %12zu %12lu %12lu\n", live_blocks, (unsigned long)latencies[samples / 2], (unsigned long)latencies[samples * 99 / 100]);
+        mem_deinit();
+        free(blocks);
+    }
+}
+
+// Open a counter of data TLB misses of this thread, -1 where perf events aren't available
+static int tlb_miss_counter()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Measures pools of 64 MiB to 4 GiB backed by the heap and by each mapping option: the time to create
+ * the pool, to touch every page of it once, and the time and data TLB misses of random 8 byte reads
+ * afterwards. Prefaulting moves the page faults into creation, huge pages cut the faults and TLB misses.
+ */
+void bench_pool_mapping()
+{
+    const int reads = 1 << 22;
+    const char *names[] = {"heap", "mmap", "populate", "thp", "thp+populate", "hugetlb"};
+    unsigned int mappings[] = {MEM_OUT_OF_BAND, MEM_MMAP, MEM_POPULATE, MEM_HUGE_PAGES, MEM_HUGE_PAGES | MEM_POPULATE, MEM_HUGETLB};
+
+    printf_yellow("  Benchmark \"pool startup and TLB misses by mapping\"\n");
+    printf("  %8s %13s %11s %11s %10s %12s\n", "pool MiB", "mapping", "create ms", "touch ms", "ns/read", "TLB miss/read");
+
+    int counter = tlb_miss_counter();
+    for (size_t mib = 64; mib <= 4096; mib *= 4)
+    {
+        size_t size = mib << 20;
+        for (int m = 0; m < 6; m++)
+        {
+            uint64_t begin = now_ns();
+            mem_pool *pool = mem_pool_create(size, mappings[m]);
+            char *block = pool != NULL ? mem_pool_alloc(pool, size) : NULL;
+            uint64_t created = now_ns();
+            if (block == NULL)
+            {
+                printf("  %8zu %13s %11s\n", mib, names[m], "failed");
+                mem_pool_destroy(pool);
+                continue;
+            }
+
+            for (size_t offset = 0; offset < size; offset += 4096)
+            {
+                block[offset] = 1;
+            }
+            uint64_t touched = now_ns();
+
+            // Independent reads at random 8 byte offsets
+            uint64_t x = 88172645463325252ULL, sum = 0, misses = 0;
+            if (counter >= 0)
+            {
+                ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+                ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+            }
+            uint64_t start = now_ns();
+            for (int i = 0; i < reads; i++)
+            {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                sum += *(volatile uint64_t *)(block + (x % size & ~(uint64_t)7));
+            }
+            uint64_t elapsed = now_ns() - start;
+            if (counter >= 0)
+            {
+                ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+                    misses = 0;
+            }
+            my_assert(sum > 0);
+
+            char miss_text[32] = "n/a";
+            if (counter >= 0)
+                snprintf(miss_text, sizeof(miss_text), "%.3f", (double)misses / reads);
+            printf("  %8zu %13s %11.1f %11.1f %10.1f %12s\n", mib, names[m], (created - begin) / 1e6, (touched - created) / 1e6,
+                   (double)elapsed / reads, miss_text);
+            mem_pool_destroy(pool);
+        }
+    }
+    if (counter >= 0)
+        close(counter);
+}
+
+// Run the bursty schedule of bench_rss_over_time on pool, recording the RSS growth after every tick
+static void run_bursts(mem_pool *pool, void **blocks, int max_blocks, int ticks, int cycle, size_t *rss)
+{
+    const size_t burst_bytes = (size_t)128 << 20;
+    size_t base = resident_bytes();
+    int count = 0;
+    srand(1);
+    for (int tick = 0; tick < ticks; tick++)
+    {
+        if (tick % cycle == 0)
+        {
+            // Burst: fill and touch blocks of 64 bytes to 64 KiB
+            size_t total = 0;
+            for (count = 0; count < max_blocks && total < burst_bytes; count++)
+            {
+                size_t size = 64 + (size_t)rand() % (64 * 1024);
+                blocks[count] = mem_pool_alloc(pool, size);
+                my_assert(blocks[count] != NULL);
+                memset(blocks[count], 1, size);
+                total += size;
+            }
+        }
+        else if (tick % cycle == cycle / 3)
+        {
+            for (int i = 0; i < count; i++)
+                mem_pool_free(pool, blocks[i]);
+            count = 0;
+        }
+        usleep(50 * 1000);
+        size_t now = resident_bytes();
+        rss[tick] = now > base ? now - base : 0;
+    }
+}
+
+/*
+ * Tracks RSS while bursts of 128 MiB are allocated, held for 200 ms and freed, followed by 400 ms of idle time.
+ * A fixed pool sized for the peak keeps its pages after the first burst, a growing pool starting at 16 MiB with a
+ * 100 ms release delay gives them back between bursts.
+ */
+void bench_rss_over_time()
+{
+    const int ticks = 36, cycle = 12, max_blocks = 1 << 16;
+    size_t fixed_rss[ticks], grow_rss[ticks];
+    void **blocks = malloc(max_blocks * sizeof(void *));
+
+    printf_yellow("  Benchmark \"RSS over time under bursts\"\n");
+
+    mem_pool *pool = mem_pool_create((size_t)192 << 20, MEM_OUT_OF_BAND);
+    run_bursts(pool, blocks, max_blocks, ticks, cycle, fixed_rss);
+    mem_pool_destroy(pool);
+
+    pool = mem_pool_create((size_t)16 << 20, MEM_GROW);
+    mem_pool_set_release_delay(pool, 100);
+    run_bursts(pool, blocks, max_blocks, ticks, cycle, grow_rss);
+    mem_pool_set_release_delay(pool, 0);
+    mem_pool_destroy(pool);
+    free(blocks);
+
+    printf("  %8s %8s %12s %17s\n", "ms", "phase", "fixed MiB", "grow+release MiB");
+    for (int tick = 0; tick < ticks; tick++)
+    {
+        const char *phase = tick % cycle < cycle / 3 ? "burst" : "idle";
+        printf("  %8d %8s %12.1f %17.1f\n", (tick + 1) * 50, phase, fixed_rss[tick] / 1048576.0, grow_rss[tick] / 1048576.0);
+    }
+}
+
+// Block sizes of the random blocks test
+static size_t random_test_size()
+{
+    return 1 + rand() % 1024;
+}
+
+// Block sizes of the fragmentation test, 1x to 3x a base block, mixed with small blocks
+static size_t fragmentation_test_size()
+{
+    return rand() % 3 == 0 ? 16 + rand() % 240 : 2048 * (1 + rand() % 3);
+}
+
+/*
+ * Replays the size mix of test_random_blocks_multithread and test_memory_fragmentation_multithread as one long
+ * churn per placement policy, freeing random live blocks so the pool stays about 80% full. Reports throughput,
+ * failed allocations, and at the end the largest free block and the external fragmentation,
+ * 1 - largest free block / free bytes.
+ */
+void bench_placement_policies()
+{
+    const int ops = 200000;
+    const char *names[] = {"classes", "first", "next", "best", "addr-best"};
+    unsigned int policies[] = {MEM_OUT_OF_BAND, MEM_FIRST_FIT, MEM_NEXT_FIT, MEM_BEST_FIT, MEM_ADDRESS_BEST_FIT};
+    const char *patterns[] = {"random", "fragment"};
+    size_t (*sizes[])() = {random_test_size, fragmentation_test_size};
+    int max_live[] = {4096, 1024};
+    size_t pool_sizes[] = {(size_t)4096 * 512 * 5 / 4, (size_t)1024 * 2776 * 5 / 4};
+
+    printf_yellow("  Benchmark \"placement policies\"\n");
+    printf("  %9s %10s %10s %9s %16s %14s\n", "pattern", "policy", "Mops/s", "failed %", "largest free KiB", "fragmentation %");
+
+    void **blocks = malloc(4096 * sizeof(void *));
+    size_t *block_sizes = malloc(4096 * sizeof(size_t));
+    for (int t = 0; t < 2; t++)
+    {
+        for (int p = 0; p < 5; p++)
+        {
+            mem_pool *pool = mem_pool_create(pool_sizes[t], policies[p]);
+            size_t live_bytes = 0;
+            int live = 0, allocs = 0, failed = 0;
+            srand(t);
+
+            uint64_t start = now_ns();
+            for (int i = 0; i < ops; i++)
+            {
+                if (live == 0 || (live < max_live[t] && rand() % 100 < 55))
+                {
+                    size_t size = sizes[t]();
+                    void *block = mem_pool_alloc(pool, size);
+                    allocs++;
+                    if (block == NULL)
+                    {
+                        failed++;
+                        continue;
+                    }
+                    blocks[live] = block;
+                    block_sizes[live++] = size;
+                    live_bytes += size;
+                }
+                else
+                {
+                    int victim = rand() % live;
+                    mem_pool_free(pool, blocks[victim]);
+                    live_bytes -= block_sizes[victim];
+                    blocks[victim] = blocks[--live];
+                    block_sizes[victim] = block_sizes[live];
+                }
+            }
+            uint64_t elapsed = now_ns() - start;
+
+            mem_statistics stats;
+            mem_pool_stats(pool, &stats);
+            my_assert(stats.free_bytes == pool_sizes[t] - live_bytes);
+            printf("  %9s %10s %10.2f %9.2f %16.1f %14.1f\n", patterns[t], names[p], ops * 1e3 / elapsed,
+                   100.0 * failed / allocs, stats.largest_free_block / 1024.0, 100.0 * stats.fragmentation);
+            mem_pool_destroy(pool);
+        }
+    }
+    free(blocks);
+    free(block_sizes);
+}
+
+// Upper bound of the histogram bucket holding the given percentile of the recorded times
+static unsigned long histogram_percentile(const unsigned long *histogram, double percentile)
+{
+    unsigned long total = 0, seen = 0;
+    for (int bucket = 0; bucket < MEM_LOCK_BUCKETS; bucket++)
+        total += histogram[bucket];
+    for (int bucket = 0; bucket < MEM_LOCK_BUCKETS; bucket++)
+    {
+        seen += histogram[bucket];
+        if (seen > 0 && seen >= total * percentile)
+            return 2UL << bucket;
+    }
+    return 0;
+}
+
+/*
+ * Runs alloc/free pairs on the default pool from 1 to 128 threads and reads the lock profile afterwards:
+ * the share of contended acquisitions, the mean wait and the 99th percentile of waits and hold times.
+ * Without make lock_profile only the throughput is measured.
+ */
+void bench_lock_contention()
+{
+    const int iterations = 1 << 20;
+    int thread_counts[] = {1, 4, 16, 64, 128};
+    mem_lock_stats stats;
+
+    printf_yellow("  Benchmark \"pool mutex contention\"\n");
+    printf("  %8s %14s %12s %12s %14s %14s\n", "threads", "pairs/sec", "contended %", "wait ns/acq", "p99 wait ns <", "p99 hold ns <");
+    for (int t = 0; t < 5; t++)
+    {
+        mem_init(64 << 20);
+        double rate = run_alloc_free_threads(thread_counts[t], iterations, 256, false);
+        if (!mem_lock_profile(&stats))
+        {
+            printf("  %8d %14.0f %12s %12s %14s %14s\n", thread_counts[t], rate, "n/a", "n/a", "n/a", "n/a");
+            mem_deinit();
+            continue;
+        }
+
+        // Allocations and frees together
+        unsigned long acquisitions = 0, contended = 0, wait_ns = 0;
+        unsigned long wait_histogram[MEM_LOCK_BUCKETS] = {0}, hold_histogram[MEM_LOCK_BUCKETS] = {0};
+        for (int op = MEM_LOCK_ALLOC; op <= MEM_LOCK_FREE; op++)
+        {
+            acquisitions += stats.acquisitions[op];
+            contended += stats.contended[op];
+            wait_ns += stats.wait_ns[op];
+            for (int bucket = 0; bucket < MEM_LOCK_BUCKETS; bucket++)
+            {
+                wait_histogram[bucket] += stats.wait_histogram[op][bucket];
+                hold_histogram[bucket] += stats.hold_histogram[op][bucket];
+            }
+        }
+        printf("  %8d %14.0f %12.2f %12.1f %14lu %14lu\n", thread_counts[t], rate, 100.0 * contended / acquisitions,
+               (double)wait_ns / acquisitions, histogram_percentile(wait_histogram, 0.99), histogram_percentile(hold_histogram, 0.99));
+        mem_deinit();
+    }
+}
+
+/*
+ * Even threads allocate and free small list nodes, odd threads keep growing a large buffer with
+ * mem_resize and start over once it passes 1 MiB.
+ */
+void *thread_mixed_workload(void *arg)
+{
+    bench_thread_t *data = arg;
+    unsigned int seed = data->thread_id;
+    void *nodes[32] = {NULL};
+    void *buffer = NULL;
+    size_t size = 0;
+
+    my_barrier_wait(&barrier);
+    for (int i = 0; i < data->iterations; i++)
+    {
+        if (data->thread_id % 2 == 0)
+        {
+            int slot = rand_r(&seed) % 32;
+            mem_free(nodes[slot]);
+            nodes[slot] = mem_alloc(16 + rand_r(&seed) % 48);
+            my_assert(nodes[slot] != NULL);
+            continue;
+        }
+        if (buffer == NULL || size > 1048576)
+        {
+            mem_free(buffer);
+            size = 65536;
+            buffer = mem_alloc(size);
+            my_assert(buffer != NULL);
+        }
+        size += rand_r(&seed) % 65536;
+        buffer = mem_resize(buffer, size);
+        my_assert(buffer != NULL);
+    }
+    for (int slot = 0; slot < 32; slot++)
+        mem_free(nodes[slot]);
+    mem_free(buffer);
+    return NULL;
+}
+
+// Share of contended acquisitions of the default pool in percent, -1 without lock profiling
+static double contended_percent()
+{
+    mem_lock_stats stats;
+    if (!mem_lock_profile(&stats))
+        return -1;
+    unsigned long acquisitions = 0, contended = 0;
+    for (int op = 0; op < MEM_LOCK_OPS; op++)
+    {
+        acquisitions += stats.acquisitions[op];
+        contended += stats.contended[op];
+    }
+    return acquisitions > 0 ? 100.0 * contended / acquisitions : 0;
+}
+
+/*
+ * Operations per second of the mixed small/large workload on one pool lock against a MEM_REGIONS
+ * pool, where node allocations and buffer resizes take different region locks.
+ */
+void bench_region_locks()
+{
+    const int operations = 1 << 20;
+    int thread_counts[] = {1, 4, 16, 64, 256};
+    unsigned int layouts[] = {MEM_MMAP, MEM_MMAP | MEM_REGIONS};
+    double rate[2], contended[2];
+
+    printf_yellow("  Benchmark \"mixed small and large blocks, one lock against regions\"\n");
+    printf("  %8s %16s %16s %10s %14s %14s\n", "threads", "one lock ops/s", "regions ops/s", "speedup", "contended % 1", "contended % R");
+    for (int t = 0; t < 5; t++)
+    {
+        int threads = thread_counts[t];
+        for (int l = 0; l < 2; l++)
+        {
+            pthread_t tids[threads];
+            bench_thread_t data[threads];
+
+            mem_init_ex((size_t)2 << 30, layouts[l]);
+            my_barrier_init(&barrier, threads + 1);
+            for (int i = 0; i < threads; i++)
+            {
+                data[i] = (bench_thread_t){.thread_id = i, .iterations = operations / threads};
+                pthread_create(&tids[i], NULL, thread_mixed_workload, &data[i]);
+            }
+            my_barrier_wait(&barrier);
+            uint64_t start = now_ns();
+            for (int i = 0; i < threads; i++)
+                pthread_join(tids[i], NULL);
+            uint64_t elapsed = now_ns() - start;
+            my_barrier_destroy(&barrier);
+            rate[l] = (double)(operations / threads) * threads / (elapsed / 1e9);
+            contended[l] = contended_percent();
+            mem_deinit();
+        }
+        if (contended[0] < 0)
+            printf("  %8d %16.0f %16.0f %9.2fx %14s %14s\n", threads, rate[0], rate[1], rate[1] / rate[0], "n/a", "n/a");
+        else
+            printf("  %8d %16.0f %16.0f %9.2fx %14.2f %14.2f\n", threads, rate[0], rate[1], rate[1] / rate[0], contended[0], contended[1]);
+    }
+}
+
+// Runs thread_alloc_free_window on total short-lived threads, at most concurrent of them at a time,
+// returns alloc/free pairs per second with the thread starts included
+static double run_short_lived_threads(int concurrent, int total, int iterations)
+{
+    pthread_t tids[concurrent];
+    bench_thread_t data[concurrent];
+    int started = 0;
+
+    uint64_t start = now_ns();
+    while (started < total)
+    {
+        my_barrier_init(&barrier, concurrent + 1);
+        for (int i = 0; i < concurrent; i++)
+        {
+            data[i] = (bench_thread_t){.thread_id = started + i, .iterations = iterations, .max_block_size = 256};
+            pthread_create(&tids[i], NULL, thread_alloc_free_window, &data[i]);
+        }
+        my_barrier_wait(&barrier);
+        for (int i = 0; i < concurrent; i++)
+            pthread_join(tids[i], NULL);
+        my_barrier_destroy(&barrier);
+        started += concurrent;
+    }
+    uint64_t elapsed = now_ns() - start;
+    return (double)started * iterations / (elapsed / 1e9);
+}
+
+/*
+ * Waves of short-lived threads, 4 per core and more, on per-thread caches against per-CPU arenas.
+ * Peak is the most memory the pool had handed out at once, blocks held in caches included, and
+ * RSS what the pool left resident.
+ */
+void bench_cpu_arenas()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_counts[] = {cores * 4, 64, 256};
+    unsigned int layouts[] = {MEM_MMAP | MEM_THREAD_CACHE, MEM_MMAP | MEM_CPU_ARENAS};
+    const int total_threads = 1024;
+    const int iterations = 2048;
+    mem_statistics stats;
+
+    printf_yellow("  Benchmark \"short-lived threads, per-thread caches against per-CPU arenas\" (%ld cores)\n", cores);
+    printf("  %8s %14s %14s %12s %12s %12s %12s\n", "threads", "cached ops/s", "arenas ops/s",
+           "cached peak", "arenas peak", "cached RSS", "arenas RSS");
+    for (int t = 0; t < 3; t++)
+    {
+        double rate[2];
+        size_t peak[2], rss[2];
+        for (int l = 0; l < 2; l++)
+        {
+            size_t before = resident_bytes();
+            mem_init_ex((size_t)1 << 30, layouts[l]);
+            rate[l] = run_short_lived_threads(thread_counts[t], total_threads, iterations);
+            mem_stats(&stats);
+            peak[l] = stats.peak_allocated_bytes;
+            rss[l] = resident_bytes() - before;
+            mem_deinit();
+        }
+        printf("  %8d %14.0f %14.0f %10zuKi %10zuKi %10.1fMi %10.1fMi\n", thread_counts[t], rate[0], rate[1],
+               peak[0] >> 10, peak[1] >> 10, rss[0] / 1048576.0, rss[1] / 1048576.0);
+    }
+}
+
+/*
+ * Cost of the sampling heap profile: alloc/free pairs of up to 1 KiB on 1 and 4 threads with
+ * profiling off and at three sampling rates, on the default layout and with thread caches.
+ * The rates take turns over 5 rounds and each keeps its best round, so drift of the machine
+ * hits all of them alike. The overhead is against profiling off.
+ */
+void bench_heap_profile_overhead()
+{
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_THREAD_CACHE};
+    const char *names[] = {"default", "cached"};
+    size_t rates[] = {0, 512 * 1024, 64 * 1024, 4096};
+    const int iterations = 1 << 21;
+
+    printf_yellow("  Benchmark \"heap profile overhead\"\n");
+    printf("  %8s %8s %12s %14s %10s\n", "layout", "threads", "sample every", "pairs/s", "overhead");
+    for (int l = 0; l < 2; l++)
+    {
+        for (int threads = 1; threads <= 4; threads *= 4)
+        {
+            double best[4] = {0};
+            for (int round = 0; round < 5; round++)
+            {
+                for (int r = 0; r < 4; r++)
+                {
+                    mem_init_ex(64 * 1024 * 1024, layouts[l]);
+                    if (rates[r] > 0)
+                        mem_profile_start(rates[r], NULL);
+                    double rate = run_alloc_free_threads(threads, iterations, 1024, false);
+                    mem_profile_stop();
+                    mem_deinit();
+                    if (rate > best[r])
+                        best[r] = rate;
+                }
+            }
+            printf("  %8s %8d %12s %14.0f %10s\n", names[l], threads, "off", best[0], "-");
+            for (int r = 1; r < 4; r++)
+                printf("  %8s %8d %10zuKi %14.0f %9.1f%%\n", names[l], threads, rates[r] >> 10, best[r],
+                       100.0 * (best[0] / best[r] - 1));
+        }
+    }
+}
+
+/*
+ * The production and debug builds against the baseline, the plain library built at the same
+ * optimization level (VARIANT_OPT in the Makefile). Production should match the baseline within
+ * noise, the debug row shows what the checks cost. The benchmark runs itself three times per
+ * variant with the variant preloaded in front of libmemory_manager.so, each run times alloc/free
+ * pairs of up to 1 KiB on 1 and 4 threads twice, and every variant keeps its best.
+ */
+void bench_library_variants()
+{
+    const char *variant = getenv("BENCH_VARIANT");
+    if (variant == NULL)
+    {
+        const char *names[] = {"baseline", "production", "debug"};
+        const char *libraries[] = {"./libmemory_manager_base.so", "./libmemory_manager_prod.so", "./libmemory_manager_debug.so"};
+        double best[3][2] = {{0, 0}, {0, 0}, {0, 0}};
+        printf_yellow("  Benchmark \"library variants\"\n");
+        printf("  %12s %16s %16s %10s %10s\n", "variant", "1 thread pairs/s", "4 threads pairs/s", "1 vs base", "4 vs base");
+
+        // Rounds alternate between the variants, so a slow spell of the machine hits all of them
+        for (int round = 0; round < 3; round++)
+        {
+            for (int v = 0; v < 3; v++)
+            {
+                if (access(libraries[v], R_OK) != 0)
+                    continue;
+                // Only the rates of the child, not its version line
+                char command[256];
+                snprintf(command, sizeof(command), "BENCH_VARIANT=%s LD_PRELOAD=%s ./bench_memory_manager 19 | tail -n 1", names[v], libraries[v]);
+                FILE *child = popen(command, "r");
+                my_assert(child != NULL);
+                double rates[2];
+                my_assert(fscanf(child, "%lf %lf", &rates[0], &rates[1]) == 2);
+                my_assert(pclose(child) == 0);
+                for (int t = 0; t < 2; t++)
+                    if (rates[t] > best[v][t])
+                        best[v][t] = rates[t];
+            }
+        }
+
+        for (int v = 0; v < 3; v++)
+        {
+            if (best[v][0] == 0)
+                printf("  %12s %16s %16s %10s %10s\n", names[v], "not built", "-", "-", "-");
+            else if (best[0][0] == 0)
+                printf("  %12s %16.0f %16.0f %10s %10s\n", names[v], best[v][0], best[v][1], "-", "-");
+            else
+                printf("  %12s %16.0f %16.0f %+9.1f%% %+9.1f%%\n", names[v], best[v][0], best[v][1],
+                       100.0 * (best[v][0] / best[0][0] - 1), 100.0 * (best[v][1] / best[0][1] - 1));
+        }
+        return;
+    }
+
+    double best[2] = {0, 0};
+    for (int round = 0; round < 2; round++)
+    {
+        for (int t = 0; t < 2; t++)
+        {
+            mem_init(64 * 1024 * 1024);
+            double rate = run_alloc_free_threads(t == 0 ? 1 : 4, 1 << 21, 1024, false);
+            mem_deinit();
+            if (rate > best[t])
+                best[t] = rate;
+        }
+    }
+    printf("%.0f %.0f\n", best[0], best[1]);
+}
+
+int main(int argc, char *argv[])
+{
+#ifdef VERSION
+    printf("Build Version; %s \n", VERSION);
+#endif
+    printf("Git Version; %s/%s \n", git_date, git_sha);
+
+    if (argc < 2)
+    {
+        printf("Usage: %s <benchmark>\n", argv[0]);
+        printf("Available benchmarks:\n");
+
+        printf("  0. runs all benchmarks\n");
+        printf("  1. mem_alloc latency with 2^8 to 2^20 live blocks\n");
+        printf("  2. mem_free latency for the out-of-band and in-band layouts\n");
+        printf("  3. alloc/free scaling with and without per-thread caches\n");
+        printf("  4. node sized objects from mem_alloc and from a slab cache\n");
+        printf("  5. first-fit vs buddy layout\n");
+        printf("  6. producer/consumer with cross-thread frees\n");
+        printf("  7. out-of-band metadata bytes per block\n");
+        printf("  8. false sharing of per-thread counters\n");
+        printf("  9. single vs batch alloc and free\n");
+        printf("  10. growing and shrinking buffers with mem_resize\n");
+        printf("  11. mem_free latency percentiles with 10^3 to 10^6 live blocks\n");
+        printf("  12. pool startup and TLB misses by mapping, 64 MiB to 4 GiB\n");
+        printf("  13. RSS over time under bursts, fixed vs growing pool\n");
+        printf("  14. throughput and fragmentation per placement policy\n");
+        printf("  15. pool mutex contention from 1 to 128 threads (make lock_profile)\n");
+        printf("  16. mixed small and large blocks from 1 to 256 threads, one lock against regions\n");
+        printf("  17. short-lived threads, per-thread caches against per-CPU arenas\n");
+        printf("  18. heap profile overhead at different sampling rates\n");
+        printf("  19. production and debug builds against the plain library\n\n");
+        return 1;
+    }
+
+    int bench = atoi(argv[1]);
+
+    if (bench == 0 || bench == 1)
+        bench_alloc_latency_vs_live_blocks();
+    if (bench == 0 || bench == 2)
+        bench_free_latency_by_layout();
+    if (bench == 0 || bench == 3)
+        bench_thread_cache_scaling();
+    if (bench == 0 || bench == 4)
+        bench_slab_vs_mem_alloc();
+    if (bench == 0 || bench == 5)
+        bench_buddy_vs_first_fit();
+    if (bench == 0 || bench == 6)
+        bench_remote_free_pipeline();
+    if (bench == 0 || bench == 7)
+        bench_metadata_per_block();
+    if (bench == 0 || bench == 8)
+        bench_false_sharing();
+    if (bench == 0 || bench == 9)
+        bench_batch_alloc_free();
+    if (bench == 0 || bench == 10)
+        bench_resize_buffers();
+    if (bench == 0 || bench == 11)
+        bench_free_percentiles();
+    if (bench == 0 || bench == 12)
+        bench_pool_mapping();
+    if (bench == 0 || bench == 13)
+        bench_rss_over_time();
+    if (bench == 0 || bench == 14)
+        bench_placement_policies();
+    if (bench == 0 || bench == 15)
+        bench_lock_contention();
+    if (bench == 0 || bench == 16)
+        bench_region_locks();
+    if (bench == 0 || bench == 17)
+        bench_cpu_arenas();
+    if (bench == 0 || bench == 18)
+        bench_heap_profile_overhead();
+    if (bench == 0 || bench == 19)
+        bench_library_variants();
+
+    if (bench < 0 || bench > 19)
+        printf("Invalid benchmark\n");
+    return 0;
+}
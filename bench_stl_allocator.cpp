@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "memory_manager.hpp"
+#include "common_defs.h"
+
+#include "gitdata.h"
+
+// Pools grow on demand, so every count fits and the first touches are part of the inserts
+static const size_t pool_size = (size_t)64 << 20;
+static const unsigned int pool_flags = MEM_MMAP | MEM_GROW;
+
+// Current time in nanoseconds
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Keys 0..count-1 in random order, the same for every allocator
+static std::vector<int> shuffled(size_t count, unsigned int seed)
+{
+    std::vector<int> keys(count);
+    for (size_t i = 0; i < count; i++)
+        keys[i] = (int)i;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(seed));
+    return keys;
+}
+
+template <class T>
+using pool_list = std::list<T, mem::Allocator<T>>;
+template <class K, class V>
+using pool_map = std::map<K, V, std::less<K>, mem::Allocator<std::pair<const K, V>>>;
+template <class K, class V>
+using pool_unordered_map = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, mem::Allocator<std::pair<const K, V>>>;
+
+// Inserts the keys into container, then erases them in erase order, and prints the ns per operation
+template <class Container>
+static void time_map(const char *allocator, Container &container, const std::vector<int> &keys, const std::vector<int> &erase)
+{
+    uint64_t start = now_ns();
+    for (int key : keys)
+        container.emplace(key, key);
+    double insert_ns = (double)(now_ns() - start) / keys.size();
+
+    start = now_ns();
+    for (int key : erase)
+        container.erase(key);
+    double erase_ns = (double)(now_ns() - start) / erase.size();
+
+    printf("  %10zu %16s %14.1f %14.1f\n", keys.size(), allocator, insert_ns, erase_ns);
+}
+
+// The same for a list, elements are erased through their iterators so only the nodes are timed
+template <class List>
+static void time_list(const char *allocator, List &list, const std::vector<int> &keys, const std::vector<int> &erase)
+{
+    std::vector<typename List::iterator> nodes(keys.size());
+    uint64_t start = now_ns();
+    for (int key : keys)
+        nodes[key] = list.insert(list.end(), key);
+    double insert_ns = (double)(now_ns() - start) / keys.size();
+
+    start = now_ns();
+    for (int key : erase)
+        list.erase(nodes[key]);
+    double erase_ns = (double)(now_ns() - start) / erase.size();
+
+    printf("  %10zu %16s %14.1f %14.1f\n", keys.size(), allocator, insert_ns, erase_ns);
+}
+
+/*
+ * Inserts 2^12 to 2^20 ints at the end of a std::list and erases them in random order, with
+ * std::allocator, with mem::Allocator, whose nodes come from a slab cache picked at compile time,
+ * and with std::pmr::list on a mem::pool_resource, which picks the slab cache at run time.
+ */
+void bench_list()
+{
+    printf_yellow("  Benchmark \"std::list insert/erase\"\n");
+    printf("  %10s %16s %14s %14s\n", "elements", "allocator", "insert ns", "erase ns");
+
+    for (int shift = 12; shift <= 20; shift += 4)
+    {
+        std::vector<int> keys = shuffled((size_t)1 << shift, 1);
+        std::vector<int> erase = shuffled((size_t)1 << shift, 2);
+        {
+            std::list<int> list;
+            time_list("std::allocator", list, keys, erase);
+        }
+        {
+            mem::pool_resource pool(pool_size, pool_flags);
+            pool_list<int> list{mem::Allocator<int>(pool)};
+            time_list("mem::Allocator", list, keys, erase);
+        }
+        {
+            mem::pool_resource pool(pool_size, pool_flags);
+            std::pmr::list<int> list(&pool);
+            time_list("pool_resource", list, keys, erase);
+        }
+    }
+}
+
+/*
+ * Inserts 2^12 to 2^20 random int keys into a std::map and erases them in another random order,
+ * with the same three allocators as bench_list.
+ */
+void bench_map()
+{
+    printf_yellow("  Benchmark \"std::map insert/erase\"\n");
+    printf("  %10s %16s %14s %14s\n", "elements", "allocator", "insert ns", "erase ns");
+
+    for (int shift = 12; shift <= 20; shift += 4)
+    {
+        std::vector<int> keys = shuffled((size_t)1 << shift, 1);
+        std::vector<int> erase = shuffled((size_t)1 << shift, 2);
+        {
+            std::map<int, int> map;
+            time_map("std::allocator", map, keys, erase);
+        }
+        {
+            mem::pool_resource pool(pool_size, pool_flags);
+            pool_map<int, int> map{mem::Allocator<std::pair<const int, int>>(pool)};
+            time_map("mem::Allocator", map, keys, erase);
+        }
+        {
+            mem::pool_resource pool(pool_size, pool_flags);
+            std::pmr::map<int, int> map(&pool);
+            time_map("pool_resource", map, keys, erase);
+        }
+    }
+}
+
+/*
+ * Inserts 2^12 to 2^20 random int keys into a std::unordered_map and erases them in another
+ * random order. The nodes come from a slab cache, the bucket arrays, which outgrow the size
+ * classes as the map rehashes, straight from the pool.
+ */
+void bench_unordered_map()
+{
+    printf_yellow("  Benchmark \"std::unordered_map insert/erase\"\n");
+    printf("  %10s %16s %14s %14s\n", "elements", "allocator", "insert ns", "erase ns");
+
+    for (int shift = 12; shift <= 20; shift += 4)
+    {
+        std::vector<int> keys = shuffled((size_t)1 << shift, 1);
+        std::vector<int> erase = shuffled((size_t)1 << shift, 2);
+        {
+            std::unordered_map<int, int> map;
+            time_map("std::allocator", map, keys, erase);
+        }
+        {
+            mem::pool_resource pool(pool_size, pool_flags);
+            pool_unordered_map<int, int> map{mem::Allocator<std::pair<const int, int>>(pool)};
+            time_map("mem::Allocator", map, keys, erase);
+        }
+        {
+            mem::pool_resource pool(pool_size, pool_flags);
+            std::pmr::unordered_map<int, int> map(&pool);
+            time_map("pool_resource", map, keys, erase);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+#ifdef VERSION
+    printf("Build Version; %s \n", VERSION);
+#endif
+    printf("Git Version; %s/%s \n", git_date, git_sha);
+
+    if (argc < 2)
+    {
+        printf("Usage: %s <benchmark>\n", argv[0]);
+        printf("Available benchmarks:\n");
+
+        printf("  0. runs all benchmarks\n");
+        printf("  1. std::list insert/erase, std::allocator vs the pool\n");
+        printf("  2. std::map insert/erase, std::allocator vs the pool\n");
+        printf("  3. std::unordered_map insert/erase, std::allocator vs the pool\n\n");
+        return 1;
+    }
+
+    int bench = atoi(argv[1]);
+
+    if (bench == 0 || bench == 1)
+        bench_list();
+    if (bench == 0 || bench == 2)
+        bench_map();
+    if (bench == 0 || bench == 3)
+        bench_unordered_map();
+
+    if (bench < 0 || bench > 3)
+        printf("Invalid benchmark\n");
+    return 0;
+}
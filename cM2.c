@@ -1,9 +1,16 @@
 #define _GNU_SOURCE
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "cm2_trace.h"
 
 char tmpbuff[1024];
 unsigned long tmppos = 0;
@@ -12,6 +19,47 @@ unsigned long tmpallocs = 0;
 void *memset(void*,int,size_t);
 void *memmove(void *to, const void *from, size_t size);
 
+/*=========================================================
+ * tracing
+ *
+ * Every call is logged as a binary trace_record (cm2_trace.h) into a ring
+ * of the calling thread. Only the owner thread writes records and they are
+ * only taken out under flush_mutex, so a record is a few stores and no lock.
+ * The flusher drains all rings every FLUSH_MS into one large buffer and
+ * writes it to the trace file, $CM2_TRACE or cm2.trace. A thread whose ring
+ * is full flushes it itself, or with CM2_TRACE_LOSSY set drops the record
+ * and counts it, which the flusher logs as a TRACE_LOST record. Rings of
+ * exited threads are reused once drained. Decode the file with cm2_decode.
+ */
+
+#define RING_RECORDS 8192        // Per thread, a power of two
+#define FLUSH_MS 10
+#define FLUSH_RECORDS 32768      // Records per write
+
+typedef struct trace_ring {
+  trace_record records[RING_RECORDS];
+  uint64_t head __attribute__((aligned(64))); // Next record to write, owner only
+  uint64_t lost;                              // Records dropped, owner only
+  uint64_t tail __attribute__((aligned(64))); // Next record to flush, under flush_mutex
+  uint64_t lost_flushed;
+  uint32_t thread_id;
+  int released;                               // Set when the owner exited
+  struct trace_ring *next;
+} trace_ring;
+
+static int trace_fd = -1;
+static int tracing = 0;
+static int lossy = 0;                         // Drop records rather than flush on a full ring
+static trace_ring *rings = NULL;              // Every ring ever made, pushed with CAS
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_record *flush_buffer;
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static __thread trace_ring *my_ring;
+static __thread int in_tracer;                // Calls made by the tracer itself aren't traced
+static __thread int ring_released;            // The exiting thread gave its ring back, stop tracing it
+
 /*=========================================================
  * interception points
  */
@@ -24,6 +72,7 @@ static void * (*myfn_memalign)(size_t blocksize, size_t bytes);
 static void * (*myfn_mmap)(void *ptr,  size_t length, int prot, int flags, int fd, off_t offset);
 static int (*myfn_munmap)(void *ptr, size_t length);
 
+static void trace_open();
 
 static void init(){
   myfn_malloc     = dlsym(RTLD_NEXT, "malloc");
@@ -33,14 +82,180 @@ static void init(){
   myfn_memalign   = dlsym(RTLD_NEXT, "memalign");
   myfn_mmap       = dlsym(RTLD_NEXT, "mmap");
   myfn_munmap     = dlsym(RTLD_NEXT, "munmap");
-  
-  if (!myfn_malloc || !myfn_free || !myfn_calloc || !myfn_realloc || !myfn_memalign || !myfn_mmap || !myfn_munmap ) 
+
+  if (!myfn_malloc || !myfn_free || !myfn_calloc || !myfn_realloc || !myfn_memalign || !myfn_mmap || !myfn_munmap )
     {
       fprintf(stderr, "Error in `dlsym`: %s\n", dlerror());
       exit(1);
     }
+  trace_open();
+}
+
+/*=========================================================
+ * trace file and flusher
+ */
+
+static void trace_open(){
+  const char *path = getenv("CM2_TRACE");
+  trace_fd = open(path != NULL ? path : "cm2.trace", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  flush_buffer = myfn_mmap(NULL, FLUSH_RECORDS * sizeof(trace_record), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (trace_fd < 0 || flush_buffer == MAP_FAILED) {
+    fprintf(stderr, "cM2: can't open the trace file, not tracing\n");
+    return;
+  }
+  trace_header header = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record)};
+  if (write(trace_fd, &header, sizeof(header)) != sizeof(header))
+    return;
+  lossy = getenv("CM2_TRACE_LOSSY") != NULL;
+  tracing = 1;
+}
+
+static uint64_t trace_now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+static void flush_write(size_t count){
+  const char *data = (const char *)flush_buffer;
+  size_t left = count * sizeof(trace_record);
+  while (left > 0) {
+    ssize_t written = write(trace_fd, data, left);
+    if (written <= 0)
+      return;
+    data += written;
+    left -= written;
+  }
+}
+
+// Move the records of a ring to the flush buffer, writing it out whenever
+// it fills up. The caller holds flush_mutex.
+static size_t drain_ring(trace_ring *ring, size_t count){
+  uint64_t lost = __atomic_load_n(&ring->lost, __ATOMIC_RELAXED);
+  if (lost != ring->lost_flushed) {
+    flush_buffer[count++] = (trace_record){trace_now(), 0, 0, lost - ring->lost_flushed, ring->thread_id, TRACE_LOST};
+    ring->lost_flushed = lost;
+  }
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  for (uint64_t tail = ring->tail; tail != head; tail++) {
+    if (count == FLUSH_RECORDS) {
+      flush_write(count);
+      count = 0;
+    }
+    flush_buffer[count++] = ring->records[tail & (RING_RECORDS - 1)];
+  }
+  __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+// Move everything recorded so far, or only what ring holds, to the trace file
+static void flush_rings(trace_ring *only){
+  size_t count = 0;
+  pthread_mutex_lock(&flush_mutex);
+  for (trace_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+    if (only == NULL || ring == only)
+      count = drain_ring(ring, count);
+  }
+  flush_write(count);
+  pthread_mutex_unlock(&flush_mutex);
+}
+
+static void *flusher(void *arg){
+  (void)arg;
+  in_tracer = 1;
+  struct timespec interval = {0, FLUSH_MS * 1000000};
+  for (;;) {
+    nanosleep(&interval, NULL);
+    flush_rings(NULL);
+  }
+  return NULL;
+}
+
+// The child of a fork would write into the parent's trace
+static void stop_in_child(){
+  tracing = 0;
+}
+
+// Frees in later destructors and the libc teardown of the thread go untraced,
+// another thread may take the ring over as soon as the flusher drained it
+static void release_ring(void *ring){
+  ring_released = 1;
+  my_ring = NULL;
+  __atomic_store_n(&((trace_ring *)ring)->released, 1, __ATOMIC_RELEASE);
+}
+
+static void start_flusher(){
+  pthread_t thread;
+  pthread_key_create(&ring_key, release_ring);
+  pthread_atfork(NULL, NULL, stop_in_child);
+  pthread_create(&thread, NULL, flusher, NULL);
+  pthread_detach(thread);
+}
+
+__attribute__((destructor)) static void trace_close(){
+  if (tracing) {
+    in_tracer = 1;
+    flush_rings(NULL);
+  }
+}
+
+// Give the thread a ring, a drained one of an exited thread or a new one
+static trace_ring *ring_attach(){
+  in_tracer = 1;
+  pthread_once(&flusher_once, start_flusher);
+
+  trace_ring *ring;
+  for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+    int released = 1;
+    if (__atomic_load_n(&ring->released, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head &&
+        __atomic_compare_exchange_n(&ring->released, &released, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  if (ring == NULL) {
+    ring = myfn_mmap(NULL, sizeof(trace_ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+      in_tracer = 0;
+      return NULL;
+    }
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  ring->thread_id = syscall(SYS_gettid);
+  pthread_setspecific(ring_key, ring);
+  my_ring = ring;
+  in_tracer = 0;
+  return ring;
+}
+
+static void trace(uint32_t op, void *address, uint64_t arg, uint64_t size){
+  if (!tracing || in_tracer || ring_released)
+    return;
+  trace_ring *ring = my_ring != NULL ? my_ring : ring_attach();
+  if (ring == NULL)
+    return;
+
+  uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_RECORDS) {
+    if (lossy) {
+      __atomic_store_n(&ring->lost, ring->lost + 1, __ATOMIC_RELAXED);
+      return;
+    }
+    in_tracer = 1;
+    flush_rings(ring);
+    in_tracer = 0;
+  }
+  ring->records[head & (RING_RECORDS - 1)] =
+    (trace_record){trace_now(), (uintptr_t)address, arg, size, ring->thread_id, op};
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*=========================================================
+ * interposed functions
+ */
+
 void *malloc(size_t size){
 
   static int initializing = 0;
@@ -49,8 +264,6 @@ void *malloc(size_t size){
       initializing = 1;
       init();
       initializing = 0;
-      fprintf(stdout, "rMALLOC(%lu)\n", size);      
-      fprintf(stdout, "jcheck: allocated %lu bytes of temp memory in %lu chunks during initialization\n", tmppos, tmpallocs);
     }
     else {
       if (tmppos + size < sizeof(tmpbuff)) {
@@ -60,16 +273,14 @@ void *malloc(size_t size){
 	return retptr;
       }
       else {
-	fprintf(stdout, "jcheck: too much memory requested during initialisation - increase tmpbuff size\n");
+	fprintf(stderr, "jcheck: too much memory requested during initialisation - increase tmpbuff size\n");
 	exit(1);
       }
     }
   }
 
   void *ptr = myfn_malloc(size);
-  char buffer[50];
-  int len=sprintf(buffer,"rMALLOc (%ld) at %p\n",size,ptr);
-  write(1,buffer,len);
+  trace(TRACE_MALLOC, ptr, 0, size);
   return ptr;
 }
 
@@ -77,22 +288,17 @@ void free(void *ptr){
   // something wrong if we call free before one of the allocators!
   //  if (myfn_malloc == NULL)
   //      init();
-  
-  if (ptr >= (void*) tmpbuff && ptr <= (void*)(tmpbuff + tmppos))
-    fprintf(stdout, "freeing temp memory\n");
-  else
-    myfn_free(ptr);
 
-  char buffer[50];
-  int len=sprintf(buffer,"rFREE at %p\n",ptr);
-  write(1,buffer,len);
+  if (ptr >= (void*) tmpbuff && ptr <= (void*)(tmpbuff + tmppos))
+    return; // temp memory from initialisation
+  // Recorded first, once freed another thread may get the block and record it
+  if (ptr != NULL)
+    trace(TRACE_FREE, ptr, 0, 0);
+  myfn_free(ptr);
 }
 
 void *realloc(void *ptr, size_t size)
 {
-  char buffer[70];
-  int len=sprintf(buffer,"rREALLOC-> (%ld) at %p \n",size,ptr);
-  write(1,buffer,len);
     if (myfn_malloc == NULL)
     {
         void *nptr = malloc(size);
@@ -104,11 +310,12 @@ void *realloc(void *ptr, size_t size)
         return nptr;
     }
 
+    // The old block may be given up as soon as the call starts, the new one is
+    // only known when it returns
+    if (ptr != NULL)
+        trace(TRACE_REALLOC_START, ptr, 0, size);
     void *nptr = myfn_realloc(ptr, size);
-
-
-    len=sprintf(buffer,"rREALLOC (%ld) at %p -> %p\n",size,ptr,nptr);
-    write(1,buffer,len);
+    trace(TRACE_REALLOC, nptr, (uintptr_t)ptr, size);
     return nptr;
 }
 
@@ -123,22 +330,17 @@ void *calloc(size_t nmemb, size_t size)
     }
 
     void *ptr = myfn_calloc(nmemb, size);
-
-    char buffer[70];
-    int len=sprintf(buffer,"rCALLOC (%ld,%ld) \n",nmemb, size);
-    write(1,buffer,len);
-    
+    trace(TRACE_CALLOC, ptr, nmemb, nmemb * size);
     return ptr;
 }
 
 void *memalign(size_t blocksize, size_t bytes)
 {
-    void *ptr = myfn_memalign(blocksize, bytes);
+    if (myfn_memalign == NULL)
+        init();
 
-    char buffer[70];
-    int len=sprintf(buffer,"rMEMALING (%ld, %ld) @ %p\n",blocksize, bytes,ptr);
-    write(1,buffer,len);
-    
+    void *ptr = myfn_memalign(blocksize, bytes);
+    trace(TRACE_MEMALIGN, ptr, blocksize, bytes);
     return ptr;
 }
 
@@ -150,8 +352,6 @@ void *mmap(void *ptr,  size_t length, int prot, int flags, int fd, off_t offset)
       initializing = 1;
       init();
       initializing = 0;
-      fprintf(stdout, "rMMAP(%lu)\n", length);      
-      fprintf(stdout, "jcheck: allocated %lu bytes of temp memory in %lu chunks during initialization\n", tmppos, tmpallocs);
     }
     else {
      if (tmppos + length < sizeof(tmpbuff)) {
@@ -161,30 +361,21 @@ void *mmap(void *ptr,  size_t length, int prot, int flags, int fd, off_t offset)
 	return retptr;
       }
       else {
-	fprintf(stdout, "jcheck: too much memory requested during initialisation - increase tmpbuff size\n");
+	fprintf(stderr, "jcheck: too much memory requested during initialisation - increase tmpbuff size\n");
 	exit(1);
       }
     }
   }
   void *ptr2 = myfn_mmap(ptr, length, prot, flags, fd, offset);
-    
-  char buffer[70];
-  int len=sprintf(buffer,"rMMAP (%ld) at %p\n", length, ptr2);
-  write(1,buffer,len);
-  
+  trace(TRACE_MMAP, ptr2, 0, length);
   return ptr2;
 }
 
 
 int munmap(void *ptr, size_t length){
-  char buffer[70];
-  int len=sprintf(buffer,"rMUNMMAP-> (%p,%ld) => \n",ptr, length);
-  write(1,buffer,len);
-  
-  int resp=myfn_munmap(ptr, length);
-
-  len=sprintf(buffer,"rMUNMMAP (%p,%ld) => %d\n",ptr, length, resp);
-  write(1,buffer,len);
+  if (myfn_munmap == NULL)
+    init();
 
-  return resp;
+  trace(TRACE_MUNMAP, ptr, 0, length);
+  return myfn_munmap(ptr, length);
 }
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cm2_trace.h"
+
+// Turns a binary trace of the cM2.c interposer into text or CSV:
+//
+//   cm2_decode [-c] [-s] trace_file
+//
+// -c writes CSV, -s sorts the records of all threads by time instead of
+// keeping the order they were flushed in.
+
+static const char *op_names[TRACE_OPS] = {
+    "?", "malloc", "free", "calloc", "realloc", "memalign", "mmap", "munmap", "lost", "realloc_start"
+};
+
+static void print_text(const trace_record *r) {
+    printf("%llu.%09llu [%u] ", (unsigned long long)(r->time_ns / 1000000000),
+           (unsigned long long)(r->time_ns % 1000000000), r->thread_id);
+    unsigned long long address = r->address, arg = r->arg, size = r->size;
+    switch (r->op) {
+    case TRACE_MALLOC:
+    case TRACE_MMAP:
+        printf("%s(%llu) = 0x%llx\n", op_names[r->op], size, address);
+        break;
+    case TRACE_FREE:
+        printf("free(0x%llx)\n", address);
+        break;
+    case TRACE_CALLOC:
+        printf("calloc(%llu, %llu) = 0x%llx\n", arg, arg > 0 ? size / arg : 0, address);
+        break;
+    case TRACE_REALLOC:
+        printf("realloc(0x%llx, %llu) = 0x%llx\n", arg, size, address);
+        break;
+    case TRACE_MEMALIGN:
+        printf("memalign(%llu, %llu) = 0x%llx\n", arg, size, address);
+        break;
+    case TRACE_MUNMAP:
+        printf("munmap(0x%llx, %llu)\n", address, size);
+        break;
+    case TRACE_LOST:
+        printf("lost %llu records\n", size);
+        break;
+    case TRACE_REALLOC_START:
+        printf("realloc(0x%llx, %llu) starts\n", address, size);
+        break;
+    default:
+        printf("unknown op %u\n", r->op);
+    }
+}
+
+static void print_csv(const trace_record *r) {
+    printf("%llu,%u,%s,0x%llx,%llu,%llu\n", (unsigned long long)r->time_ns, r->thread_id,
+           r->op < TRACE_OPS ? op_names[r->op] : "?", (unsigned long long)r->address,
+           (unsigned long long)r->arg, (unsigned long long)r->size);
+}
+
+static int compare_time(const void *a, const void *b) {
+    const trace_record *x = a, *y = b;
+    return x->time_ns < y->time_ns ? -1 : x->time_ns > y->time_ns;
+}
+
+int main(int argc, char *argv[]) {
+    int csv = 0, sorted = 0, option;
+    while ((option = getopt(argc, argv, "cs")) != -1) {
+        if (option == 'c') {
+            csv = 1;
+        } else if (option == 's') {
+            sorted = 1;
+        } else {
+            optind = argc;  // Print the usage
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-c] [-s] trace_file\n", argv[0]);
+        return 2;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, 8) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(trace_record)) {
+        fprintf(stderr, "%s: not a version %d cM2 trace\n", argv[optind], TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    if (csv) {
+        printf("time_ns,thread,op,address,arg,size\n");
+    }
+    void (*print)(const trace_record *) = csv ? print_csv : print_text;
+
+    // Unsorted traces are streamed, sorted ones read whole
+    size_t count = 0, capacity = sorted ? 65536 : 4096;
+    trace_record *records = malloc(capacity * sizeof(trace_record));
+    size_t read;
+    while (records != NULL && (read = fread(records + count, sizeof(trace_record), capacity - count, file)) > 0) {
+        if (!sorted) {
+            for (size_t i = 0; i < read; i++) {
+                print(&records[i]);
+            }
+            continue;
+        }
+        count += read;
+        if (count == capacity) {
+            capacity *= 2;
+            trace_record *grown = realloc(records, capacity * sizeof(trace_record));
+            if (grown == NULL) {
+                free(records);
+            }
+            records = grown;
+        }
+    }
+    fclose(file);
+    if (records == NULL) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    qsort(records, count, sizeof(trace_record), compare_time);
+    for (size_t i = 0; i < count; i++) {
+        print(&records[i]);
+    }
+    free(records);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef cm2_trace_h
+#define cm2_trace_h
+
+#include <stdint.h>
+
+// Binary trace written by the cM2.c interposer (libmymalloc.so): a header,
+// then fixed size records. Records of one thread are in the order they were
+// made, records of different threads are interleaved in flush order.
+//
+// Blocks are given up before they are recorded as taken by another thread:
+// a free or munmap is recorded before the memory goes back, and a realloc of a
+// block writes TRACE_REALLOC_START before the call and TRACE_REALLOC once it
+// returns.
+
+#define TRACE_MAGIC "CM2TRACE"
+#define TRACE_VERSION 2
+
+typedef struct trace_header {
+    char magic[8];             // TRACE_MAGIC, not terminated
+    uint32_t version;          // TRACE_VERSION
+    uint32_t record_size;      // sizeof(trace_record)
+} trace_header;
+
+// Operations, the meaning of arg depends on them
+enum {
+    TRACE_MALLOC = 1,
+    TRACE_FREE,                // address is the block freed
+    TRACE_CALLOC,              // arg is the element count, size the total
+    TRACE_REALLOC,             // arg is the block passed in
+    TRACE_MEMALIGN,            // arg is the alignment
+    TRACE_MMAP,
+    TRACE_MUNMAP,              // address is the range unmapped
+    TRACE_LOST,                // size records of the thread were dropped, its buffer was full
+    TRACE_REALLOC_START,       // address is the block passed to realloc, size the bytes asked for
+    TRACE_OPS
+};
+
+typedef struct trace_record {
+    uint64_t time_ns;          // CLOCK_MONOTONIC
+    uint64_t address;          // Block returned, or the one given back
+    uint64_t arg;
+    uint64_t size;             // Bytes asked for
+    uint32_t thread_id;        // Kernel thread id
+    uint32_t op;
+} trace_record;
+
+#endif // cm2_trace_h
@@ -6,6 +6,8 @@
 #include <pthread.h>
 
 static pthread_mutex_t memory_mutex;
+static mem_pool *list_pool = NULL;        // The list's own pool, other users of the allocator are left alone
+static mem_slab_cache *node_cache = NULL; // Nodes are carved out of slabs in the pool
 
 typedef unsigned int uint16_t;
 
@@ -16,8 +18,9 @@ typedef struct Node {
 
 void list_init(Node** list_head, size_t size) {
     pthread_mutex_lock(&memory_mutex);
-    // Initialize memory for the list using mem_init
-    mem_init(size+sizeof(Node));
+    // Initialize memory for the list in a pool of its own
+    list_pool = mem_pool_create(size+sizeof(Node), MEM_OUT_OF_BAND);
+    node_cache = mem_slab_create_in(list_pool, sizeof(Node));
 
     *list_head = NULL;
 
@@ -29,7 +32,7 @@ void list_init(Node** list_head, size_t size) {
 void list_insert(Node** list_head, uint16_t data) {
     pthread_mutex_lock(&memory_mutex);
     // Allocate memory for the new node using mem_alloc
-    Node* new_node = (Node*) mem_alloc(sizeof(Node));
+    Node* new_node = (Node*) mem_slab_alloc(node_cache);
     
     if (new_node == NULL) {
         //debug
@@ -76,7 +79,7 @@ void list_insert_after(Node* prev_node, uint16_t data) {
     }
 
     // Allocate memory for the new node
-    Node* new_node = (Node*) mem_alloc(sizeof(Node));
+    Node* new_node = (Node*) mem_slab_alloc(node_cache);
 
     if (new_node == NULL) {
         //debug
@@ -107,7 +110,7 @@ void list_insert_before(Node** list_head, Node* next_node, uint16_t data) {
     }
 
     // Allocate memory for the new node
-    Node* new_node = (Node*) mem_alloc(sizeof(Node));
+    Node* new_node = (Node*) mem_slab_alloc(node_cache);
 
     if (new_node == NULL) {
         //debug
@@ -176,8 +179,8 @@ void list_delete(Node** list_head, uint16_t data) {
         prev->next = current->next;  
     }
 
-    // Free the memory of the deleted node using mem_free
-    mem_free(current);
+    // Give the memory of the deleted node back to the slab cache
+    mem_slab_free(node_cache, current);
     //debug
     // printf("Node with data %u deleted.\n", data);
     pthread_mutex_unlock(&memory_mutex);
@@ -303,7 +306,10 @@ int list_count_nodes(Node** list_head) {
 
 void list_cleanup(Node** list_head) {
     pthread_mutex_lock(&memory_mutex);
-    mem_deinit();
+    mem_slab_destroy(node_cache);
+    node_cache = NULL;
+    mem_pool_destroy(list_pool);
+    list_pool = NULL;
     // Set head to NULL after all nodes are freed
     *list_head = NULL;
     //debug
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "memory_manager.h"
+
+// Slabs are taken from the pool in MEM_SLAB_SIZE pieces, or smaller ones
+// when the pool has no room left for a full slab
+#define MEM_SLAB_SIZE 4096
+// Slab start, objects keep it when their size is a multiple of it
+#define MEM_SLAB_ALIGN 16
+
+// Threads are told apart by a number taken on first use. Unlike a pthread_t it
+// is never reused, so a thread started after the owner exited is not the owner.
+static unsigned long last_thread_token = 0;
+static __thread unsigned long thread_token = 0;
+
+static unsigned long slab_thread_token() {
+    if (thread_token == 0) {
+        thread_token = __atomic_add_fetch(&last_thread_token, 1, __ATOMIC_RELAXED);
+    }
+    return thread_token;
+}
+
+struct mem_slab_cache {
+    pthread_mutex_t mutex;
+    mem_pool *pool;     // Pool the slabs come from, NULL for the default pool
+    size_t object_size;
+    unsigned long owner; // Token of the thread that created the cache
+    void *free_objects; // Freed objects linked through their first word
+    void *remote_free;  // Objects freed by other threads, pushed without the mutex
+    char *unused;       // Part of the newest slab that was never handed out
+    char *unused_end;
+    void **slabs;       // Every slab taken from the pool, given back on destroy
+    size_t num_slabs;
+    size_t max_slabs;
+};
+
+// Create a cache handing out objects of object_size bytes from the default pool
+mem_slab_cache *mem_slab_create(size_t object_size) {
+    return mem_slab_create_in(NULL, object_size);
+}
+
+// Create a cache handing out objects of object_size bytes from pool
+mem_slab_cache *mem_slab_create_in(mem_pool *pool, size_t object_size) {
+    if (object_size == 0) {
+        return NULL;
+    }
+
+    mem_slab_cache *cache = calloc(1, sizeof(mem_slab_cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    // Objects hold the freelist link while they are free and stay pointer aligned
+    if (object_size < sizeof(void*)) {
+        object_size = sizeof(void*);
+    }
+    cache->pool = pool;
+    cache->owner = slab_thread_token();
+    cache->object_size = (object_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    pthread_mutex_init(&cache->mutex, NULL);
+    return cache;
+}
+
+static void *slab_pool_alloc(mem_slab_cache *cache, size_t size) {
+    return cache->pool != NULL ? mem_pool_alloc_aligned(cache->pool, size, MEM_SLAB_ALIGN)
+                               : mem_alloc_aligned(size, MEM_SLAB_ALIGN);
+}
+
+// Take a new slab from the pool, the caller holds the cache mutex
+static bool slab_grow(mem_slab_cache *cache) {
+    if (cache->num_slabs == cache->max_slabs) {
+        size_t max_slabs = cache->max_slabs > 0 ? cache->max_slabs * 2 : 16;
+        void **slabs = realloc(cache->slabs, max_slabs * sizeof(void*));
+        if (slabs == NULL) {
+            return false;
+        }
+        cache->slabs = slabs;
+        cache->max_slabs = max_slabs;
+    }
+
+    // Largest multiple of the object size that fits a slab, halved until the pool can provide it
+    size_t object_size = cache->object_size;
+    size_t slab_size = MEM_SLAB_SIZE > object_size ? MEM_SLAB_SIZE - MEM_SLAB_SIZE % object_size : object_size;
+    char *slab = slab_pool_alloc(cache, slab_size);
+    while (slab == NULL && slab_size > object_size) {
+        slab_size = (slab_size / 2) - (slab_size / 2) % object_size;
+        if (slab_size < object_size) {
+            slab_size = object_size;
+        }
+        slab = slab_pool_alloc(cache, slab_size);
+    }
+    if (slab == NULL) {
+        return false;
+    }
+
+    cache->slabs[cache->num_slabs++] = slab;
+    cache->unused = slab;
+    cache->unused_end = slab + slab_size;
+    return true;
+}
+
+// Allocate one object from the cache
+void *mem_slab_alloc(mem_slab_cache *cache) {
+    pthread_mutex_lock(&cache->mutex);
+
+    // Reuse a freed object first
+    void **object = cache->free_objects;
+    if (object != NULL) {
+        cache->free_objects = *object;
+        pthread_mutex_unlock(&cache->mutex);
+        return object;
+    }
+
+    // Take everything other threads have freed in one go
+    object = __atomic_exchange_n(&cache->remote_free, NULL, __ATOMIC_ACQUIRE);
+    if (object != NULL) {
+        cache->free_objects = *object;
+        pthread_mutex_unlock(&cache->mutex);
+        return object;
+    }
+
+    if (cache->unused == cache->unused_end && !slab_grow(cache)) {
+        pthread_mutex_unlock(&cache->mutex);
+        return NULL;  // Pool is full
+    }
+
+    object = (void**)cache->unused;
+    cache->unused += cache->object_size;
+    pthread_mutex_unlock(&cache->mutex);
+    return object;
+}
+
+// Give an object back to the cache
+void mem_slab_free(mem_slab_cache *cache, void *object) {
+    if (object == NULL) {
+        return;
+    }
+
+    // Other threads push onto the remote stack, the next allocation that finds the
+    // freelist empty takes all of it under the mutex, whichever thread makes it.
+    // Only the whole stack is ever taken off, so the push can't suffer from ABA.
+    if (cache->owner != slab_thread_token()) {
+        void *head = __atomic_load_n(&cache->remote_free, __ATOMIC_RELAXED);
+        do {
+            *(void**)object = head;
+        } while (!__atomic_compare_exchange_n(&cache->remote_free, &head, object, true,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        return;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    *(void**)object = cache->free_objects;
+    cache->free_objects = object;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+// Give every slab back to the pool and delete the cache
+void mem_slab_destroy(mem_slab_cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < cache->num_slabs; i++) {
+        if (cache->pool != NULL) {
+            mem_pool_free(cache->pool, cache->slabs[i]);
+        } else {
+            mem_free(cache->slabs[i]);
+        }
+    }
+    free(cache->slabs);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
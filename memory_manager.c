@@ -1,208 +1,3215 @@
+#define _GNU_SOURCE // For mremap and sched_getcpu
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
+#include "memory_manager.h"
 
-static pthread_mutex_t memory_mutex; // 
+// Free blocks are kept in segregated lists by size class. Sizes below
+// MIN_CLASS_SIZE get a class each, every power of two above that is split
+// into CLASS_SUBDIVISIONS equally wide classes.
+#define MIN_CLASS_SHIFT 4
+#define MIN_CLASS_SIZE (1 << MIN_CLASS_SHIFT)
+#define CLASS_SUBDIVISION_BITS 2
+#define CLASS_SUBDIVISIONS (1 << CLASS_SUBDIVISION_BITS)
+#define NUM_CLASSES (MIN_CLASS_SIZE + (64 - MIN_CLASS_SHIFT) * CLASS_SUBDIVISIONS)
+#define CLASS_WORDS ((NUM_CLASSES + 63) / 64)
 
-typedef struct mem_struct {
-    struct mem_struct *next;
-    bool available;
-    size_t size;
-    void *memaddress;
-} mem_struct;
+// Out-of-band metadata lives in one mmap'd array per pool that grows with
+// mremap, so no libc allocation happens after the pool is set up. Entries
+// link each other by index, entries not in use are chained through next_free.
+#define NO_BLOCK UINT_MAX
+#define BLOCKS_MIN_BYTES 4096
 
-static void *memorypool = NULL; // Pool for actual memory
-static mem_struct *head = NULL; // Pool for block metadata
+// Used out-of-band blocks are found from their address through an open
+// addressing hash table, mmap'd the same way. Free blocks merge with their
+// neighbours through the next/prev links, so mem_free is constant time.
+#define HASH_MIN_SLOTS 512
 
-// Initialize the memory manager
-void mem_init(size_t size) {
-    pthread_mutex_lock(&memory_mutex);
+typedef struct block_slot {
+    void *address;      // NULL for an empty slot
+    unsigned int index;
+} block_slot;
+
+// MEM_LAZY_COALESCE pools leave freed blocks unmerged and coalesce the whole
+// pool once the unmerged frees exceed LAZY_PERCENT of all blocks, or when an
+// allocation doesn't fit
+#define LAZY_MIN_FREES 64
+#define LAZY_PERCENT 25
+
+// Pool memory starts on a page boundary, which bounds the alignments buddy
+// pools can provide
+#define POOL_ALIGN 4096
+
+// Huge page pools (MEM_HUGE_PAGES, MEM_HUGETLB) are mapped in whole huge
+// pages starting on a huge page boundary, THP only backs aligned ranges
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define MEM_MAP_FLAGS (MEM_MMAP | MEM_HUGE_PAGES | MEM_HUGETLB | MEM_POPULATE)
+
+// Growing pools (MEM_GROW) map further chunks, each at least as large as all
+// chunks before it, so a handful covers any size. Every chunk has its own
+// list of out-of-band blocks, blocks never merge across chunks.
+#define POOL_MAX_CHUNKS 48
+
+typedef struct pool_chunk {
+    char *memory;
+    size_t size;                       // Usable bytes
+    size_t mapped;                     // Bytes mapped, 0 when the chunk came from the heap
+    unsigned int head;                 // First out-of-band block of the chunk
+} pool_chunk;
+
+// MEM_REGIONS pools split their memory into POOL_REGIONS equally sized
+// regions on page boundaries. Every region is an out-of-band pool of its own,
+// blocks never span two regions, so an operation only takes the lock of the
+// region its block lies in and never holds two region locks at once.
+#define POOL_REGIONS 8
+
+// MEM_CPU_ARENAS pools have a region per configured CPU instead, at most
+// POOL_MAX_ARENAS. Threads on CPUs beyond that share regions.
+#define POOL_MAX_ARENAS 64
+
+// Free out-of-band blocks count the release passes they stay free for. After
+// the second their whole pages go back to the kernel and they are marked
+// released until they are linked free again.
+#define IDLE_RELEASED 2
+
+// Operation counters are kept per thread and pool and only summed up by
+// mem_stats, so counting is a plain increment of memory no other thread
+// writes. A thread counts for up to STATS_POOLS pools at a time, the counts
+// of a pool it drops or of a thread that exits are folded into the pool.
+#define STATS_POOLS 4
+enum { STAT_ALLOCS, STAT_FREES, STAT_RESIZES, STAT_FAILURES, STAT_COUNTERS };
+
+// In-band layout (MEM_IN_BAND): every block starts with a tag holding the
+// block size, header included, and the TAG_USED/TAG_PREV_USED bits. Free
+// blocks keep their size class links in the payload and repeat the size in
+// a footer, so a block and its neighbours are found by pointer arithmetic.
+#define TAG_SIZE sizeof(size_t)
+#define TAG_ALIGN 16
+#define TAG_USED 0x1
+#define TAG_PREV_USED 0x2
+#define TAG_FLAGS ((size_t)(TAG_USED | TAG_PREV_USED))
+#define TAG_MIN_BLOCK 32
+
+typedef struct tag_block {
+    size_t tag;
+    struct tag_block *next_free; // Only valid while the block is free
+    struct tag_block *prev_free;
+} tag_block;
+
+// Buddy layout (MEM_BUDDY): the pool is a binary tree of power-of-two
+// blocks. Two bitmaps over the tree nodes tell which blocks are split and
+// which are free, free blocks are linked per order through their memory.
+// The buddy of a block is found by flipping its size bit in the offset.
+#define BUDDY_MIN_SHIFT 4
+#define BUDDY_MIN_BLOCK ((size_t)1 << BUDDY_MIN_SHIFT)
+#define BUDDY_MAX_ORDERS 64
+
+typedef struct buddy_block {
+    struct buddy_block *next;
+    struct buddy_block *prev;
+} buddy_block;
+
+// Everything a pool owns, the mem_* functions use default_pool
+struct mem_pool {
+    pthread_mutex_t mutex;
+    void *memorypool;                  // Pool for actual memory
+    unsigned int flags;                // Flags given at creation
+    size_t min_align;                  // Every block handed out is aligned to this
+    unsigned long id;                  // Never reused, tells thread caches of different pools apart
+    struct mem_pool *next_pool;        // Next live pool
+
+    // Out-of-band layout
+    mem_struct *blocks;                // Block metadata, may move when it grows
+    unsigned int max_blocks;           // Entries mapped
+    unsigned int num_blocks;           // Entries ever handed out
+    unsigned int unused_blocks;        // Entries given back, linked through next_free
+    unsigned int live_blocks;          // Entries in use
+    unsigned int unmerged;             // Frees not coalesced yet, MEM_LAZY_COALESCE only
+    block_slot *hash;                  // Used blocks by address
+    size_t hash_slots;                 // Power of two
+    size_t hash_used;
+    pool_chunk chunks[POOL_MAX_CHUNKS]; // The first holds memorypool
+    int num_chunks;
+    unsigned int rover;                // Block the last next-fit search stopped at
+    int rover_chunk;                   // Chunk of the rover
+    struct mem_pool *regions;          // MEM_REGIONS only, the pool itself keeps no blocks
+    int num_regions;
+    size_t region_size;                // Bytes per region, the last one takes the rest
+    size_t used_bytes;                 // Bytes in used blocks
+    size_t used_blocks;
+    size_t peak_bytes;                 // Highest used_bytes so far
+    unsigned long retired[STAT_COUNTERS]; // Counts folded in from threads, under stats_mutex
+#ifdef MEM_LOCK_PROFILE
+    mem_lock_stats lock_stats;         // Updated while holding the mutex
+    uint64_t lock_since;               // When it was taken, in ns
+#endif
+    unsigned int release_ms;           // Delay before free pages are released, 0 for never
+    uint64_t next_release;             // Time of the next release pass in ms, under pools_mutex
+    unsigned int free_lists[NUM_CLASSES]; // Free blocks per size class
+    uint64_t class_bitmap[CLASS_WORDS];  // Bit set for every non-empty size class
+
+    // In-band layout, shares class_bitmap
+    tag_block *tag_lists[NUM_CLASSES]; // Free in-band blocks per size class
+    char *tag_start;                   // First in-band block
+    char *tag_end;                     // Sentinel tag closing the pool
+
+    // Buddy layout
+    char *buddy_base;                  // Start of the tree, 16 byte aligned
+    size_t buddy_size;                 // Usable bytes, the rest of the tree is never free
+    int buddy_max_order;               // Order of the root block
+    uint64_t *buddy_split_map;         // Bit per tree node, set when split in two
+    uint64_t *buddy_free_map;          // Bit per tree node, set when on a free list
+    buddy_block *buddy_lists[BUDDY_MAX_ORDERS];
+};
+
+static mem_pool default_pool = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// Live pools, thread caches check here that their pool still exists
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mem_pool *pools = NULL;
+static unsigned long last_pool_id = 0;
+
+typedef struct thread_stats {
+    struct thread_stats *next;           // Next thread in stats_threads
+    bool keyed;                          // stats_thread_exit runs when the thread exits
+    bool registered;
+    unsigned long pool_ids[STATS_POOLS]; // 0 when the slot is unused
+    mem_pool *pools[STATS_POOLS];
+    unsigned long counts[STATS_POOLS][STAT_COUNTERS];
+} thread_stats;
+
+// Every thread that counted something, mem_stats walks them under stats_mutex.
+// Lock order is stats_mutex, pools_mutex.
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats *stats_threads = NULL;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+// Initial-exec keeps the lookup from going through __tls_get_addr on every count
+static __thread thread_stats tstats __attribute__((tls_model("initial-exec")));
+
+// Move the counts of a slot into its pool if the pool still exists and clear
+// the slot, the caller holds stats_mutex
+static void stats_fold(thread_stats *stats, int slot) {
+    if (stats->pool_ids[slot] != 0) {
+        pthread_mutex_lock(&pools_mutex);
+        for (mem_pool *pool = pools; pool != NULL; pool = pool->next_pool) {
+            if (pool == stats->pools[slot] && pool->id == stats->pool_ids[slot]) {
+                for (int counter = 0; counter < STAT_COUNTERS; counter++) {
+                    pool->retired[counter] += stats->counts[slot][counter];
+                }
+                break;
+            }
+        }
+        pthread_mutex_unlock(&pools_mutex);
+    }
+    stats->pool_ids[slot] = 0;
+    stats->pools[slot] = NULL;
+    memset(stats->counts[slot], 0, sizeof(stats->counts[slot]));
+}
+
+static void stats_thread_exit(void *arg) {
+    thread_stats *stats = arg;
+    pthread_mutex_lock(&stats_mutex);
+    for (int slot = 0; slot < STATS_POOLS; slot++) {
+        stats_fold(stats, slot);
+    }
+    for (thread_stats **link = &stats_threads; *link != NULL; link = &(*link)->next) {
+        if (*link == stats) {
+            *link = stats->next;
+            break;
+        }
+    }
+    stats->registered = false;
+    stats->keyed = false;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+static void stats_create_key() {
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+// Give this thread a slot for pool, registering the thread on first use and
+// taking over a slot of another pool when all are in use
+static int stats_slot_take(mem_pool *pool) {
+    thread_stats *stats = &tstats;
+
+    // pthread_setspecific allocates for keys past the first 32, which under a malloc
+    // replacement counts into this pool again, so it can't run under stats_mutex
+    if (!stats->keyed) {
+        stats->keyed = true;
+        pthread_once(&stats_key_once, stats_create_key);
+        pthread_setspecific(stats_key, stats);
+        for (int slot = 0; slot < STATS_POOLS; slot++) {
+            if (stats->pool_ids[slot] == pool->id) {
+                return slot;  // Taken by that allocation
+            }
+        }
+    }
+
+    pthread_mutex_lock(&stats_mutex);
+    if (!stats->registered) {
+        stats->next = stats_threads;
+        stats_threads = stats;
+        stats->registered = true;
+    }
+
+    int slot = 0;
+    while (slot < STATS_POOLS - 1 && stats->pool_ids[slot] != 0) {
+        slot++;
+    }
+    stats_fold(stats, slot);
+    stats->pools[slot] = pool;
+    stats->pool_ids[slot] = pool->id;
+    pthread_mutex_unlock(&stats_mutex);
+    return slot;
+}
+
+static void stats_add(mem_pool *pool, int counter, unsigned long n) {
+    thread_stats *stats = &tstats;
+    int slot = 0;
+    while (slot < STATS_POOLS && stats->pool_ids[slot] != pool->id) {
+        slot++;
+    }
+    if (slot == STATS_POOLS) {
+        slot = stats_slot_take(pool);
+    }
+    // Only this thread writes its counts, the atomic store keeps readers from seeing a torn value
+    unsigned long *count = &stats->counts[slot][counter];
+    __atomic_store_n(count, *count + n, __ATOMIC_RELAXED);
+}
+
+// Pool mutex, every acquisition is profiled with MEM_LOCK_PROFILE. Compiled
+// without it these are the plain mutex calls.
+#ifdef MEM_LOCK_PROFILE
+static uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int lock_bucket(uint64_t ns) {
+    int bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+    return bucket < MEM_LOCK_BUCKETS ? bucket : MEM_LOCK_BUCKETS - 1;
+}
+
+static void pool_lock(mem_pool *pool, int op) {
+    uint64_t wait = 0;
+    bool contended = pthread_mutex_trylock(&pool->mutex) != 0;
+    if (contended) {
+        uint64_t start = clock_ns();
+        pthread_mutex_lock(&pool->mutex);
+        wait = clock_ns() - start;
+    }
+
+    mem_lock_stats *stats = &pool->lock_stats;
+    stats->acquisitions[op]++;
+    stats->contended[op] += contended;
+    stats->wait_ns[op] += wait;
+    stats->wait_histogram[op][lock_bucket(wait)]++;
+    pool->lock_since = clock_ns();
+}
+
+static void pool_unlock(mem_pool *pool, int op) {
+    uint64_t hold = clock_ns() - pool->lock_since;
+    pool->lock_stats.hold_ns[op] += hold;
+    pool->lock_stats.hold_histogram[op][lock_bucket(hold)]++;
+    pthread_mutex_unlock(&pool->mutex);
+}
+#else
+#define pool_lock(pool, op) pthread_mutex_lock(&(pool)->mutex)
+#define pool_unlock(pool, op) pthread_mutex_unlock(&(pool)->mutex)
+#endif
+
+// Debug checks, compiled in with MEM_DEBUG (make debug). Every block gets a
+// redzone on either side of its payload. In front of the payload's redzone a
+// header says how large the payload is, with room before it for the free list
+// links that in-band, buddy and cached blocks keep in their first bytes. Fresh
+// payloads are filled with DEBUG_ALLOC_BYTE, freed ones with DEBUG_FREE_BYTE.
+// Free, resize and mem_block_size check the redzones and the header, so
+// overruns, double frees and frees of pointers the pool never handed out are
+// reported on stderr. Without MEM_DEBUG none of this is compiled and
+// debug_report is a no-op.
+#ifdef MEM_DEBUG
+#define DEBUG_REDZONE 16              // Bytes around the header and after the payload
+#define DEBUG_LIVE 0x6c697665u
+#define DEBUG_FREED 0x66726565u
+#define DEBUG_ALLOC_BYTE 0xcd
+#define DEBUG_FREE_BYTE 0xdd
+#define DEBUG_REDZONE_BYTE 0xfd
+
+typedef struct debug_header {
+    size_t size;                       // Bytes asked for
+    uint32_t front;                    // Bytes from the block to the payload
+    uint32_t magic;                    // DEBUG_LIVE, DEBUG_FREED once given back
+} debug_header;
+
+static unsigned long debug_errors = 0;
+
+static void debug_error(const char *op, const char *what, void *block) {
+    __atomic_add_fetch(&debug_errors, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "memory_manager: %s of %p: %s\n", op, block, what);
+}
+
+#define debug_report(op, what, block) debug_error(op, what, block)
+
+// Bytes in front of the payload, the payload keeps the block's alignment
+static size_t debug_front(size_t alignment) {
+    size_t front = DEBUG_REDZONE + sizeof(debug_header) + DEBUG_REDZONE;
+    return (front + alignment - 1) & ~(alignment - 1);
+}
+
+static debug_header *debug_header_of(void *payload) {
+    return (debug_header*)((char*)payload - DEBUG_REDZONE) - 1;
+}
+
+// Bytes a block needs for size bytes of payload, 0 when that doesn't fit a size_t
+static size_t debug_padded(size_t size, size_t front) {
+    return size <= (size_t)-1 - front - DEBUG_REDZONE ? size + front + DEBUG_REDZONE : 0;
+}
+
+static void debug_guard_back(char *payload, size_t size) {
+    memset(payload + size, DEBUG_REDZONE_BYTE, DEBUG_REDZONE);
+}
+
+// Lay out the redzones and header of a fresh block, returns its payload
+static void *debug_arm(void *block, size_t size, size_t front) {
+    char *payload = (char*)block + front;
+    debug_header *header = debug_header_of(payload);
+    memset(block, DEBUG_REDZONE_BYTE, front);
+    header->size = size;
+    header->front = front;
+    header->magic = DEBUG_LIVE;
+    memset(payload, DEBUG_ALLOC_BYTE, size);
+    debug_guard_back(payload, size);
+    return payload;
+}
+
+static bool debug_in_pool(mem_pool *pool, char *address) {
+    for (int c = 0; c < pool->num_chunks; c++) {
+        if (address >= pool->chunks[c].memory && address < pool->chunks[c].memory + pool->chunks[c].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Header of a live payload of the pool after checking its redzones, NULL and
+// reported if the pool never handed it out or it was freed already
+static debug_header *debug_check(mem_pool *pool, void *payload, const char *op) {
+    char *address = payload;
+    debug_header *header = debug_header_of(payload);
+    if (!debug_in_pool(pool, (char*)header)) {
+        debug_error(op, "not in the pool", payload);
+        return NULL;
+    }
+    if (header->magic == DEBUG_FREED) {
+        debug_error(op, "freed already", payload);
+        return NULL;
+    }
+    if (header->magic != DEBUG_LIVE || header->front < debug_front(1) || !debug_in_pool(pool, address - header->front)) {
+        debug_error(op, "header overwritten or not a block", payload);
+        return NULL;
+    }
+    // The redzone right in front, then what is left before the header
+    for (size_t i = 1; i <= header->front; i++) {
+        if (i > DEBUG_REDZONE && i <= DEBUG_REDZONE + sizeof(debug_header)) {
+            continue;
+        }
+        if ((unsigned char)address[-(ptrdiff_t)i] != DEBUG_REDZONE_BYTE) {
+            debug_error(op, "written before the block", payload);
+            break;
+        }
+    }
+    for (size_t i = 0; i < DEBUG_REDZONE; i++) {
+        if ((unsigned char)address[header->size + i] != DEBUG_REDZONE_BYTE) {
+            debug_error(op, "written past the end of the block", payload);
+            break;
+        }
+    }
+    return header;
+}
+
+// Check and poison a payload being freed, returns its block or NULL
+static void *debug_release(mem_pool *pool, void *payload) {
+    debug_header *header = debug_check(pool, payload, "free");
+    if (header == NULL) {
+        return NULL;
+    }
+    header->magic = DEBUG_FREED;
+    memset(payload, DEBUG_FREE_BYTE, header->size);
+    return (char*)payload - header->front;
+}
+#else
+#define debug_report(op, what, block) ((void)0)
+#endif
+
+// Count bytes and blocks going into or out of use, the caller holds the pool mutex
+static void usage_add(mem_pool *pool, size_t bytes, size_t blocks) {
+    pool->used_bytes += bytes;
+    pool->used_blocks += blocks;
+    if (pool->used_bytes > pool->peak_bytes) {
+        pool->peak_bytes = pool->used_bytes;
+    }
+}
+
+static void usage_sub(mem_pool *pool, size_t bytes, size_t blocks) {
+    pool->used_bytes -= bytes;
+    pool->used_blocks -= blocks;
+}
+
+// Parts of a pool that hold blocks under a lock of their own, the regions of
+// a MEM_REGIONS pool or else the pool itself
+static int num_parts(mem_pool *pool) {
+    return pool->regions != NULL ? pool->num_regions : 1;
+}
+
+static mem_pool *pool_part(mem_pool *pool, int part) {
+    return pool->regions != NULL ? &pool->regions[part] : pool;
+}
+
+// Map a block size to its size class
+static int size_class(size_t size) {
+    if (size < MIN_CLASS_SIZE) {
+        return (int)size;
+    }
+    int shift = 63 - __builtin_clzll(size);
+    int sub = (size >> (shift - CLASS_SUBDIVISION_BITS)) & (CLASS_SUBDIVISIONS - 1);
+    return MIN_CLASS_SIZE + (shift - MIN_CLASS_SHIFT) * CLASS_SUBDIVISIONS + sub;
+}
+
+// Find the first non-empty size class at or above class c, -1 if there is none
+static int next_nonempty_class(mem_pool *pool, int c) {
+    if (c >= NUM_CLASSES) {
+        return -1;
+    }
+    int word = c / 64;
+    uint64_t bits = pool->class_bitmap[word] & (~0ULL << (c % 64));
+    while (bits == 0) {
+        if (++word >= CLASS_WORDS) {
+            return -1;
+        }
+        bits = pool->class_bitmap[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+// Mark size class c as having free blocks or not
+static void set_class(mem_pool *pool, int c) {
+    pool->class_bitmap[c / 64] |= 1ULL << (c % 64);
+}
+
+static void clear_class(mem_pool *pool, int c) {
+    pool->class_bitmap[c / 64] &= ~(1ULL << (c % 64));
+}
+
+// Take an unused metadata entry, NO_BLOCK if the array can't grow. The array
+// may move, so callers keep indices rather than pointers across this call.
+static unsigned int block_new(mem_pool *pool) {
+    unsigned int index = pool->unused_blocks;
+    if (index != NO_BLOCK) {
+        pool->unused_blocks = pool->blocks[index].next_free;
+        pool->live_blocks++;
+        return index;
+    }
+
+    if (pool->num_blocks == pool->max_blocks) {
+        size_t old_bytes = (size_t)pool->max_blocks * sizeof(mem_struct);
+        size_t new_bytes = old_bytes > 0 ? old_bytes * 2 : BLOCKS_MIN_BYTES;
+        if (new_bytes / sizeof(mem_struct) >= NO_BLOCK) {
+            return NO_BLOCK;
+        }
+        mem_struct *blocks = old_bytes > 0
+            ? mremap(pool->blocks, old_bytes, new_bytes, MREMAP_MAYMOVE)
+            : mmap(NULL, new_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (blocks == MAP_FAILED) {
+            return NO_BLOCK;
+        }
+        pool->blocks = blocks;
+        pool->max_blocks = new_bytes / sizeof(mem_struct);
+    }
+    pool->live_blocks++;
+    return pool->num_blocks++;
+}
+
+static void block_delete(mem_pool *pool, unsigned int index) {
+    pool->blocks[index].next_free = pool->unused_blocks;
+    pool->unused_blocks = index;
+    pool->live_blocks--;
+}
+
+static size_t hash_address(mem_pool *pool, void *address) {
+    uint64_t hash = ((uintptr_t)address >> 3) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(hash >> 32) & (pool->hash_slots - 1);
+}
+
+static void hash_insert(mem_pool *pool, void *address, unsigned int index) {
+    size_t slot = hash_address(pool, address);
+    while (pool->hash[slot].address != NULL) {
+        slot = (slot + 1) & (pool->hash_slots - 1);
+    }
+    pool->hash[slot].address = address;
+    pool->hash[slot].index = index;
+    pool->hash_used++;
+}
+
+// Make room for one more entry, keeping the table at most half full
+static bool hash_reserve(mem_pool *pool) {
+    if ((pool->hash_used + 1) * 2 <= pool->hash_slots) {
+        return true;
+    }
+
+    block_slot *old_hash = pool->hash;
+    size_t old_slots = pool->hash_slots;
+    size_t new_slots = old_slots > 0 ? old_slots * 2 : HASH_MIN_SLOTS;
+    block_slot *hash = mmap(NULL, new_slots * sizeof(block_slot), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (hash == MAP_FAILED) {
+        return false;
+    }
+
+    pool->hash = hash;
+    pool->hash_slots = new_slots;
+    pool->hash_used = 0;
+    for (size_t i = 0; i < old_slots; i++) {
+        if (old_hash[i].address != NULL) {
+            hash_insert(pool, old_hash[i].address, old_hash[i].index);
+        }
+    }
+    if (old_hash != NULL) {
+        munmap(old_hash, old_slots * sizeof(block_slot));
+    }
+    return true;
+}
+
+// Index of the used block at address, NO_BLOCK if there is none
+static unsigned int hash_find(mem_pool *pool, void *address) {
+    if (pool->hash_slots == 0) {
+        return NO_BLOCK;
+    }
+    size_t slot = hash_address(pool, address);
+    while (pool->hash[slot].address != NULL) {
+        if (pool->hash[slot].address == address) {
+            return pool->hash[slot].index;
+        }
+        slot = (slot + 1) & (pool->hash_slots - 1);
+    }
+    return NO_BLOCK;
+}
+
+// Remove an address, moving later entries of the probe run back into the hole
+static void hash_remove(mem_pool *pool, void *address) {
+    size_t mask = pool->hash_slots - 1;
+    size_t hole = hash_address(pool, address);
+    while (pool->hash[hole].address != address) {
+        if (pool->hash[hole].address == NULL) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+
+    size_t slot = hole;
+    for (;;) {
+        slot = (slot + 1) & mask;
+        if (pool->hash[slot].address == NULL) {
+            break;
+        }
+        // An entry can fill the hole unless its home lies between the hole and itself
+        size_t home = hash_address(pool, pool->hash[slot].address);
+        bool stays = hole < slot ? (hole < home && home <= slot) : (hole < home || home <= slot);
+        if (!stays) {
+            pool->hash[hole] = pool->hash[slot];
+            hole = slot;
+        }
+    }
+    pool->hash[hole].address = NULL;
+    pool->hash_used--;
+}
+
+// Put a free block at the front of its size class list
+static void link_free(mem_pool *pool, unsigned int index) {
+    mem_struct *block = &pool->blocks[index];
+    int c = size_class(block->size);
+    block->prev_free = NO_BLOCK;
+    block->idle = 0;
+    block->next_free = pool->free_lists[c];
+    if (pool->free_lists[c] != NO_BLOCK) {
+        pool->blocks[pool->free_lists[c]].prev_free = index;
+    }
+    pool->free_lists[c] = index;
+    set_class(pool, c);
+}
+
+// Take a free block out of its size class list
+static void unlink_free(mem_pool *pool, unsigned int index) {
+    mem_struct *block = &pool->blocks[index];
+    int c = size_class(block->size);
+    if (block->prev_free != NO_BLOCK) {
+        pool->blocks[block->prev_free].next_free = block->next_free;
+    } else {
+        pool->free_lists[c] = block->next_free;
+    }
+    if (block->next_free != NO_BLOCK) {
+        pool->blocks[block->next_free].prev_free = block->prev_free;
+    }
+    if (pool->free_lists[c] == NO_BLOCK) {
+        clear_class(pool, c);
+    }
+    block->next_free = NO_BLOCK;
+    block->prev_free = NO_BLOCK;
+}
+
+// Lowest address free block of at least size bytes, chunk by chunk
+static unsigned int first_fit(mem_pool *pool, size_t size) {
+    for (int chunk = 0; chunk < pool->num_chunks; chunk++) {
+        for (unsigned int index = pool->chunks[chunk].head; index != NO_BLOCK; index = pool->blocks[index].next) {
+            if (pool->blocks[index].available && pool->blocks[index].size >= size) {
+                return index;
+            }
+        }
+    }
+    return NO_BLOCK;
+}
+
+// First free block of at least size bytes from the rover on, wrapping around once
+static unsigned int next_fit(mem_pool *pool, size_t size) {
+    int chunk = pool->rover_chunk;
+    unsigned int start = pool->rover;
+    if (start == NO_BLOCK || chunk >= pool->num_chunks) {
+        chunk = 0;
+        start = pool->chunks[0].head;
+    }
+
+    unsigned int index = start;
+    do {
+        mem_struct *block = &pool->blocks[index];
+        if (block->available && block->size >= size) {
+            pool->rover = index;
+            pool->rover_chunk = chunk;
+            return index;
+        }
+        index = block->next;
+        if (index == NO_BLOCK) {
+            chunk = (chunk + 1) % pool->num_chunks;
+            index = pool->chunks[chunk].head;
+        }
+    } while (index != start);
+    return NO_BLOCK;
+}
+
+// Smallest free block of at least size bytes, the lowest address among equal
+// sizes when by_address is set. Classes only grow, so the first class with a
+// fitting block holds the best one.
+static unsigned int best_fit(mem_pool *pool, size_t size, bool by_address) {
+    for (int c = next_nonempty_class(pool, size_class(size)); c >= 0; c = next_nonempty_class(pool, c + 1)) {
+        unsigned int best = NO_BLOCK;
+        for (unsigned int index = pool->free_lists[c]; index != NO_BLOCK; index = pool->blocks[index].next_free) {
+            mem_struct *block = &pool->blocks[index];
+            if (block->size < size) {
+                continue;
+            }
+            mem_struct *current = best != NO_BLOCK ? &pool->blocks[best] : NULL;
+            if (current == NULL || block->size < current->size ||
+                (by_address && block->size == current->size && block->memaddress < current->memaddress)) {
+                best = index;
+            }
+            if (!by_address && block->size == size) {
+                break;  // Nothing fits better
+            }
+        }
+        if (best != NO_BLOCK) {
+            return best;
+        }
+    }
+    return NO_BLOCK;
+}
+
+// Find a free block of at least size bytes
+static unsigned int find_free_block(mem_pool *pool, size_t size) {
+    switch (pool->flags & MEM_FIT_MASK) {
+    case MEM_FIRST_FIT:
+        return first_fit(pool, size);
+    case MEM_NEXT_FIT:
+        return next_fit(pool, size);
+    case MEM_BEST_FIT:
+        return best_fit(pool, size, false);
+    case MEM_ADDRESS_BEST_FIT:
+        return best_fit(pool, size, true);
+    }
+
+    int c = size_class(size);
+
+    // The head of the own class is good enough if it fits
+    if (pool->free_lists[c] != NO_BLOCK && pool->blocks[pool->free_lists[c]].size >= size) {
+        return pool->free_lists[c];
+    }
+
+    // Every block in a higher class fits
+    int higher = next_nonempty_class(pool, c + 1);
+    if (higher >= 0) {
+        return pool->free_lists[higher];
+    }
+
+    // Last resort, look through the rest of the own class
+    unsigned int current = pool->free_lists[c];
+    while (current != NO_BLOCK) {
+        if (pool->blocks[current].size >= size) {
+            return current;
+        }
+        current = pool->blocks[current].next_free;
+    }
+    return NO_BLOCK;
+}
+
+static size_t tag_size(tag_block *block) {
+    return block->tag & ~TAG_FLAGS;
+}
+
+static tag_block *tag_next(tag_block *block) {
+    return (tag_block*)((char*)block + tag_size(block));
+}
+
+// The footer of a free block sits right in front of the next block
+static tag_block *tag_prev(tag_block *block) {
+    size_t prev_size = *(size_t*)((char*)block - TAG_SIZE);
+    return (tag_block*)((char*)block - prev_size);
+}
+
+static void tag_set_footer(tag_block *block) {
+    *(size_t*)((char*)tag_next(block) - TAG_SIZE) = tag_size(block);
+}
+
+// Block size needed for size bytes of payload, 0 if it can't be represented
+static size_t tag_block_size(size_t size) {
+    if (size > (size_t)-1 - TAG_MIN_BLOCK) {
+        return 0;
+    }
+    size_t total = (size + TAG_SIZE + TAG_ALIGN - 1) & ~(size_t)(TAG_ALIGN - 1);
+    return total < TAG_MIN_BLOCK ? TAG_MIN_BLOCK : total;
+}
+
+static void tag_link_free(mem_pool *pool, tag_block *block) {
+    int c = size_class(tag_size(block));
+    block->prev_free = NULL;
+    block->next_free = pool->tag_lists[c];
+    if (pool->tag_lists[c] != NULL) {
+        pool->tag_lists[c]->prev_free = block;
+    }
+    pool->tag_lists[c] = block;
+    set_class(pool, c);
+}
+
+static void tag_unlink_free(mem_pool *pool, tag_block *block) {
+    int c = size_class(tag_size(block));
+    if (block->prev_free != NULL) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        pool->tag_lists[c] = block->next_free;
+    }
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    if (pool->tag_lists[c] == NULL) {
+        clear_class(pool, c);
+    }
+}
+
+// Same search as find_free_block, on the in-band lists
+static tag_block *tag_find_free(mem_pool *pool, size_t size) {
+    int c = size_class(size);
+
+    if (pool->tag_lists[c] != NULL && tag_size(pool->tag_lists[c]) >= size) {
+        return pool->tag_lists[c];
+    }
+
+    int higher = next_nonempty_class(pool, c + 1);
+    if (higher >= 0) {
+        return pool->tag_lists[higher];
+    }
+
+    tag_block *current = pool->tag_lists[c];
+    while (current != NULL) {
+        if (tag_size(current) >= size) {
+            return current;
+        }
+        current = current->next_free;
+    }
+    return NULL;
+}
+
+// Lay out the pool as one free block followed by a used sentinel tag
+static void tag_init(mem_pool *pool, size_t size) {
+    memset(pool->tag_lists, 0, sizeof(pool->tag_lists));
+
+    // Blocks start 8 bytes before a 16 byte boundary so payloads are aligned
+    char *base = pool->memorypool;
+    char *end = base + size;
+    uintptr_t first = ((uintptr_t)base + TAG_SIZE + TAG_ALIGN - 1) & ~(uintptr_t)(TAG_ALIGN - 1);
+    pool->tag_start = (char*)first - TAG_SIZE;
+
+    size_t usable = 0;
+    if (end >= pool->tag_start + TAG_SIZE) {
+        usable = (size_t)(end - TAG_SIZE - pool->tag_start) & ~(size_t)(TAG_ALIGN - 1);
+    }
+    if (usable < TAG_MIN_BLOCK) {
+        usable = 0;
+    }
+    pool->tag_end = pool->tag_start + usable;
+
+    // Nothing lies in front of the first block, it never merges backwards
+    if (usable > 0) {
+        tag_block *block = (tag_block*)pool->tag_start;
+        block->tag = usable | TAG_PREV_USED;
+        tag_set_footer(block);
+        tag_link_free(pool, block);
+        ((tag_block*)pool->tag_end)->tag = TAG_USED;
+    } else {
+        ((tag_block*)pool->tag_end)->tag = TAG_USED | TAG_PREV_USED;
+    }
+}
+
+// Hand out the first need bytes of a free block that is off its list
+static void *tag_take(mem_pool *pool, tag_block *block, size_t need) {
+    size_t total = tag_size(block);
+    if (total - need >= TAG_MIN_BLOCK) {
+        // Split the rest off as a new free block
+        tag_block *rest = (tag_block*)((char*)block + need);
+        rest->tag = (total - need) | TAG_PREV_USED;
+        tag_set_footer(rest);
+        tag_link_free(pool, rest);
+        total = need;
+    } else {
+        tag_next(block)->tag |= TAG_PREV_USED;
+    }
+    block->tag = total | TAG_USED | (block->tag & TAG_PREV_USED);
+    usage_add(pool, total, 1);
+    return (char*)block + TAG_SIZE;
+}
+
+static void *tag_alloc(mem_pool *pool, size_t size) {
+    size_t need = tag_block_size(size);
+    tag_block *block = need > 0 ? tag_find_free(pool, need) : NULL;
+    if (block == NULL) {
+        return NULL;
+    }
+    tag_unlink_free(pool, block);
+    return tag_take(pool, block, need);
+}
+
+// Allocate a block whose payload is aligned to alignment, the space in front
+// of it becomes a free block of its own
+static void *tag_alloc_aligned(mem_pool *pool, size_t size, size_t alignment) {
+    if (alignment <= TAG_ALIGN) {
+        return tag_alloc(pool, size);
+    }
+    size_t need = tag_block_size(size);
+    if (need == 0 || need > (size_t)-1 - alignment - TAG_MIN_BLOCK) {
+        return NULL;
+    }
+
+    // A block that happens to be aligned already, or one with room for any gap
+    tag_block *block = tag_find_free(pool, need);
+    if (block == NULL || (((uintptr_t)block + TAG_SIZE) & (alignment - 1)) != 0) {
+        block = tag_find_free(pool, need + alignment + TAG_MIN_BLOCK);
+    }
+    if (block == NULL) {
+        return NULL;
+    }
+    tag_unlink_free(pool, block);
+
+    uintptr_t payload = (uintptr_t)block + TAG_SIZE;
+    size_t gap = ((payload + alignment - 1) & ~(uintptr_t)(alignment - 1)) - payload;
+    if (gap > 0 && gap < TAG_MIN_BLOCK) {
+        gap += alignment;  // Too small for a block of its own
+    }
+    if (gap > 0) {
+        tag_block *front = block;
+        size_t total = tag_size(front);
+        block = (tag_block*)((char*)front + gap);
+        block->tag = total - gap;
+        front->tag = gap | (front->tag & TAG_PREV_USED);
+        tag_set_footer(front);
+        tag_link_free(pool, front);
+    }
+    return tag_take(pool, block, need);
+}
+
+// Header of a used block handed out by tag_alloc, NULL for anything else
+static tag_block *tag_lookup(mem_pool *pool, void *address) {
+    char *p = address;
+    if (p < pool->tag_start + TAG_SIZE || p >= pool->tag_end || ((uintptr_t)p & (TAG_ALIGN - 1)) != 0) {
+        return NULL;
+    }
+    // Thread caches look blocks up without the pool mutex, the tag of a used
+    // block only ever gets its TAG_PREV_USED bit flipped by others
+    tag_block *block = (tag_block*)(p - TAG_SIZE);
+    return (__atomic_load_n(&block->tag, __ATOMIC_RELAXED) & TAG_USED) ? block : NULL;
+}
+
+// Free a block and merge it with its free neighbours
+static void tag_release(mem_pool *pool, tag_block *block) {
+    size_t size = tag_size(block);
+    usage_sub(pool, size, 1);
+    size_t prev_used = block->tag & TAG_PREV_USED;
+
+    tag_block *next = tag_next(block);
+    if (!(next->tag & TAG_USED)) {
+        tag_unlink_free(pool, next);
+        size += tag_size(next);
+    }
+    if (!prev_used) {
+        tag_block *prev = tag_prev(block);
+        tag_unlink_free(pool, prev);
+        size += tag_size(prev);
+        prev_used = prev->tag & TAG_PREV_USED;
+        block = prev;
+    }
+
+    block->tag = size | prev_used;
+    tag_set_footer(block);
+    tag_next(block)->tag &= ~(size_t)TAG_PREV_USED;
+    tag_link_free(pool, block);
+}
+
+// Give the end of a used block beyond need bytes back to the pool, merged
+// with the block behind it if that one is free
+static void tag_trim(mem_pool *pool, tag_block *block, size_t need) {
+    size_t total = tag_size(block);
+    if (total - need < TAG_MIN_BLOCK) {
+        return;
+    }
+    usage_sub(pool, total - need, 0);
+
+    tag_block *rest = (tag_block*)((char*)block + need);
+    tag_block *next = tag_next(block);
+    size_t rest_size = total - need;
+    if (!(next->tag & TAG_USED)) {
+        tag_unlink_free(pool, next);
+        rest_size += tag_size(next);
+    }
+    block->tag = need | TAG_USED | (block->tag & TAG_PREV_USED);
+    rest->tag = rest_size | TAG_PREV_USED;
+    tag_set_footer(rest);
+    tag_next(rest)->tag &= ~(size_t)TAG_PREV_USED;
+    tag_link_free(pool, rest);
+}
+
+// Resize in place where the block and its free neighbours allow it, moving
+// the data only as a last resort
+static void *tag_resize(mem_pool *pool, void *address, size_t size) {
+    tag_block *block = tag_lookup(pool, address);
+    size_t need = tag_block_size(size);
+    if (block == NULL || need == 0) {
+        return NULL;
+    }
+
+    size_t total = tag_size(block);
+    if (total >= need) {
+        tag_trim(pool, block, need);
+        return address;  // Shrunk in place
+    }
+
+    // Grow into the next block if it's free and large enough
+    tag_block *next = tag_next(block);
+    size_t next_size = (next->tag & TAG_USED) ? 0 : tag_size(next);
+    if (total + next_size >= need) {
+        tag_unlink_free(pool, next);
+        usage_add(pool, next_size, 0);
+        block->tag = (total + next_size) | TAG_USED | (block->tag & TAG_PREV_USED);
+        tag_next(block)->tag |= TAG_PREV_USED;
+        tag_trim(pool, block, need);
+        return address;
+    }
+
+    // Otherwise take in the previous block as well and move the data down,
+    // if that keeps the minimum alignment
+    if (!(block->tag & TAG_PREV_USED)) {
+        tag_block *prev = tag_prev(block);
+        size_t merged = tag_size(prev) + total + next_size;
+        if (merged >= need && (((uintptr_t)prev + TAG_SIZE) & (pool->min_align - 1)) == 0) {
+            tag_unlink_free(pool, prev);
+            if (next_size > 0) {
+                tag_unlink_free(pool, next);
+            }
+            usage_add(pool, merged - total, 0);
+            prev->tag = merged | TAG_USED | (prev->tag & TAG_PREV_USED);
+            tag_next(prev)->tag |= TAG_PREV_USED;
+            memmove((char*)prev + TAG_SIZE, address, total - TAG_SIZE);
+            tag_trim(pool, prev, need);
+            return (char*)prev + TAG_SIZE;
+        }
+    }
+
+    void *new_address = tag_alloc_aligned(pool, size, pool->min_align);
+    if (new_address == NULL) {
+        return NULL;
+    }
+    memcpy(new_address, address, total - TAG_SIZE);
+    tag_release(pool, block);
+    return new_address;
+}
+
+static bool bit_get(uint64_t *map, size_t n) {
+    return (map[n / 64] >> (n % 64)) & 1;
+}
+
+static void bit_set(uint64_t *map, size_t n) {
+    map[n / 64] |= 1ULL << (n % 64);
+}
+
+static void bit_clear(uint64_t *map, size_t n) {
+    map[n / 64] &= ~(1ULL << (n % 64));
+}
+
+// Tree node of the block of the given order containing offset
+static size_t buddy_node(mem_pool *pool, size_t offset, int order) {
+    int level = pool->buddy_max_order - order;
+    return ((size_t)1 << level) - 1 + (offset >> (BUDDY_MIN_SHIFT + order));
+}
+
+static void buddy_push(mem_pool *pool, size_t offset, int order) {
+    buddy_block *block = (buddy_block*)(pool->buddy_base + offset);
+    block->prev = NULL;
+    block->next = pool->buddy_lists[order];
+    if (pool->buddy_lists[order] != NULL) {
+        pool->buddy_lists[order]->prev = block;
+    }
+    pool->buddy_lists[order] = block;
+    bit_set(pool->buddy_free_map, buddy_node(pool, offset, order));
+}
+
+static void buddy_remove(mem_pool *pool, size_t offset, int order) {
+    buddy_block *block = (buddy_block*)(pool->buddy_base + offset);
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        pool->buddy_lists[order] = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    bit_clear(pool->buddy_free_map, buddy_node(pool, offset, order));
+}
+
+// Put the usable part of a block on the free lists, splitting where it ends
+static void buddy_carve(mem_pool *pool, size_t offset, int order) {
+    size_t block_size = BUDDY_MIN_BLOCK << order;
+    if (offset >= pool->buddy_size) {
+        return;  // Past the end of the pool, stays used for good
+    }
+    if (offset + block_size <= pool->buddy_size) {
+        buddy_push(pool, offset, order);
+        return;
+    }
+    bit_set(pool->buddy_split_map, buddy_node(pool, offset, order));
+    buddy_carve(pool, offset, order - 1);
+    buddy_carve(pool, offset + block_size / 2, order - 1);
+}
+
+static bool buddy_init(mem_pool *pool, size_t size) {
+    uintptr_t base = ((uintptr_t)pool->memorypool + BUDDY_MIN_BLOCK - 1) & ~(uintptr_t)(BUDDY_MIN_BLOCK - 1);
+    uintptr_t end = (uintptr_t)pool->memorypool + size;
+    pool->buddy_base = (char*)base;
+    pool->buddy_size = end > base ? (end - base) & ~(BUDDY_MIN_BLOCK - 1) : 0;
+
+    pool->buddy_max_order = 0;
+    while ((BUDDY_MIN_BLOCK << pool->buddy_max_order) < pool->buddy_size) {
+        pool->buddy_max_order++;
+    }
+
+    size_t nodes = ((size_t)2 << pool->buddy_max_order) - 1;
+    pool->buddy_split_map = calloc((nodes + 63) / 64, sizeof(uint64_t));
+    pool->buddy_free_map = calloc((nodes + 63) / 64, sizeof(uint64_t));
+    memset(pool->buddy_lists, 0, sizeof(pool->buddy_lists));
+    if (pool->buddy_split_map == NULL || pool->buddy_free_map == NULL) {
+        return false;
+    }
+
+    if (pool->buddy_size > 0) {
+        buddy_carve(pool, 0, pool->buddy_max_order);
+    }
+    return true;
+}
+
+// Smallest order holding size bytes
+static int buddy_order(size_t size) {
+    int order = 0;
+    while ((BUDDY_MIN_BLOCK << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+static void *buddy_alloc(mem_pool *pool, size_t size) {
+    if (pool->buddy_size == 0 || size > (BUDDY_MIN_BLOCK << pool->buddy_max_order)) {
+        return NULL;
+    }
+    int order = buddy_order(size);
+
+    int current = order;
+    while (current <= pool->buddy_max_order && pool->buddy_lists[current] == NULL) {
+        current++;
+    }
+    if (current > pool->buddy_max_order) {
+        return NULL;  // No block large enough
+    }
+
+    // Split the block until it has the requested order, keeping the left halves
+    size_t offset = (char*)pool->buddy_lists[current] - pool->buddy_base;
+    buddy_remove(pool, offset, current);
+    while (current > order) {
+        bit_set(pool->buddy_split_map, buddy_node(pool, offset, current));
+        current--;
+        buddy_push(pool, offset + (BUDDY_MIN_BLOCK << current), current);
+    }
+    usage_add(pool, BUDDY_MIN_BLOCK << order, 1);
+    return pool->buddy_base + offset;
+}
+
+// Order of the used block starting at address, -1 if there is none
+static int buddy_find(mem_pool *pool, void *address) {
+    size_t offset = (char*)address - pool->buddy_base;
+    if ((char*)address < pool->buddy_base || offset >= pool->buddy_size || (offset & (BUDDY_MIN_BLOCK - 1)) != 0) {
+        return -1;
+    }
+
+    // Walk down from the root to the block holding offset
+    int order = pool->buddy_max_order;
+    while (order > 0 && bit_get(pool->buddy_split_map, buddy_node(pool, offset, order))) {
+        order--;
+    }
+    if ((offset & ((BUDDY_MIN_BLOCK << order) - 1)) != 0 ||
+        bit_get(pool->buddy_free_map, buddy_node(pool, offset, order))) {
+        return -1;  // Inside a block or already free
+    }
+    return order;
+}
+
+// Free a block and merge it with its buddy for as long as the buddy is free
+static void buddy_release(mem_pool *pool, void *address, int order) {
+    size_t offset = (char*)address - pool->buddy_base;
+    usage_sub(pool, BUDDY_MIN_BLOCK << order, 1);
+    while (order < pool->buddy_max_order) {
+        size_t buddy = offset ^ (BUDDY_MIN_BLOCK << order);
+        if (!bit_get(pool->buddy_free_map, buddy_node(pool, buddy, order))) {
+            break;
+        }
+        buddy_remove(pool, buddy, order);
+        offset &= ~(BUDDY_MIN_BLOCK << order);
+        order++;
+        bit_clear(pool->buddy_split_map, buddy_node(pool, offset, order));
+    }
+    buddy_push(pool, offset, order);
+}
+
+// Resize in place by splitting off upper halves or merging with free right
+// buddies, moving the data only as a last resort
+static void *buddy_resize(mem_pool *pool, void *address, size_t size) {
+    int order = buddy_find(pool, address);
+    if (order < 0) {
+        return NULL;
+    }
+    if (size < pool->min_align) {
+        size = pool->min_align;
+    }
+    size_t offset = (char*)address - pool->buddy_base;
+
+    int want = size <= (BUDDY_MIN_BLOCK << pool->buddy_max_order) ? buddy_order(size) : pool->buddy_max_order + 1;
+    if (want <= order) {
+        // Give the upper halves back
+        usage_sub(pool, (BUDDY_MIN_BLOCK << order) - (BUDDY_MIN_BLOCK << want), 0);
+        while (order > want) {
+            bit_set(pool->buddy_split_map, buddy_node(pool, offset, order));
+            order--;
+            buddy_push(pool, offset + (BUDDY_MIN_BLOCK << order), order);
+        }
+        return address;
+    }
+
+    // The block can grow if it is the left half at every level up to want
+    // and each right half is free
+    int grown = order;
+    while (grown < want && grown < pool->buddy_max_order &&
+           (offset & (BUDDY_MIN_BLOCK << grown)) == 0 &&
+           bit_get(pool->buddy_free_map, buddy_node(pool, offset + (BUDDY_MIN_BLOCK << grown), grown))) {
+        grown++;
+    }
+    if (grown == want) {
+        usage_add(pool, (BUDDY_MIN_BLOCK << want) - (BUDDY_MIN_BLOCK << order), 0);
+        for (int current = order; current < want; current++) {
+            buddy_remove(pool, offset + (BUDDY_MIN_BLOCK << current), current);
+            bit_clear(pool->buddy_split_map, buddy_node(pool, offset, current + 1));
+        }
+        return address;
+    }
+
+    void *new_address = buddy_alloc(pool, size);
+    if (new_address == NULL) {
+        return NULL;
+    }
+    memcpy(new_address, address, BUDDY_MIN_BLOCK << order);
+    buddy_release(pool, address, order);
+    return new_address;
+}
+
+static void buddy_deinit(mem_pool *pool) {
+    free(pool->buddy_split_map);
+    free(pool->buddy_free_map);
+    pool->buddy_split_map = NULL;
+    pool->buddy_free_map = NULL;
+    pool->buddy_base = NULL;
+    pool->buddy_size = 0;
+    memset(pool->buddy_lists, 0, sizeof(pool->buddy_lists));
+}
+
+// Split a block that is off the free lists after its first size bytes, the
+// rest becomes a free block the caller links. NO_BLOCK if there's no entry
+// left for the rest.
+static unsigned int split_block(mem_pool *pool, unsigned int index, size_t size) {
+    unsigned int new_index = block_new(pool);
+    if (new_index == NO_BLOCK) {
+        return NO_BLOCK;
+    }
+
+    mem_struct *current = &pool->blocks[index];
+    mem_struct *new_block = &pool->blocks[new_index];
+    new_block->available = true;
+    new_block->size = current->size - size;
+    new_block->memaddress = (char*)current->memaddress + size;
+    new_block->next = current->next;
+    new_block->prev = index;
+    if (current->next != NO_BLOCK) {
+        pool->blocks[current->next].prev = new_index;
+    }
+
+    current->next = new_index;
+    current->size = size;
+    return new_index;
+}
+
+static size_t align_gap(void *address, size_t alignment) {
+    return (alignment - ((uintptr_t)address & (alignment - 1))) & (alignment - 1);
+}
+
+// Take size bytes aligned to alignment out of a free block, the caller holds
+// the pool mutex
+static unsigned int alloc_block(mem_pool *pool, size_t size, size_t alignment) {
+    if (!hash_reserve(pool)) {
+        return NO_BLOCK;
+    }
+    unsigned int index = find_free_block(pool, size);
+    if (alignment > pool->min_align &&
+        (index == NO_BLOCK || align_gap(pool->blocks[index].memaddress, alignment) != 0)) {
+        // Room for the block behind the largest possible gap
+        if (size > (size_t)-1 - alignment) {
+            return NO_BLOCK;
+        }
+        index = find_free_block(pool, size + alignment - pool->min_align);
+    }
+    if (index == NO_BLOCK) {
+        return NO_BLOCK;  // No suitable block found
+    }
+
+    unlink_free(pool, index);
+    size_t gap = align_gap(pool->blocks[index].memaddress, alignment);
+    if (gap > 0) {
+        // The space in front of the aligned address stays free
+        unsigned int aligned = split_block(pool, index, gap);
+        link_free(pool, index);
+        if (aligned == NO_BLOCK) {
+            return NO_BLOCK;
+        }
+        index = aligned;
+    }
+
+    // Check if the block can be split
+    if (pool->blocks[index].size > size) {
+        unsigned int rest = split_block(pool, index, size);
+        if (rest != NO_BLOCK) {
+            link_free(pool, rest);
+        }
+    }
+    pool->blocks[index].available = false;
+    usage_add(pool, pool->blocks[index].size, 1);
+    hash_insert(pool, pool->blocks[index].memaddress, index);
+    return index;
+}
+
+// Merge a block with the block behind it, neither is on a free list
+static void merge_next(mem_pool *pool, unsigned int index) {
+    mem_struct *current = &pool->blocks[index];
+    unsigned int next_index = current->next;
+    current->size += pool->blocks[next_index].size;
+    current->next = pool->blocks[next_index].next; // Skip the next block
+    if (current->next != NO_BLOCK) {
+        pool->blocks[current->next].prev = index;
+    }
+    if (pool->rover == next_index) {
+        pool->rover = index;  // Same chunk
+    }
+    block_delete(pool, next_index);
+}
+
+// Merge a block with the free block behind it
+static void absorb_next(mem_pool *pool, unsigned int index) {
+    unlink_free(pool, pool->blocks[index].next);
+    merge_next(pool, index);
+}
+
+// Coalesce adjacent free blocks of the whole pool
+static void coalesce_blocks(mem_pool *pool) {
+    for (int chunk = 0; chunk < pool->num_chunks; chunk++) {
+        unsigned int index = pool->chunks[chunk].head;
+
+        while (index != NO_BLOCK && pool->blocks[index].next != NO_BLOCK) {
+            mem_struct *current = &pool->blocks[index];
+            unsigned int next_index = current->next;
+            // Check if current block and next block are both available
+            if (current->available && pool->blocks[next_index].available) {
+                // Merge current block with the next block, it changes size class
+                unlink_free(pool, index);
+                absorb_next(pool, index);
+                link_free(pool, index);
+            } else {
+                // Move to the next block in the list
+                index = next_index;
+            }
+        }
+    }
+    pool->unmerged = 0;
+}
+
+// Find the used block starting at address, the caller holds the pool mutex
+static unsigned int find_block(mem_pool *pool, void *address) {
+    return hash_find(pool, address);
+}
+
+// Give the end of a used block beyond size bytes back to the pool, merged
+// with the block behind it if that one is free
+static void trim_block(mem_pool *pool, unsigned int index, size_t size) {
+    mem_struct *current = &pool->blocks[index];
+    if (size == 0 || current->size <= size) {
+        return;
+    }
+
+    size_t tail = current->size - size;
+    unsigned int next_index = current->next;
+    if (next_index != NO_BLOCK && pool->blocks[next_index].available) {
+        mem_struct *next_block = &pool->blocks[next_index];
+        unlink_free(pool, next_index);
+        next_block->memaddress = (char*)next_block->memaddress - tail;
+        next_block->size += tail;
+        link_free(pool, next_index);
+        current->size = size;
+        return;
+    }
+
+    unsigned int rest = split_block(pool, index, size);
+    if (rest != NO_BLOCK) {
+        link_free(pool, rest);
+    }
+}
+
+// Give a used block back to the pool and merge it with its free neighbours,
+// the caller holds the pool mutex
+static void release_block(mem_pool *pool, unsigned int index) {
+    mem_struct *block = &pool->blocks[index];
+    hash_remove(pool, block->memaddress);
+    block->available = true;
+    usage_sub(pool, block->size, 1);
+
+    if (pool->flags & MEM_LAZY_COALESCE) {
+        link_free(pool, index);
+        pool->unmerged++;
+        if (pool->unmerged > LAZY_MIN_FREES &&
+            (size_t)pool->unmerged * 100 > (size_t)pool->live_blocks * LAZY_PERCENT) {
+            coalesce_blocks(pool);
+        }
+        return;
+    }
+
+    if (block->next != NO_BLOCK && pool->blocks[block->next].available) {
+        absorb_next(pool, index);
+    }
+    unsigned int prev_index = pool->blocks[index].prev;
+    if (prev_index != NO_BLOCK && pool->blocks[prev_index].available) {
+        unlink_free(pool, prev_index);
+        merge_next(pool, prev_index);
+        index = prev_index;
+    }
+    link_free(pool, index);
+}
+
+// Resize in place where the block and its free neighbours allow it, moving
+// the data only as a last resort. The caller holds the pool mutex.
+static void *resize_block(mem_pool *pool, void *block, size_t size) {
+    unsigned int index = find_block(pool, block);
+    size_t rounded = (size + pool->min_align - 1) & ~(pool->min_align - 1);
+    if (index == NO_BLOCK || rounded < size || pool->blocks[index].available) {
+        return NULL;  // Block not found
+    }
+    size = rounded;
+
+    mem_struct *current = &pool->blocks[index];
+    unsigned int prev_index = current->prev;
+    size_t old_size = current->size;
+    if (old_size >= size) {
+        trim_block(pool, index, size);
+        usage_sub(pool, old_size - pool->blocks[index].size, 0);
+        return block;  // Shrunk in place
+    }
+
+    unsigned int next_index = current->next;
+    size_t next_size = 0;
+    if (next_index != NO_BLOCK && pool->blocks[next_index].available) {
+        next_size = pool->blocks[next_index].size;
+    }
+    if (old_size + next_size >= size) {
+        // Take what is missing from the next block
+        absorb_next(pool, index);
+        trim_block(pool, index, size);
+        usage_add(pool, pool->blocks[index].size - old_size, 0);
+        return block;
+    }
+
+    if (prev_index != NO_BLOCK && pool->blocks[prev_index].available &&
+        pool->blocks[prev_index].size + old_size + next_size >= size) {
+        // Take in the previous block as well and move the data down
+        if (next_size > 0) {
+            absorb_next(pool, index);
+        }
+        hash_remove(pool, block);
+        unlink_free(pool, prev_index);
+        merge_next(pool, prev_index);
+        mem_struct *prev = &pool->blocks[prev_index];
+        prev->available = false;
+        hash_insert(pool, prev->memaddress, prev_index);
+        memmove(prev->memaddress, block, old_size);
+        trim_block(pool, prev_index, size);
+        prev = &pool->blocks[prev_index];
+        usage_add(pool, prev->size - old_size, 0);
+        return prev->memaddress;
+    }
+
+    // Allocate a new block, the metadata array may move
+    unsigned int new_index = alloc_block(pool, size, pool->min_align);
+    if (new_index == NO_BLOCK) {
+        return NULL;  // Allocation failed
+    }
+
+    // Copy the old data to the new block and free the old block
+    void *address = pool->blocks[new_index].memaddress;
+    memcpy(address, block, old_size);
+    release_block(pool, index);
+    return address;
+}
+
+
+// Per-thread caches (MEM_THREAD_CACHE): small in-band blocks freed by a
+// thread stay allocated in the pool and are kept in exact-size bins, so the
+// next allocation of that size doesn't take the pool mutex. Bins are refilled
+// and flushed in batches, and a thread never caches more than CACHE_MAX_BYTES
+// per pool. A thread keeps caches for up to CACHE_POOLS pools at a time.
+#define CACHE_BINS 64                 // Block sizes up to 1 KiB in TAG_ALIGN steps
+#define CACHE_BATCH 8                 // Blocks taken from the pool per refill
+#define CACHE_MAX_BYTES (256 * 1024)  // Cap on the bytes cached by one thread
+#define CACHE_POOLS 4
+#define CACHE_MAGIC ((uintptr_t)0x63616368656421ULL)
+
+typedef struct thread_cache {
+    unsigned long pool_id;    // Pool the cached blocks belong to, 0 when unused
+    mem_pool *pool;
+    size_t bytes;             // Bytes held in the bins
+    void *bins[CACHE_BINS];   // Payloads linked through their first word
+} thread_cache;
+
+static __thread thread_cache tcaches[CACHE_POOLS];
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// A cached payload holds the next pointer and a marker to catch double frees
+static void cache_push(thread_cache *cache, void *address, size_t block_size) {
+    void **slot = address;
+    int bin = block_size / TAG_ALIGN;
+    slot[0] = cache->bins[bin];
+    slot[1] = (void*)((uintptr_t)address ^ CACHE_MAGIC);
+    cache->bins[bin] = address;
+    cache->bytes += block_size;
+}
+
+static void *cache_pop(thread_cache *cache, int bin) {
+    void **slot = cache->bins[bin];
+    if (slot == NULL) {
+        return NULL;
+    }
+    cache->bins[bin] = slot[0];
+    cache->bytes -= bin * TAG_ALIGN;
+    slot[1] = NULL;
+    return slot;
+}
+
+static bool cache_contains(void *address) {
+    return ((void**)address)[1] == (void*)((uintptr_t)address ^ CACHE_MAGIC);
+}
+
+// Give cached blocks back to the pool until at most keep_bytes are left,
+// largest first, the caller holds the pool mutex
+static void cache_flush(thread_cache *cache, size_t keep_bytes) {
+    for (int bin = CACHE_BINS - 1; bin > 0 && cache->bytes > keep_bytes; bin--) {
+        void *address;
+        while (cache->bytes > keep_bytes && (address = cache_pop(cache, bin)) != NULL) {
+            tag_release(cache->pool, (tag_block*)((char*)address - TAG_SIZE));
+        }
+    }
+}
+
+// Flush a cache if its pool still exists and free the slot
+static void cache_evict(thread_cache *cache) {
+    if (cache->pool_id != 0 && cache->bytes > 0) {
+        pthread_mutex_lock(&pools_mutex);
+        for (mem_pool *pool = pools; pool != NULL; pool = pool->next_pool) {
+            if (pool == cache->pool && pool->id == cache->pool_id) {
+                pool_lock(pool, MEM_LOCK_OTHER);
+                cache_flush(cache, 0);
+                pool_unlock(pool, MEM_LOCK_OTHER);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&pools_mutex);
+    }
+    memset(cache, 0, sizeof(thread_cache));
+}
+
+static void cache_thread_exit(void *arg) {
+    for (int i = 0; i < CACHE_POOLS; i++) {
+        cache_evict(&tcaches[i]);
+    }
+}
+
+static void cache_create_key() {
+    pthread_key_create(&cache_key, cache_thread_exit);
+}
+
+// Cache of this thread for pool, NULL if there is none
+static thread_cache *cache_find(mem_pool *pool) {
+    for (int i = 0; i < CACHE_POOLS; i++) {
+        if (tcaches[i].pool_id == pool->id) {
+            return &tcaches[i];
+        }
+    }
+    return NULL;
+}
+
+// Cache of this thread for pool, takes over the emptiest slot if there is none
+static thread_cache *cache_get(mem_pool *pool) {
+    thread_cache *cache = cache_find(pool);
+    if (cache != NULL) {
+        return cache;
+    }
+
+    cache = &tcaches[0];
+    for (int i = 1; i < CACHE_POOLS && cache->pool_id != 0; i++) {
+        if (tcaches[i].pool_id == 0 || tcaches[i].bytes < cache->bytes) {
+            cache = &tcaches[i];
+        }
+    }
+    cache_evict(cache);
+    cache->pool_id = pool->id;
+    cache->pool = pool;
+    pthread_once(&cache_key_once, cache_create_key);
+    pthread_setspecific(cache_key, tcaches);
+    return cache;
+}
+
+// Serve an allocation from the thread cache, refilling the bin in one batch
+static void *cache_alloc(mem_pool *pool, size_t size) {
+    size_t need = tag_block_size(size);
+    int bin = need / TAG_ALIGN;
+    if (need == 0 || bin >= CACHE_BINS) {
+        return NULL;
+    }
+    thread_cache *cache = cache_get(pool);
+
+    void *address = cache_pop(cache, bin);
+    if (address != NULL) {
+        return address;
+    }
+
+    pool_lock(pool, MEM_LOCK_ALLOC);
+    for (int i = 0; i < CACHE_BATCH && cache->bytes + need <= CACHE_MAX_BYTES; i++) {
+        address = tag_alloc_aligned(pool, size, pool->min_align);
+        if (address == NULL) {
+            break;
+        }
+        cache_push(cache, address, need);
+    }
+    pool_unlock(pool, MEM_LOCK_ALLOC);
+    return cache_pop(cache, bin);
+}
+
+// Keep a freed block in the thread cache, false if it has to go to the pool
+static bool cache_free(mem_pool *pool, void *address) {
+    tag_block *block = tag_lookup(pool, address);
+    if (block == NULL) {
+        return false;
+    }
+    if (cache_contains(address)) {
+        return true;  // Already free
+    }
+    size_t block_size = __atomic_load_n(&block->tag, __ATOMIC_RELAXED) & ~TAG_FLAGS;
+    if (block_size / TAG_ALIGN >= CACHE_BINS) {
+        return false;
+    }
+    thread_cache *cache = cache_get(pool);
+
+    if (cache->bytes + block_size > CACHE_MAX_BYTES) {
+        pool_lock(pool, MEM_LOCK_FREE);
+        cache_flush(cache, CACHE_MAX_BYTES / 2);
+        pool_unlock(pool, MEM_LOCK_FREE);
+    }
+    cache_push(cache, address, block_size);
+    return true;
+}
+
+// Fault in every page of a fresh mapping
+static void map_populate(char *memory, size_t length) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(memory, length, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+    // Older kernels, touch one byte per page
+    for (size_t offset = 0; offset < length; offset += POOL_ALIGN) {
+        memory[offset] = 0;
+    }
+}
+
+// Map a chunk of at least size bytes with the mapping flags of a pool, sets
+// the mapped length and returns NULL on failure
+static char *map_chunk(size_t size, unsigned int flags, size_t *mapped) {
+    int prot = PROT_READ | PROT_WRITE;
+    int populate = (flags & MEM_POPULATE) ? MAP_POPULATE : 0;
+    size_t huge_length = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    char *memory;
+    if (huge_length < size) {
+        return NULL;
+    }
+
+    if (flags & MEM_HUGETLB) {
+        memory = mmap(NULL, huge_length, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+        if (memory != MAP_FAILED) {
+            *mapped = huge_length;
+            return memory;
+        }
+        flags |= MEM_HUGE_PAGES;  // No huge pages reserved, try transparent ones
+    }
+
+    if (flags & MEM_HUGE_PAGES) {
+        // Map one huge page extra and cut the mapping down to an aligned range.
+        // Populating waits for madvise, or the pool would be faulted in small pages.
+        char *raw = mmap(NULL, huge_length + HUGE_PAGE_SIZE, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+        memory = (char*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (memory > raw) {
+            munmap(raw, memory - raw);
+        }
+        munmap(memory + huge_length, raw + HUGE_PAGE_SIZE - memory);
+        madvise(memory, huge_length, MADV_HUGEPAGE);  // Only a hint, fails without THP
+        if (flags & MEM_POPULATE) {
+            map_populate(memory, huge_length);
+        }
+        *mapped = huge_length;
+        return memory;
+    }
+
+    size_t length = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    if (length < size) {
+        return NULL;
+    }
+    memory = mmap(NULL, length, prot, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    *mapped = length;
+    return memory;
+}
+
+// Give back the memory of every chunk of a pool, mapped or from the heap
+static void pool_unmap(mem_pool *pool) {
+    for (int chunk = 0; chunk < pool->num_chunks; chunk++) {
+        if (pool->chunks[chunk].mapped > 0) {
+            munmap(pool->chunks[chunk].memory, pool->chunks[chunk].mapped);
+        } else {
+            free(pool->chunks[chunk].memory);
+        }
+    }
+    pool->num_chunks = 0;
+    pool->memorypool = NULL;
+}
+
+// Map another chunk with room for need bytes as one free block, the caller
+// holds the pool mutex
+static bool pool_grow(mem_pool *pool, size_t need) {
+    if (pool->num_chunks == 0 || pool->num_chunks == POOL_MAX_CHUNKS) {
+        return false;
+    }
+    size_t size = 0;
+    for (int chunk = 0; chunk < pool->num_chunks; chunk++) {
+        size += pool->chunks[chunk].size;
+    }
+    if (size < need) {
+        size = need;
+    }
+
+    size_t mapped;
+    char *memory = map_chunk(size, pool->flags, &mapped);
+    if (memory == NULL) {
+        return false;
+    }
+    unsigned int index = block_new(pool);
+    if (index == NO_BLOCK) {
+        munmap(memory, mapped);
+        return false;
+    }
+
+    // The whole mapping is usable, the block size stays a multiple of the alignment
+    mem_struct *block = &pool->blocks[index];
+    block->memaddress = memory;
+    block->next = NO_BLOCK;
+    block->prev = NO_BLOCK;
+    block->available = true;
+    block->size = mapped;
+    link_free(pool, index);
+    pool->chunks[pool->num_chunks++] = (pool_chunk){memory, mapped, mapped, index};
+    return true;
+}
+
+// Milliseconds of the monotonic clock
+static uint64_t clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Release the pages of free blocks that stayed free since the last pass, the
+// caller holds the pool mutex
+static void release_idle_blocks(mem_pool *pool) {
+    if (pool->flags & (MEM_IN_BAND | MEM_BUDDY)) {
+        return;  // Free blocks keep their links in their memory
+    }
+    for (int c = next_nonempty_class(pool, 0); c >= 0; c = next_nonempty_class(pool, c + 1)) {
+        for (unsigned int index = pool->free_lists[c]; index != NO_BLOCK; index = pool->blocks[index].next_free) {
+            mem_struct *block = &pool->blocks[index];
+            if (block->idle == IDLE_RELEASED || ++block->idle < IDLE_RELEASED) {
+                continue;
+            }
+            // Only whole pages inside the block, its neighbours may be in use
+            uintptr_t start = ((uintptr_t)block->memaddress + POOL_ALIGN - 1) & ~(uintptr_t)(POOL_ALIGN - 1);
+            uintptr_t end = ((uintptr_t)block->memaddress + block->size) & ~(uintptr_t)(POOL_ALIGN - 1);
+            if (start < end) {
+                madvise((void*)start, end - start, MADV_DONTNEED);
+            }
+        }
+    }
+}
+
+// Wakes the releaser early when a release delay changes
+static pthread_cond_t release_cond = PTHREAD_COND_INITIALIZER;
+static bool releaser_started = false;
+
+// Background thread running the release passes of every pool with a release
+// delay. It holds pools_mutex, so pools can't go away under it.
+static void *releaser_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pools_mutex);
+    for (;;) {
+        uint64_t now = clock_ms();
+        uint64_t wake = UINT64_MAX;
+        for (mem_pool *pool = pools; pool != NULL; pool = pool->next_pool) {
+            if (pool->release_ms == 0) {
+                continue;
+            }
+            if (pool->next_release <= now) {
+                for (int part = 0; part < num_parts(pool); part++) {
+                    mem_pool *locked = pool_part(pool, part);
+                    pool_lock(locked, MEM_LOCK_OTHER);
+                    release_idle_blocks(locked);
+                    pool_unlock(locked, MEM_LOCK_OTHER);
+                }
+                pool->next_release = now + pool->release_ms;
+            }
+            if (pool->next_release < wake) {
+                wake = pool->next_release;
+            }
+        }
+
+        if (wake == UINT64_MAX) {
+            pthread_cond_wait(&release_cond, &pools_mutex);
+        } else {
+            // Condition variables time out on the realtime clock
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            uint64_t nsec = until.tv_nsec + (wake - now) % 1000 * 1000000;
+            until.tv_sec += (wake - now) / 1000 + nsec / 1000000000;
+            until.tv_nsec = nsec % 1000000000;
+            pthread_cond_timedwait(&release_cond, &pools_mutex, &until);
+        }
+    }
+    return NULL;
+}
+
+// Cover the first chunk of an out-of-band pool with one free block, false if
+// there's no metadata entry for it
+static bool blocks_init(mem_pool *pool) {
+    unsigned int index = block_new(pool);
+    if (index == NO_BLOCK) {
+        return false;
+    }
+    mem_struct *head = &pool->blocks[index];
+    head->memaddress = pool->chunks[0].memory;
+    head->next = NO_BLOCK;
+    head->prev = NO_BLOCK;
+    head->available = true;
+    head->size = pool->chunks[0].size;
+    link_free(pool, index);
+    pool->chunks[0].head = index;
+    return true;
+}
+
+// Give back the out-of-band metadata of a pool
+static void blocks_unmap(mem_pool *pool) {
+    if (pool->blocks != NULL) {
+        munmap(pool->blocks, (size_t)pool->max_blocks * sizeof(mem_struct));
+    }
+    if (pool->hash != NULL) {
+        munmap(pool->hash, pool->hash_slots * sizeof(block_slot));
+    }
+}
+
+// Give back the metadata and locks of the regions, their memory belongs to the pool
+static void regions_teardown(mem_pool *pool) {
+    for (int r = 0; r < pool->num_regions; r++) {
+        blocks_unmap(&pool->regions[r]);
+        pthread_mutex_destroy(&pool->regions[r].mutex);
+    }
+    free(pool->regions);
+    pool->regions = NULL;
+    pool->num_regions = 0;
+    pool->region_size = 0;
+}
+
+// Split the memory of a MEM_REGIONS pool into regions with one free block
+// each. Pools too small for a page per region get a single region.
+static bool regions_init(mem_pool *pool, size_t size) {
+    int count = POOL_REGIONS;
+    if (pool->flags & MEM_CPU_ARENAS) {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        count = cpus < 1 ? 1 : cpus > POOL_MAX_ARENAS ? POOL_MAX_ARENAS : (int)cpus;
+    }
+    size_t region_size = (size / count) & ~(size_t)(POOL_ALIGN - 1);
+    if (region_size == 0) {
+        count = 1;
+    }
+    pool->regions = calloc(count, sizeof(mem_pool));
+    if (pool->regions == NULL) {
+        return false;
+    }
+    pool->region_size = region_size > 0 ? region_size : size;
+
+    for (int r = 0; r < count; r++) {
+        mem_pool *region = &pool->regions[r];
+        pthread_mutex_init(&region->mutex, NULL);
+        pool->num_regions++;
+        region->flags = pool->flags & (MEM_ALIGN_16 | MEM_ALIGN_64 | MEM_LAZY_COALESCE | MEM_FIT_MASK);
+        region->min_align = pool->min_align;
+        region->memorypool = (char*)pool->memorypool + r * pool->region_size;
+        region->unused_blocks = NO_BLOCK;
+        region->rover = NO_BLOCK;
+        memset(region->free_lists, 0xff, sizeof(region->free_lists));
+        size_t bytes = r < count - 1 ? pool->region_size : size - r * pool->region_size;
+        region->chunks[0] = (pool_chunk){region->memorypool, bytes, 0, NO_BLOCK};
+        region->num_chunks = 1;
+        if (!blocks_init(region)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sampling heap profile. Allocated bytes are sampled as a Poisson process,
+// every thread counts down a random number of bytes with a mean of
+// profile_rate and the allocation that crosses zero gets its call stack
+// recorded. A sample of size bytes stands for size / (1 - e^(-size / rate))
+// bytes, which keeps the estimates unbiased for small and large blocks.
+// Everything is mapped once with mmap and never freed, so sampling takes no
+// allocation that could come back into a pool and the lock-free checks in
+// the free path never read unmapped memory.
+#define PROFILE_DEPTH 32                  // Frames kept per call stack
+#define PROFILE_MAX_STACKS 65536          // Distinct call stacks, later ones count as one unknown stack
+#define PROFILE_MAX_SAMPLES (1 << 20)     // Live samples, allocations past that aren't sampled
+#define PROFILE_BUCKETS 65536             // Sampled addresses by hash, mostly empty
+#define PROFILE_DEFAULT_RATE (512 * 1024)
+#define PROFILE_NONE UINT_MAX
+
+typedef struct profile_stack {
+    uint64_t hash;
+    int depth;
+    void *frames[PROFILE_DEPTH];       // Innermost first, as backtrace gives them
+    double live_bytes;                 // Estimated bytes allocated here and not freed yet
+    double alloc_bytes;                // Estimated bytes allocated here since profiling started
+} profile_stack;
+
+typedef struct profile_sample {
+    void *address;
+    unsigned int stack;
+    unsigned int next;                 // Next sample in the bucket, or on the unused list
+    double bytes;                      // Bytes this sample stands for
+} profile_sample;
+
+// Taken only for sampled allocations and frees of sampled blocks
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t profile_dump_mutex = PTHREAD_MUTEX_INITIALIZER;  // One dump at a time
+static bool profile_on = false;        // Read without the mutex
+static size_t profile_rate = PROFILE_DEFAULT_RATE;
+static char profile_path[PATH_MAX];    // Written at mem_deinit and on the dump signal
+static profile_stack *profile_stacks;  // The first is the unknown stack
+static profile_stack *profile_snapshot; // Copy of profile_stacks a dump works on
+static unsigned int profile_num_stacks;
+static unsigned int *profile_stack_slots; // Open addressing over stack indexes, twice the stacks
+static profile_sample *profile_samples;
+static unsigned int profile_used_samples; // Entries ever handed out
+static unsigned int profile_unused_samples; // Entries given back, linked through next
+static unsigned int *profile_buckets;  // NULL until profiling first starts
+
+static __thread int64_t tprofile_left __attribute__((tls_model("initial-exec"))); // Bytes to the next sample
+static __thread uint64_t tprofile_seed __attribute__((tls_model("initial-exec"))); // 0 until the thread first allocates
+static __thread bool tprofile_busy __attribute__((tls_model("initial-exec")));     // Sampling or dumping, allocations aren't sampled
+
+static sem_t profile_dump_sem;         // Posted by the signal handler
+static bool profile_dumper_started = false;
+
+// Bytes to the next sample, exponentially distributed with a mean of profile_rate
+static int64_t profile_interval() {
+    tprofile_seed ^= tprofile_seed << 13;
+    tprofile_seed ^= tprofile_seed >> 7;
+    tprofile_seed ^= tprofile_seed << 17;
+    double uniform = ((tprofile_seed >> 11) + 1) * (1.0 / 9007199254740993.0);  // In (0, 1)
+    return (int64_t)(-log(uniform) * profile_rate) + 1;
+}
+
+static size_t profile_bucket(void *address) {
+    return ((uintptr_t)address * 0x9E3779B97F4A7C15ULL >> 48) & (PROFILE_BUCKETS - 1);
+}
+
+// Index of the stack with these frames, added if it's new, the caller holds profile_mutex
+static unsigned int profile_stack_find(void **frames, int depth) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ULL;
+    }
+    size_t mask = 2 * PROFILE_MAX_STACKS - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        unsigned int index = profile_stack_slots[slot];
+        if (index == PROFILE_NONE) {
+            if (profile_num_stacks == PROFILE_MAX_STACKS) {
+                return 0;
+            }
+            index = profile_num_stacks++;
+            profile_stack *stack = &profile_stacks[index];
+            stack->hash = hash;
+            stack->depth = depth;
+            memcpy(stack->frames, frames, depth * sizeof(void*));
+            stack->live_bytes = 0;
+            stack->alloc_bytes = 0;
+            profile_stack_slots[slot] = index;
+            return index;
+        }
+        profile_stack *stack = &profile_stacks[index];
+        if (stack->hash == hash && stack->depth == depth && memcmp(stack->frames, frames, depth * sizeof(void*)) == 0) {
+            return index;
+        }
+    }
+}
+
+// Record the call stack of an allocation whose bytes crossed the sampling countdown
+static __attribute__((noinline)) void profile_record(void *address, size_t size) {
+    if (tprofile_busy) {
+        tprofile_left = profile_rate;  // backtrace itself may allocate
+        return;
+    }
+    if (tprofile_seed == 0) {
+        // A thread's first allocation only starts its countdown
+        tprofile_seed = ((uintptr_t)&tprofile_seed ^ clock_ms()) | 1;
+        tprofile_left = profile_interval();
+        return;
+    }
+    tprofile_left = profile_interval();
+
+    void *frames[PROFILE_DEPTH];
+    tprofile_busy = true;
+    int depth = backtrace(frames, PROFILE_DEPTH);
+    tprofile_busy = false;
+    double bytes = size / (1.0 - exp(-(double)size / profile_rate));
+
+    pthread_mutex_lock(&profile_mutex);
+    unsigned int index = profile_unused_samples;
+    if (!profile_on) {
+        index = PROFILE_NONE;  // Stopped meanwhile
+    } else if (index != PROFILE_NONE) {
+        profile_unused_samples = profile_samples[index].next;
+    } else if (profile_used_samples < PROFILE_MAX_SAMPLES) {
+        index = profile_used_samples++;
+    }
+    if (index != PROFILE_NONE) {
+        profile_sample *sample = &profile_samples[index];
+        size_t bucket = profile_bucket(address);
+        sample->address = address;
+        sample->stack = profile_stack_find(frames, depth);
+        sample->bytes = bytes;
+        sample->next = profile_buckets[bucket];
+        __atomic_store_n(&profile_buckets[bucket], index, __ATOMIC_RELEASE);
+        profile_stacks[sample->stack].live_bytes += bytes;
+        profile_stacks[sample->stack].alloc_bytes += bytes;
+    }
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+// Count an allocation against the countdown of the thread, one branch while profiling is off
+static inline void profile_alloc(void *address, size_t size) {
+    if (__atomic_load_n(&profile_on, __ATOMIC_RELAXED) && address != NULL && size > 0 &&
+        (tprofile_left -= size) < 0) {
+        profile_record(address, size);
+    }
+}
+
+// Drop the sample of a freed block, the caller holds profile_mutex
+static void profile_unlink(unsigned int *link) {
+    profile_sample *sample = &profile_samples[*link];
+    unsigned int index = *link;
+    profile_stacks[sample->stack].live_bytes -= sample->bytes;
+    __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+    sample->next = profile_unused_samples;
+    profile_unused_samples = index;
+}
+
+static __attribute__((noinline)) void profile_forget(void *address) {
+    pthread_mutex_lock(&profile_mutex);
+    for (unsigned int *link = &profile_buckets[profile_bucket(address)]; *link != PROFILE_NONE;
+         link = &profile_samples[*link].next) {
+        if (profile_samples[*link].address == address) {
+            profile_unlink(link);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+// Frees only take the profile mutex when a sampled block hashes to the same bucket
+static inline void profile_free(void *address) {
+    unsigned int *buckets = __atomic_load_n(&profile_buckets, __ATOMIC_ACQUIRE);
+    if (buckets != NULL && address != NULL &&
+        __atomic_load_n(&buckets[profile_bucket(address)], __ATOMIC_RELAXED) != PROFILE_NONE) {
+        profile_forget(address);
+    }
+}
+
+// Drop the samples of every block of a pool that goes away
+static void profile_forget_pool(mem_pool *pool) {
+    if (__atomic_load_n(&profile_buckets, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&profile_mutex);
+    for (size_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        unsigned int *link = &profile_buckets[bucket];
+        while (*link != PROFILE_NONE) {
+            char *address = profile_samples[*link].address;
+            bool inside = false;
+            for (int c = 0; c < pool->num_chunks && !inside; c++) {
+                inside = address >= pool->chunks[c].memory && address < pool->chunks[c].memory + pool->chunks[c].size;
+            }
+            if (inside) {
+                profile_unlink(link);
+            } else {
+                link = &profile_samples[*link].next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+// Name of a frame for a folded stack: the function, else module+offset
+static void profile_frame_name(const char *symbol, char *name, size_t length) {
+    const char *open = strchr(symbol, '(');
+    const char *close = open != NULL ? strchr(open, ')') : NULL;
+    if (open != NULL && close != NULL && open[1] != '+' && open[1] != ')') {
+        const char *end = memchr(open, '+', close - open);
+        snprintf(name, length, "%.*s", (int)((end != NULL ? end : close) - open - 1), open + 1);
+    } else if (open != NULL && close != NULL) {
+        const char *module = memrchr(symbol, '/', open - symbol);
+        module = module != NULL ? module + 1 : symbol;
+        snprintf(name, length, "%.*s%.*s", (int)(open - module), module, (int)(close - open - 1), open + 1);
+    } else {
+        snprintf(name, length, "%s", symbol);
+    }
+    for (char *c = name; *c != '\0'; c++) {
+        if (*c == ';' || *c == ' ') {
+            *c = '_';  // Separators of the folded format
+        }
+    }
+}
+
+// Write one folded line per stack with a non-zero value, outermost frame first
+static void profile_write_folded(FILE *file, unsigned int num_stacks, bool live) {
+    Dl_info self;
+    bool know_self = dladdr((void*)profile_record, &self) != 0;
+    for (unsigned int index = 0; index < num_stacks; index++) {
+        profile_stack *stack = &profile_snapshot[index];
+        double bytes = live ? stack->live_bytes : stack->alloc_bytes;
+        if (bytes < 0.5) {
+            continue;
+        }
+        if (index == 0) {
+            fprintf(file, "[unknown] %.0f\n", bytes);  // Stacks past PROFILE_MAX_STACKS
+            continue;
+        }
+        // The profiler's and allocator's own frames are left out
+        int first = 0;
+        Dl_info info;
+        while (know_self && first < stack->depth && dladdr(stack->frames[first], &info) != 0 &&
+               info.dli_fbase == self.dli_fbase) {
+            first++;
+        }
+        if (first == stack->depth) {
+            first = 0;  // Linked into the program, nothing tells the frames apart
+        }
+        char **symbols = backtrace_symbols(stack->frames, stack->depth);
+        for (int i = stack->depth - 1; i >= first; i--) {
+            char name[256];
+            if (symbols != NULL) {
+                profile_frame_name(symbols[i], name, sizeof(name));
+            } else {
+                snprintf(name, sizeof(name), "%p", stack->frames[i]);
+            }
+            fprintf(file, "%s%s", name, i > first ? ";" : "");
+        }
+        fprintf(file, " %.0f\n", bytes);
+        free(symbols);
+    }
+}
+
+static bool profile_write(const char *path) {
+    if (__atomic_load_n(&profile_buckets, __ATOMIC_ACQUIRE) == NULL || path == NULL || path[0] == '\0') {
+        return false;
+    }
+    bool busy = tprofile_busy;
+    tprofile_busy = true;  // The dump's own allocations aren't sampled
+    pthread_mutex_lock(&profile_dump_mutex);
+    pthread_mutex_lock(&profile_mutex);
+    unsigned int num_stacks = profile_num_stacks;
+    memcpy(profile_snapshot, profile_stacks, num_stacks * sizeof(profile_stack));
+    pthread_mutex_unlock(&profile_mutex);
 
-    memorypool = malloc(size);
-    head = malloc(sizeof(mem_struct));
+    char alloc_path[PATH_MAX + 8];
+    snprintf(alloc_path, sizeof(alloc_path), "%s.alloc", path);
+    FILE *live = fopen(path, "w");
+    FILE *alloc = fopen(alloc_path, "w");
+    if (live != NULL) {
+        profile_write_folded(live, num_stacks, true);
+    }
+    if (alloc != NULL) {
+        profile_write_folded(alloc, num_stacks, false);
+    }
+    bool written = live != NULL && alloc != NULL;
+    written &= live == NULL || fclose(live) == 0;
+    written &= alloc == NULL || fclose(alloc) == 0;
+    pthread_mutex_unlock(&profile_dump_mutex);
+    tprofile_busy = busy;
+    return written;
+}
 
-    if (head == NULL || memorypool == NULL) {
-        pthread_mutex_unlock(&memory_mutex);
-        return;  // Failed to initialize memory
+// Map the profile's tables, the caller holds profile_mutex
+static bool profile_map() {
+    size_t stacks = PROFILE_MAX_STACKS * sizeof(profile_stack);
+    size_t slots = 2 * PROFILE_MAX_STACKS * sizeof(unsigned int);
+    size_t samples = PROFILE_MAX_SAMPLES * sizeof(profile_sample);
+    size_t buckets = PROFILE_BUCKETS * sizeof(unsigned int);
+    char *memory = mmap(NULL, 2 * stacks + slots + samples + buckets, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
     }
+    profile_stacks = (profile_stack*)memory;
+    profile_snapshot = (profile_stack*)(memory + stacks);
+    profile_stack_slots = (unsigned int*)(memory + 2 * stacks);
+    profile_samples = (profile_sample*)(memory + 2 * stacks + slots);
+    unsigned int *bucket_table = (unsigned int*)(memory + 2 * stacks + slots + samples);
+    memset(bucket_table, 0xff, buckets);
+    __atomic_store_n(&profile_buckets, bucket_table, __ATOMIC_RELEASE);
+    return true;
+}
 
-    // Initialize the first block
-    head->memaddress = memorypool;
-    head->next = NULL;
-    head->available = true;
-    head->size = size;
+// Start a new profile, forgetting the samples of the last one
+bool mem_profile_start(size_t sample_bytes, const char *path) {
+    void *frame;
+    backtrace(&frame, 1);  // Loads the unwinder, which allocates, before any sample needs it
 
-    pthread_mutex_unlock(&memory_mutex);
-    return;
+    pthread_mutex_lock(&profile_mutex);
+    if (profile_buckets == NULL && !profile_map()) {
+        pthread_mutex_unlock(&profile_mutex);
+        return false;
+    }
+    profile_rate = sample_bytes > 0 ? sample_bytes : PROFILE_DEFAULT_RATE;
+    snprintf(profile_path, sizeof(profile_path), "%s", path != NULL ? path : "");
+    for (size_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        __atomic_store_n(&profile_buckets[bucket], PROFILE_NONE, __ATOMIC_RELAXED);
+    }
+    memset(profile_stack_slots, 0xff, 2 * PROFILE_MAX_STACKS * sizeof(unsigned int));
+    memset(&profile_stacks[0], 0, sizeof(profile_stack));
+    profile_num_stacks = 1;
+    profile_used_samples = 0;
+    profile_unused_samples = PROFILE_NONE;
+    __atomic_store_n(&profile_on, true, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&profile_mutex);
+    return true;
 }
 
-// Allocate memory from the pool
-void *mem_alloc(size_t size) {
-    pthread_mutex_lock(&memory_mutex);
+// Stop sampling, blocks sampled so far keep being tracked until they're freed
+void mem_profile_stop() {
+    __atomic_store_n(&profile_on, false, __ATOMIC_RELAXED);
+}
+
+bool mem_profile_write(const char *path) {
+    return profile_write(path);
+}
+
+static void profile_signal_handler(int signo) {
+    (void)signo;
+    sem_post(&profile_dump_sem);  // Async-signal-safe, the dump runs on its own thread
+}
+
+static void *profile_dumper_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (sem_wait(&profile_dump_sem) == 0) {
+            pthread_mutex_lock(&profile_mutex);
+            char path[PATH_MAX];
+            memcpy(path, profile_path, sizeof(path));
+            pthread_mutex_unlock(&profile_mutex);
+            profile_write(path);
+        }
+    }
+    return NULL;
+}
+
+// Write the profile to the path given to mem_profile_start whenever signo arrives
+bool mem_profile_dump_on_signal(int signo) {
+    pthread_mutex_lock(&profile_dump_mutex);
+    if (!profile_dumper_started) {
+        pthread_attr_t attr;
+        pthread_t thread;
+        sem_init(&profile_dump_sem, 0, 0);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        profile_dumper_started = pthread_create(&thread, &attr, profile_dumper_thread, NULL) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&profile_dump_mutex);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return profile_dumper_started && sigaction(signo, &action, NULL) == 0;
+}
+
+// Start profiling from the environment: MEM_PROFILE=path, MEM_PROFILE_RATE=bytes
+// and MEM_PROFILE_SIGNAL=signal number for dumps on demand. Runs when the library
+// is loaded, starting takes allocations that mem_init_ex can't make when it sets
+// up the pool of a malloc replacement.
+__attribute__((constructor)) static void profile_start_from_env() {
+    const char *path = getenv("MEM_PROFILE");
+    if (path == NULL || path[0] == '\0' || __atomic_load_n(&profile_on, __ATOMIC_RELAXED)) {
+        return;
+    }
+    const char *rate = getenv("MEM_PROFILE_RATE");
+    const char *signo = getenv("MEM_PROFILE_SIGNAL");
+    if (mem_profile_start(rate != NULL ? strtoul(rate, NULL, 10) : 0, path) && signo != NULL) {
+        mem_profile_dump_on_signal(atoi(signo));
+    }
+}
+
+// Set up a pool of size bytes with the layout selected by flags
+static void pool_setup(mem_pool *pool, size_t size, unsigned int flags) {
+#ifdef MEM_LOCK_PROFILE
+    memset(&pool->lock_stats, 0, sizeof(pool->lock_stats));  // Before the mutex, its acquisition counts
+#endif
+    pool_lock(pool, MEM_LOCK_OTHER);
+
+    // Buddy pools ignore the other layout flags. Thread caches need the block
+    // size from the pointer, so they use the in-band layout.
+    if (flags & MEM_BUDDY) {
+        flags &= MEM_BUDDY | MEM_ALIGN_16 | MEM_ALIGN_64 | MEM_MAP_FLAGS;
+    } else if (flags & MEM_THREAD_CACHE) {
+        flags |= MEM_IN_BAND;
+    }
+    if (flags & MEM_CPU_ARENAS) {
+        flags |= MEM_REGIONS;
+    }
+    if (flags & MEM_IN_BAND) {
+        flags &= ~(MEM_REGIONS | MEM_CPU_ARENAS);
+    } else if (flags & MEM_REGIONS) {
+        flags &= ~MEM_GROW;  // Regions are laid out once
+    }
+    if (flags & MEM_MAP_FLAGS) {
+        flags |= MEM_MMAP;
+    }
+    pool->flags = flags;
+    pool->min_align = (flags & MEM_ALIGN_64) ? 64 : (flags & MEM_ALIGN_16) ? 16 : 1;
+    if ((flags & (MEM_IN_BAND | MEM_BUDDY)) && pool->min_align < TAG_ALIGN) {
+        pool->min_align = TAG_ALIGN;
+    }
+    size_t mapped = 0;
+    unsigned int fit = flags & MEM_FIT_MASK;
+    if ((fit & (fit - 1)) != 0) {
+        pool->memorypool = NULL;  // More than one placement policy
+    } else if (flags & MEM_MMAP) {
+        pool->memorypool = map_chunk(size > 0 ? size : 1, flags, &mapped);
+    } else if (posix_memalign(&pool->memorypool, POOL_ALIGN, size > 0 ? size : 1) != 0) {
+        pool->memorypool = NULL;
+    }
+    pool->num_chunks = 0;
+    if (pool->memorypool != NULL) {
+        pool->chunks[0] = (pool_chunk){pool->memorypool, size, mapped, NO_BLOCK};
+        pool->num_chunks = 1;
+    }
+    pool->release_ms = 0;
+    pool->used_bytes = 0;
+    pool->used_blocks = 0;
+    pool->peak_bytes = 0;
+    memset(pool->retired, 0, sizeof(pool->retired));
+    pool->rover = NO_BLOCK;
+    pool->rover_chunk = 0;
+    pool->regions = NULL;
+    pool->num_regions = 0;
+    pool->region_size = 0;
+    pool->blocks = NULL;
+    pool->max_blocks = 0;
+    pool->num_blocks = 0;
+    pool->unused_blocks = NO_BLOCK;
+    pool->live_blocks = 0;
+    pool->unmerged = 0;
+    pool->hash = NULL;
+    pool->hash_slots = 0;
+    pool->hash_used = 0;
+    memset(pool->free_lists, 0xff, sizeof(pool->free_lists));
+    memset(pool->class_bitmap, 0, sizeof(pool->class_bitmap));
+
+    if (pool->memorypool != NULL && (flags & MEM_IN_BAND)) {
+        tag_init(pool, size);
+    } else if (pool->memorypool != NULL && (flags & MEM_BUDDY)) {
+        if (!buddy_init(pool, size)) {
+            buddy_deinit(pool);
+            pool_unmap(pool);  // Failed to initialize memory
+        }
+    } else if (pool->memorypool != NULL && (flags & MEM_REGIONS)) {
+        if (!regions_init(pool, size)) {
+            regions_teardown(pool);
+            pool_unmap(pool);  // Failed to initialize memory
+        }
+    } else if (pool->memorypool != NULL && !blocks_init(pool)) {
+        pool_unmap(pool);  // Failed to initialize memory
+    }
+
+    pool_unlock(pool, MEM_LOCK_OTHER);
+
+    // Register the pool under a fresh id
+    pthread_mutex_lock(&pools_mutex);
+    pool->id = ++last_pool_id;
+    pool->next_pool = pools;
+    pools = pool;
+    pthread_mutex_unlock(&pools_mutex);
+}
+
+// Give back everything a pool owns
+static void pool_teardown(mem_pool *pool) {
+    // Once unregistered no thread cache flushes into the pool anymore
+    pthread_mutex_lock(&pools_mutex);
+    for (mem_pool **link = &pools; *link != NULL; link = &(*link)->next_pool) {
+        if (*link == pool) {
+            *link = pool->next_pool;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pools_mutex);
+    profile_forget_pool(pool);
+
+    pool_lock(pool, MEM_LOCK_OTHER);
+
+    if (pool->regions != NULL) {
+        regions_teardown(pool);
+    }
+    pool_unmap(pool); // Free the memorypool
+    // All metadata goes in one go
+    blocks_unmap(pool);
+    // Set variables to NULL
+    pool->blocks = NULL;
+    pool->max_blocks = 0;
+    pool->num_blocks = 0;
+    pool->unused_blocks = NO_BLOCK;
+    pool->live_blocks = 0;
+    pool->unmerged = 0;
+    pool->hash = NULL;
+    pool->hash_slots = 0;
+    pool->hash_used = 0;
+    pool->release_ms = 0;
+    pool->used_bytes = 0;
+    pool->used_blocks = 0;
+    pool->peak_bytes = 0;
+    memset(pool->retired, 0, sizeof(pool->retired));
+    pool->rover = NO_BLOCK;
+    pool->rover_chunk = 0;
+    memset(pool->free_lists, 0xff, sizeof(pool->free_lists));
+    memset(pool->tag_lists, 0, sizeof(pool->tag_lists));
+    memset(pool->class_bitmap, 0, sizeof(pool->class_bitmap));
+    pool->tag_start = NULL;
+    pool->tag_end = NULL;
+    buddy_deinit(pool);
+    pool->flags = 0;
+    pool->min_align = 0;
+    pool->id = 0;
+
+    pool_unlock(pool, MEM_LOCK_OTHER);
+}
+
+// Start or stop releasing the free pages of a pool after delay_ms
+void mem_pool_set_release_delay(mem_pool *pool, unsigned int delay_ms) {
+    pthread_mutex_lock(&pools_mutex);
+    pool->release_ms = delay_ms;
+    pool->next_release = clock_ms() + delay_ms;
+    if (delay_ms > 0 && !releaser_started) {
+        pthread_attr_t attr;
+        pthread_t thread;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        releaser_started = pthread_create(&thread, &attr, releaser_thread, NULL) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    pthread_cond_signal(&release_cond);
+    pthread_mutex_unlock(&pools_mutex);
+}
+
+// Create a pool with its own memory, metadata and lock
+mem_pool *mem_pool_create(size_t size, unsigned int flags) {
+    mem_pool *pool = calloc(1, sizeof(mem_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+
+    pool_setup(pool, size, flags);
+    if (pool->memorypool == NULL) {
+        mem_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
 
+// Allocate size bytes aligned to alignment without the thread cache, the
+// caller holds the pool mutex
+static void *pool_alloc_locked(mem_pool *pool, size_t size, size_t alignment) {
     if (size == 0) {
-        pthread_mutex_unlock(&memory_mutex);
-        return memorypool;  // Invalid allocation request
+        return pool->memorypool;  // Invalid allocation request
     }
 
-    mem_struct *current = head;
+    if (pool->flags & MEM_BUDDY) {
+        // Blocks are aligned to their own size, up to the alignment of the pool
+        return alignment <= POOL_ALIGN ? buddy_alloc(pool, size < alignment ? alignment : size) : NULL;
+    }
 
-    // Traverse the list to find a suitable block
-    while (current != NULL) {
-        if (current->available && current->size >= size) {
-            // Check if the block can be split
-            if (current->size > size) {
-                mem_struct* new_block = malloc(sizeof(mem_struct));
-
-                new_block->available = true;
-                new_block->size = current->size - size;
-                new_block->memaddress = current->memaddress + size;
-                new_block->next = current->next;
-
-                current->next = new_block;
-                current->size = size;
-                current->available = false;
-            } else {
-                current->available = false;
-            }
-            pthread_mutex_unlock(&memory_mutex);
-            return (char*)current->memaddress;
+    if (pool->flags & MEM_IN_BAND) {
+        void *address = tag_alloc_aligned(pool, size, alignment);
+        thread_cache *cache = (pool->flags & MEM_THREAD_CACHE) ? cache_find(pool) : NULL;
+        if (address == NULL && cache != NULL) {
+            // Blocks held by our own cache might be what is missing
+            cache_flush(cache, 0);
+            address = tag_alloc_aligned(pool, size, alignment);
         }
-        current = current->next;
+        return address;
     }
 
-    pthread_mutex_unlock(&memory_mutex);
-    return NULL;  // No suitable block found
+    // Block sizes stay multiples of the minimum alignment, so every block starts aligned
+    size_t rounded = (size + pool->min_align - 1) & ~(pool->min_align - 1);
+    unsigned int index = rounded >= size ? alloc_block(pool, rounded, alignment) : NO_BLOCK;
+    if (index == NO_BLOCK && rounded >= size && pool->unmerged > 0) {
+        // Lazily freed blocks might add up to enough
+        coalesce_blocks(pool);
+        index = alloc_block(pool, rounded, alignment);
+    }
+    if (index == NO_BLOCK && rounded >= size && (pool->flags & MEM_GROW) &&
+        rounded <= (size_t)-1 - alignment && pool_grow(pool, rounded + alignment)) {
+        index = alloc_block(pool, rounded, alignment);
+    }
+    return index != NO_BLOCK ? pool->blocks[index].memaddress : NULL;
 }
 
-// Free memory and coalesce adjacent free blocks
-void coalesce_free_blocks() {
-    mem_struct *current = head;
-
-    while (current != NULL && current->next != NULL) {
-        // Check if current block and next block are both available
-        if (current->available && current->next->available) {
-            // Merge current block with the next block
-            current->size += current->next->size;
-            
-            // Skip over the next block by adjusting the 'next' pointer
-            mem_struct *next_block = current->next;
-            current->next = next_block->next;
-            free(next_block);
-        } else {
-            // Move to the next block in the list
-            current = current->next;
+// Region of a MEM_REGIONS pool holding address, NULL if the pool doesn't
+static mem_pool *region_of(mem_pool *pool, void *address) {
+    uintptr_t offset = (uintptr_t)address - (uintptr_t)pool->memorypool;
+    if (pool->num_chunks == 0 || offset >= pool->chunks[0].size) {
+        return NULL;
+    }
+    size_t r = offset / pool->region_size;
+    return &pool->regions[r < (size_t)pool->num_regions ? r : (size_t)pool->num_regions - 1];
+}
+
+// First region tried for a size, every factor of four from 64 bytes up moves
+// one region further
+static int size_region(mem_pool *pool, size_t size) {
+    int shift = 63 - __builtin_clzll(size);
+    int r = shift > MIN_CLASS_SHIFT ? (shift - MIN_CLASS_SHIFT) / 2 : 0;
+    return r < pool->num_regions ? r : pool->num_regions - 1;
+}
+
+// CPU the thread runs on. Where the kernel supports restartable sequences
+// glibc registers an rseq area for every thread, whose cpu_id the kernel
+// keeps current, so it is a plain load. The thread may move on right after,
+// which only costs sharing a region lock for a while.
+static int current_cpu() {
+#if __has_include(<sys/rseq.h>)
+    if (__rseq_size > 0) {
+        struct rseq *area = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+        int cpu = (int)__atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED);
+        if (cpu >= 0) {
+            return cpu;
         }
     }
+#endif
+    int cpu = sched_getcpu();
+    return cpu >= 0 ? cpu : 0;
 }
 
-void mem_free(void* block) {
-    pthread_mutex_lock(&memory_mutex);
+// Allocate from the region of the size, or of the CPU for MEM_CPU_ARENAS, or
+// the regions after it when it is full, taking one region lock at a time
+static void *region_alloc(mem_pool *pool, size_t size, size_t alignment) {
+    if (size == 0) {
+        return pool->memorypool;  // Invalid allocation request
+    }
+    int first = (pool->flags & MEM_CPU_ARENAS) ? current_cpu() % pool->num_regions : size_region(pool, size);
+    for (int i = 0; i < pool->num_regions; i++) {
+        mem_pool *region = &pool->regions[(first + i) % pool->num_regions];
+        pool_lock(region, MEM_LOCK_ALLOC);
+        void *address = pool_alloc_locked(region, size, alignment);
+        pool_unlock(region, MEM_LOCK_ALLOC);
+        if (address != NULL) {
+            return address;
+        }
+    }
+    return NULL;
+}
+
+// Allocate size bytes aligned to alignment, a power of two
+static void *pool_alloc(mem_pool *pool, size_t size, size_t alignment) {
+    if (alignment < pool->min_align) {
+        alignment = pool->min_align;
+    }
+#ifdef MEM_DEBUG
+    size_t payload_size = size;
+    size_t front = debug_front(alignment);
+    size = size > 0 ? debug_padded(size, front) : 0;
+    if (size == 0 && payload_size > 0) {
+        stats_add(pool, STAT_FAILURES, 1);
+        return NULL;
+    }
+#endif
+    void *address = NULL;
+    if ((pool->flags & MEM_THREAD_CACHE) && size > 0 && alignment == pool->min_align) {
+        address = cache_alloc(pool, size);
+    }
+
+    if (pool->regions != NULL) {
+        address = region_alloc(pool, size, alignment);
+    } else if (address == NULL) {
+        pool_lock(pool, MEM_LOCK_ALLOC);
+        address = pool_alloc_locked(pool, size, alignment);
+        pool_unlock(pool, MEM_LOCK_ALLOC);
+    }
+#ifdef MEM_DEBUG
+    size = payload_size;
+    if (address != NULL && size > 0) {
+        address = debug_arm(address, size, front);
+    }
+#endif
+    if (size > 0) {
+        stats_add(pool, address != NULL ? STAT_ALLOCS : STAT_FAILURES, 1);
+    }
+    profile_alloc(address, size);
+    return address;
+}
+
+// Allocate memory from a pool
+void *mem_pool_alloc(mem_pool *pool, size_t size) {
+    return pool_alloc(pool, size, 1);
+}
+
+// Allocate memory aligned to alignment from a pool, NULL unless alignment is a power of two
+void *mem_pool_alloc_aligned(mem_pool *pool, size_t size, size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    return pool_alloc(pool, size, alignment);
+}
+
+// Free a block without the thread cache, the caller holds the pool mutex
+static void pool_free_locked(mem_pool *pool, void *block) {
     if (block == NULL) {
-        //debug
-        // printf("Warning: Trying to free a NULL pointer.\n");
-        pthread_mutex_unlock(&memory_mutex);
         return;
     }
 
-    mem_struct *current = head;
+    if (pool->flags & MEM_BUDDY) {
+        int order = buddy_find(pool, block);
+        if (order >= 0) {
+            buddy_release(pool, block, order);
+        } else {
+            debug_report("free", "unknown block", block);
+        }
+        return;
+    }
+
+    if (pool->flags & MEM_IN_BAND) {
+        // Unknown and already free blocks are ignored here as well
+        tag_block *tag = tag_lookup(pool, block);
+        if (tag != NULL) {
+            tag_release(pool, tag);
+        } else {
+            debug_report("free", "unknown block", block);
+        }
+        return;
+    }
 
-    // Traverse the linked list 
-    while (current != NULL) {
-        // Check if the requested block is the current block
-        if (current->memaddress == block) {
-            if (!current->available) {
-                // Free the block
-                current->available = true;
-                coalesce_free_blocks();
-                pthread_mutex_unlock(&memory_mutex);
-                return;
-            } else {
-                //debug
-                // printf("Error: Block at address %p is already free.\n", block);
-                pthread_mutex_unlock(&memory_mutex);
-                return;
+    unsigned int index = find_block(pool, block);
+    if (index == NO_BLOCK) {
+        debug_report("free", "unknown block", block);
+        return;
+    }
+    if (pool->blocks[index].available) {
+        debug_report("free", "freed already", block);
+        return;
+    }
+
+    // Free the block
+    release_block(pool, index);
+}
+
+// Free a block of a MEM_REGIONS pool under the lock of its region
+static void region_free(mem_pool *pool, void *block) {
+    mem_pool *region = region_of(pool, block);
+    if (region == NULL) {
+        return;  // Not a block of the pool
+    }
+    pool_lock(region, MEM_LOCK_FREE);
+    pool_free_locked(region, block);
+    pool_unlock(region, MEM_LOCK_FREE);
+}
+
+// Resize a block of a MEM_REGIONS pool within its region, or move it to
+// another region when its own is full
+static void *region_resize(mem_pool *pool, void *block, size_t size) {
+    mem_pool *region = region_of(pool, block);
+    if (region == NULL) {
+        return NULL;  // Block not found
+    }
+    pool_lock(region, MEM_LOCK_RESIZE);
+    unsigned int index = find_block(region, block);
+    size_t old_size = index != NO_BLOCK ? region->blocks[index].size : 0;
+    void *address = index != NO_BLOCK ? resize_block(region, block, size) : NULL;
+    pool_unlock(region, MEM_LOCK_RESIZE);
+    if (address != NULL || index == NO_BLOCK || old_size >= size) {
+        return address;
+    }
+
+    // The caller owns the block, so it is copied without holding a lock
+    address = region_alloc(pool, size, pool->min_align);
+    if (address != NULL) {
+        memcpy(address, block, old_size);
+        region_free(pool, block);
+    }
+    return address;
+}
+
+void mem_pool_free(mem_pool *pool, void* block) {
+    if (block != NULL) {
+        stats_add(pool, STAT_FREES, 1);
+    }
+    profile_free(block);
+#ifdef MEM_DEBUG
+    if (block != NULL && (block = debug_release(pool, block)) == NULL) {
+        return;
+    }
+#endif
+    if (pool->regions != NULL) {
+        region_free(pool, block);
+        return;
+    }
+    if ((pool->flags & MEM_THREAD_CACHE) && block != NULL && cache_free(pool, block)) {
+        return;
+    }
+
+    pool_lock(pool, MEM_LOCK_FREE);
+    pool_free_locked(pool, block);
+    pool_unlock(pool, MEM_LOCK_FREE);
+}
+
+// Allocate count blocks of the given sizes in one critical section. Either
+// all of them are allocated or none, in which case blocks is set to NULL.
+bool mem_pool_alloc_batch(mem_pool *pool, void **blocks, const size_t *sizes, size_t count) {
+#ifdef MEM_DEBUG
+    // Block by block, each gets its redzones
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = pool_alloc(pool, sizes[i], pool->min_align);
+        if (blocks[i] != NULL || sizes[i] == 0) {
+            continue;
+        }
+        while (i-- > 0) {
+            if (sizes[i] > 0) {
+                mem_pool_free(pool, blocks[i]);
+            }
+        }
+        memset(blocks, 0, count * sizeof(void*));
+        return false;
+    }
+    return true;
+#else
+    if (pool->regions != NULL) {
+        // Block by block, each under the lock of its region
+        for (size_t i = 0; i < count; i++) {
+            blocks[i] = region_alloc(pool, sizes[i], pool->min_align);
+            if (blocks[i] != NULL) {
+                continue;
+            }
+            while (i-- > 0) {
+                if (sizes[i] > 0) {
+                    region_free(pool, blocks[i]);
+                }
+            }
+            memset(blocks, 0, count * sizeof(void*));
+            stats_add(pool, STAT_FAILURES, 1);
+            return false;
+        }
+        stats_add(pool, STAT_ALLOCS, count);
+        for (size_t i = 0; i < count; i++) {
+            profile_alloc(blocks[i], sizes[i]);
+        }
+        return true;
+    }
+
+    pool_lock(pool, MEM_LOCK_ALLOC);
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = pool_alloc_locked(pool, sizes[i], pool->min_align);
+        if (blocks[i] != NULL) {
+            continue;
+        }
+
+        // Give back what was taken so far, zero sized requests own nothing
+        while (i-- > 0) {
+            if (sizes[i] > 0) {
+                pool_free_locked(pool, blocks[i]);
             }
         }
-        // Go to the next block
-        current = current->next;
+        memset(blocks, 0, count * sizeof(void*));
+        pool_unlock(pool, MEM_LOCK_ALLOC);
+        stats_add(pool, STAT_FAILURES, 1);
+        return false;
     }
-    //debug
-    // printf("Error: Block at address %p not found.\n", block);
-    pthread_mutex_unlock(&memory_mutex);
-    return;
+    pool_unlock(pool, MEM_LOCK_ALLOC);
+    stats_add(pool, STAT_ALLOCS, count);
+    for (size_t i = 0; i < count; i++) {
+        profile_alloc(blocks[i], sizes[i]);
+    }
+    return true;
+#endif
 }
 
-// Resize a memory block
-void *mem_resize(void *block, size_t size) {
-    pthread_mutex_lock(&memory_mutex);
+// Free count blocks in one critical section
+void mem_pool_free_batch(mem_pool *pool, void **blocks, size_t count) {
+    bool locked = false;
+    unsigned long freed = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        void *block = blocks[i];
+        freed += block != NULL;
+        profile_free(block);
+#ifdef MEM_DEBUG
+        if (block != NULL && (block = debug_release(pool, block)) == NULL) {
+            continue;
+        }
+#endif
+        if (pool->regions != NULL) {
+            region_free(pool, block);
+            continue;
+        }
+        if ((pool->flags & MEM_THREAD_CACHE) && block != NULL && cache_free(pool, block)) {
+            continue;
+        }
+        if (!locked) {
+            pool_lock(pool, MEM_LOCK_FREE);
+            locked = true;
+        }
+        pool_free_locked(pool, block);
+    }
+    if (locked) {
+        pool_unlock(pool, MEM_LOCK_FREE);
+    }
+    stats_add(pool, STAT_FREES, freed);
+}
+
+// Copy the lock profile of a pool, false when profiling isn't compiled in
+bool mem_pool_lock_profile(mem_pool *pool, mem_lock_stats *stats) {
+#ifdef MEM_LOCK_PROFILE
+    pthread_mutex_lock(&pool->mutex);  // Reading the profile isn't profiled
+    *stats = pool->lock_stats;
+    pthread_mutex_unlock(&pool->mutex);
+
+    // The regions of a MEM_REGIONS pool add up, every region lock counts
+    for (int r = 0; r < pool->num_regions; r++) {
+        mem_pool *region = &pool->regions[r];
+        pthread_mutex_lock(&region->mutex);
+        for (int op = 0; op < MEM_LOCK_OPS; op++) {
+            stats->acquisitions[op] += region->lock_stats.acquisitions[op];
+            stats->contended[op] += region->lock_stats.contended[op];
+            stats->wait_ns[op] += region->lock_stats.wait_ns[op];
+            stats->hold_ns[op] += region->lock_stats.hold_ns[op];
+            for (int bucket = 0; bucket < MEM_LOCK_BUCKETS; bucket++) {
+                stats->wait_histogram[op][bucket] += region->lock_stats.wait_histogram[op][bucket];
+                stats->hold_histogram[op][bucket] += region->lock_stats.hold_histogram[op][bucket];
+            }
+        }
+        pthread_mutex_unlock(&region->mutex);
+    }
+    return true;
+#else
+    (void)pool;
+    (void)stats;
+    return false;
+#endif
+}
+
+// Print a lock profile to stderr, one line per operation and one per histogram
+void mem_lock_profile_print(const mem_lock_stats *stats) {
+    static const char *names[MEM_LOCK_OPS] = {"alloc", "free", "resize", "other"};
+    fprintf(stderr, "Lock profile:\n  %-8s %12s %12s %12s %12s\n", "op", "acquired", "contended", "wait ns/acq", "hold ns/acq");
+    for (int op = 0; op < MEM_LOCK_OPS; op++) {
+        unsigned long acquisitions = stats->acquisitions[op];
+        if (acquisitions == 0) {
+            continue;
+        }
+        fprintf(stderr, "  %-8s %12lu %12lu %12.1f %12.1f\n", names[op], acquisitions, stats->contended[op],
+                (double)stats->wait_ns[op] / acquisitions, (double)stats->hold_ns[op] / acquisitions);
+    }
+    for (int op = 0; op < MEM_LOCK_OPS; op++) {
+        for (int kind = 0; kind < 2 && stats->acquisitions[op] > 0; kind++) {
+            const unsigned long *histogram = kind == 0 ? stats->wait_histogram[op] : stats->hold_histogram[op];
+            fprintf(stderr, "  %s %s ns:", names[op], kind == 0 ? "wait" : "hold");
+            for (int bucket = 0; bucket < MEM_LOCK_BUCKETS; bucket++) {
+                if (histogram[bucket] > 0) {
+                    fprintf(stderr, " %s%lu:%lu", bucket == MEM_LOCK_BUCKETS - 1 ? ">=" : "", 1UL << bucket, histogram[bucket]);
+                }
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+}
+
+// Resize a block under the lock of the pool or its region
+static void *pool_resize(mem_pool *pool, void *block, size_t size) {
+    void *address;
+    if (pool->regions != NULL) {
+        address = region_resize(pool, block, size);
+    } else {
+        pool_lock(pool, MEM_LOCK_RESIZE);
+        if (pool->flags & MEM_BUDDY) {
+            address = buddy_resize(pool, block, size);
+        } else if (pool->flags & MEM_IN_BAND) {
+            address = tag_resize(pool, block, size);
+        } else {
+            address = resize_block(pool, block, size);
+        }
+        pool_unlock(pool, MEM_LOCK_RESIZE);
+    }
+    return address;
+}
 
+// Resize a memory block of a pool
+void *mem_pool_resize(mem_pool *pool, void *block, size_t size) {
     if (block == NULL) {
-        pthread_mutex_unlock(&memory_mutex);
-        return mem_alloc(size);  // Allocate a new block if NULL
+        return mem_pool_alloc(pool, size);  // Allocate a new block if NULL
+    }
+
+#ifdef MEM_DEBUG
+    // The header and redzones move with the block, the payload gets new ones behind it
+    debug_header *header = debug_check(pool, block, "resize");
+    size_t front = header != NULL ? header->front : 0;
+    size_t old_size = header != NULL ? header->size : 0;
+    size_t padded = debug_padded(size, front);
+    void *address = header != NULL && padded > 0 ? pool_resize(pool, (char*)block - front, padded) : NULL;
+    if (address != NULL) {
+        address = (char*)address + front;
+        debug_header_of(address)->size = size;
+        if (size > old_size) {
+            memset((char*)address + old_size, DEBUG_ALLOC_BYTE, size - old_size);
+        }
+        debug_guard_back(address, size);
+    }
+#else
+    void *address = pool_resize(pool, block, size);
+#endif
+    stats_add(pool, address != NULL ? STAT_RESIZES : STAT_FAILURES, 1);
+    if (address != NULL) {
+        // The resized block counts as a new allocation of size bytes
+        profile_free(block);
+        profile_alloc(address, size);
     }
+    return address;
+}
 
-    mem_struct *current = head;
+// Usable bytes of the used block at block, 0 if there is none
+size_t mem_pool_block_size(mem_pool *pool, void *block) {
+#ifdef MEM_DEBUG
+    // The payload asked for, the rest of the block is redzone
+    debug_header *header = block != NULL ? debug_check(pool, block, "block size") : NULL;
+    return header != NULL ? header->size : 0;
+#else
+    mem_pool *locked = pool->regions != NULL ? region_of(pool, block) : pool;
+    if (block == NULL || locked == NULL) {
+        return 0;
+    }
 
-    // Traverse the list to find the block
-    while (current != NULL) {
-        if (current->memaddress == block) {
-            if (current->size >= size) {
-                pthread_mutex_unlock(&memory_mutex);
-                return block;  // Block is already large enough
-            } else if (current->next != NULL && current->next->available &&
-                       (current->size + current->next->size) >= size) {
-                // Merge with the next block if it's free and large enough
-                current->size += current->next->size;
-                current->next = current->next->next; // Skip the next block
-                free(current->next);
-                pthread_mutex_unlock(&memory_mutex);
-                return (char*)current->memaddress;  // Return the same block
-            } else {
-                mem_free(current);
-                // Allocate a new block
-                void *new_block = mem_alloc(size);
-                if (new_block == NULL) {
-                    pthread_mutex_unlock(&memory_mutex);
-                    return NULL;  // Allocation failed
+    size_t size = 0;
+    pool_lock(locked, MEM_LOCK_OTHER);
+    if (locked->flags & MEM_BUDDY) {
+        int order = buddy_find(locked, block);
+        size = order >= 0 ? BUDDY_MIN_BLOCK << order : 0;
+    } else if (locked->flags & MEM_IN_BAND) {
+        tag_block *tag = tag_lookup(locked, block);
+        size = tag != NULL ? tag_size(tag) - TAG_SIZE : 0;
+    } else {
+        unsigned int index = find_block(locked, block);
+        size = index != NO_BLOCK ? locked->blocks[index].size : 0;
+    }
+    pool_unlock(locked, MEM_LOCK_OTHER);
+    return size;
+#endif
+}
+
+// Count the free blocks of a pool, the caller holds the pool mutex
+static void stats_free_blocks(mem_pool *pool, mem_statistics *stats) {
+    if (pool->flags & MEM_BUDDY) {
+        for (int order = 0; order <= pool->buddy_max_order && pool->buddy_size > 0; order++) {
+            size_t size = BUDDY_MIN_BLOCK << order;
+            for (buddy_block *block = pool->buddy_lists[order]; block != NULL; block = block->next) {
+                stats->free_blocks++;
+                stats->free_bytes += size;
+                if (size > stats->largest_free_block) {
+                    stats->largest_free_block = size;
+                }
+            }
+        }
+        return;
+    }
+
+    for (int c = next_nonempty_class(pool, 0); c >= 0; c = next_nonempty_class(pool, c + 1)) {
+        if (pool->flags & MEM_IN_BAND) {
+            for (tag_block *block = pool->tag_lists[c]; block != NULL; block = block->next_free) {
+                stats->free_blocks++;
+                stats->free_bytes += tag_size(block);
+                if (tag_size(block) > stats->largest_free_block) {
+                    stats->largest_free_block = tag_size(block);
                 }
+            }
+            continue;
+        }
+        for (unsigned int index = pool->free_lists[c]; index != NO_BLOCK; index = pool->blocks[index].next_free) {
+            stats->free_blocks++;
+            stats->free_bytes += pool->blocks[index].size;
+            if (pool->blocks[index].size > stats->largest_free_block) {
+                stats->largest_free_block = pool->blocks[index].size;
+            }
+        }
+    }
+}
 
-                // Copy the old data to the new block
-                memcpy(new_block, block, current->size);
+// Fill in a snapshot of a pool's usage and operation counts
+void mem_pool_stats(mem_pool *pool, mem_statistics *stats) {
+    memset(stats, 0, sizeof(mem_statistics));
 
-                // Free the old block
-                mem_free(block);
+    // Regions are counted one after the other, each under its own lock
+    for (int part = 0; part < num_parts(pool); part++) {
+        mem_pool *locked = pool_part(pool, part);
+        pool_lock(locked, MEM_LOCK_OTHER);
+        stats->allocated_bytes += locked->used_bytes;
+        stats->allocated_blocks += locked->used_blocks;
+        stats->peak_allocated_bytes += locked->peak_bytes;
+        stats_free_blocks(locked, stats);
+        pool_unlock(locked, MEM_LOCK_OTHER);
+    }
 
-                pthread_mutex_unlock(&memory_mutex);
-                return new_block;
+    if (stats->free_bytes > 0) {
+        stats->fragmentation = 1.0 - (double)stats->largest_free_block / stats->free_bytes;
+    }
+    // Counts of exited threads and dropped slots, then those of live threads
+    unsigned long counts[STAT_COUNTERS];
+    pthread_mutex_lock(&stats_mutex);
+    memcpy(counts, pool->retired, sizeof(counts));
+    for (thread_stats *thread = stats_threads; thread != NULL; thread = thread->next) {
+        for (int slot = 0; slot < STATS_POOLS; slot++) {
+            if (thread->pools[slot] != pool || thread->pool_ids[slot] != pool->id) {
+                continue;
+            }
+            for (int counter = 0; counter < STAT_COUNTERS; counter++) {
+                counts[counter] += __atomic_load_n(&thread->counts[slot][counter], __ATOMIC_RELAXED);
             }
         }
-        current = current->next;
     }
+    pthread_mutex_unlock(&stats_mutex);
+    stats->allocs = counts[STAT_ALLOCS];
+    stats->frees = counts[STAT_FREES];
+    stats->resizes = counts[STAT_RESIZES];
+    stats->failures = counts[STAT_FAILURES];
+}
 
-    // Block not found
-    pthread_mutex_unlock(&memory_mutex);
-    return NULL;
+// Give a pool and all of its blocks back in one go
+void mem_pool_destroy(mem_pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pool_teardown(pool);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
 }
 
-// Deinitialize the memory manager and free the memory pools
-void mem_deinit() {
-    pthread_mutex_lock(&memory_mutex);
+// Initialize the memory manager
+void mem_init(size_t size) {
+    mem_init_ex(size, MEM_OUT_OF_BAND);
+}
 
-    free(memorypool); // Free the memorypool
-    mem_struct *current = head; 
-    mem_struct *next_block = NULL;
-    // Free every strut
-    while (current != NULL) {
-        next_block = current->next;
-        free(current);
-        current = next_block;
+// Initialize the memory manager with the layout selected by flags
+void mem_init_ex(size_t size, unsigned int flags) {
+    // Initializing again without mem_deinit starts over, the pool must not be registered twice
+    if (default_pool.id != 0) {
+        pool_teardown(&default_pool);
     }
-    // Set variables to NULL
-    head = NULL;
-    memorypool = NULL;
+    pool_setup(&default_pool, size, flags);
+}
+
+// Allocate memory from the pool
+void *mem_alloc(size_t size) {
+    return mem_pool_alloc(&default_pool, size);
+}
+
+// Allocate memory aligned to alignment from the pool
+void *mem_alloc_aligned(size_t size, size_t alignment) {
+    return mem_pool_alloc_aligned(&default_pool, size, alignment);
+}
 
-    pthread_mutex_unlock(&memory_mutex);
-}
\ No newline at end of file
+void mem_free(void* block) {
+    mem_pool_free(&default_pool, block);
+}
+
+// Allocate count blocks of the given sizes from the pool, all or nothing
+bool mem_alloc_batch(void **blocks, const size_t *sizes, size_t count) {
+    return mem_pool_alloc_batch(&default_pool, blocks, sizes, count);
+}
+
+// Free count blocks
+void mem_free_batch(void **blocks, size_t count) {
+    mem_pool_free_batch(&default_pool, blocks, count);
+}
+
+// Resize a memory block
+void *mem_resize(void *block, size_t size) {
+    return mem_pool_resize(&default_pool, block, size);
+}
+
+// Usable bytes of a block of the pool
+size_t mem_block_size(void *block) {
+    return mem_pool_block_size(&default_pool, block);
+}
+
+// Free memory and coalesce adjacent free blocks
+void coalesce_free_blocks() {
+    for (int part = 0; part < num_parts(&default_pool); part++) {
+        mem_pool *locked = pool_part(&default_pool, part);
+        pool_lock(locked, MEM_LOCK_OTHER);
+        coalesce_blocks(locked);
+        pool_unlock(locked, MEM_LOCK_OTHER);
+    }
+}
+
+// Release the free pages of the pool after delay_ms
+void mem_set_release_delay(unsigned int delay_ms) {
+    mem_pool_set_release_delay(&default_pool, delay_ms);
+}
+
+// Fill in a snapshot of the pool's usage and operation counts
+void mem_stats(mem_statistics *stats) {
+    mem_pool_stats(&default_pool, stats);
+}
+
+// Lock profile of the pool, false when profiling isn't compiled in
+bool mem_lock_profile(mem_lock_stats *stats) {
+    return mem_pool_lock_profile(&default_pool, stats);
+}
+
+// Errors the debug checks reported in any pool, false when they aren't compiled in
+bool mem_debug_errors(unsigned long *errors) {
+#ifdef MEM_DEBUG
+    *errors = __atomic_load_n(&debug_errors, __ATOMIC_RELAXED);
+    return true;
+#else
+    (void)errors;
+    return false;
+#endif
+}
+
+// Deinitialize the memory manager and free the memory pools
+void mem_deinit() {
+#ifdef MEM_LOCK_PROFILE
+    mem_lock_stats stats;
+    mem_lock_profile(&stats);
+    if (stats.acquisitions[MEM_LOCK_ALLOC] + stats.acquisitions[MEM_LOCK_FREE] + stats.acquisitions[MEM_LOCK_RESIZE] > 0) {
+        mem_lock_profile_print(&stats);
+    }
+#endif
+#ifdef MEM_DEBUG
+    if (debug_errors > 0) {
+        fprintf(stderr, "memory_manager: %lu errors found by the debug checks\n", debug_errors);
+    }
+#endif
+    // What is left in the profile now is what the program never freed
+    if (__atomic_load_n(&profile_on, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&profile_mutex);
+        char path[PATH_MAX];
+        memcpy(path, profile_path, sizeof(path));
+        pthread_mutex_unlock(&profile_mutex);
+        profile_write(path);
+    }
+    pool_teardown(&default_pool);
+}
@@ -5,21 +5,185 @@
 #include <stdbool.h> // For bool
 #include <pthread.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Define the mem_struct and function prototypes for the memory manager
 
+// Blocks are entries of a per-pool array and refer to each other by index
 typedef struct mem_struct {
-    struct mem_struct *next;
+    unsigned int next;      // Next block by address
+    unsigned int prev;      // Previous block by address
+    unsigned int next_free; // Next free block in the same size class
+    unsigned int prev_free; // Previous free block in the same size class
     bool available;
+    unsigned char idle;     // Release passes seen while free, see mem_pool_set_release_delay
     size_t size;
     void *memaddress;
 } mem_struct;
 
-// Function declarations 
+// Pool layouts for mem_init_ex
+#define MEM_OUT_OF_BAND 0x0 // Block metadata is kept outside the pool (default)
+#define MEM_IN_BAND 0x1     // Blocks carry boundary tags inside the pool, payloads are 16 byte aligned.
+                            // Free and resize are constant time, but every block costs an 8 byte tag
+                            // and is rounded up to 16 bytes.
+#define MEM_THREAD_CACHE 0x2 // Per-thread caches of freed blocks up to 1 KiB in front of the pool lock.
+                             // Implies MEM_IN_BAND. Cached blocks stay allocated in the pool until
+                             // their thread exits or runs out of memory.
+#define MEM_BUDDY 0x4        // Binary buddy allocator, blocks are rounded up to a power of two (16 bytes
+                             // at least). Metadata is two bits per tree node. Can't be combined with
+                             // the other layouts.
+#define MEM_ALIGN_16 0x8     // Every block starts on a 16 byte boundary, sizes are rounded up to match.
+#define MEM_ALIGN_64 0x10    // Every block starts on its own 64 byte cache line, so blocks of different
+                             // threads never share a line. Both can be combined with any layout.
+#define MEM_LAZY_COALESCE 0x20 // Out-of-band frees don't merge with their neighbours right away, the pool
+                               // is coalesced in one pass once enough frees add up or an allocation
+                               // doesn't fit.
+#define MEM_MMAP 0x40          // Pool memory is an anonymous mapping instead of the heap. Pages are only
+                               // committed when first touched unless MEM_POPULATE is given too.
+#define MEM_HUGE_PAGES 0x80    // Map the pool on a 2 MiB boundary and ask for transparent huge pages,
+                               // fewer TLB misses for large pools. Implies MEM_MMAP.
+#define MEM_HUGETLB 0x100      // Map the pool from the reserved huge page pool, falls back to
+                               // MEM_HUGE_PAGES when none are reserved. Implies MEM_MMAP.
+#define MEM_POPULATE 0x200     // Fault the whole pool in at creation so allocations never page fault.
+                               // Implies MEM_MMAP.
+#define MEM_GROW 0x400         // Map another chunk, at least as large as the pool so far, when an
+                               // allocation doesn't fit. Out-of-band layout only.
+
+#define MEM_REGIONS 0x4000     // Split an out-of-band pool into eight address regions with a lock each.
+                               // Sizes map to regions by magnitude, so small and large blocks don't share
+                               // a lock, and a full region hands over to the next. No block is larger than
+                               // a region, peak_allocated_bytes is the sum of the regions' peaks.
+#define MEM_CPU_ARENAS 0x8000  // Like MEM_REGIONS with one region per CPU, up to 64. Allocations start in
+                               // the region of the CPU the thread runs on, so the pool's overhead grows
+                               // with the cores rather than the threads.
+
+// Placement policies of the out-of-band layout, one bit each in the MEM_FIT_MASK field. A pool asked
+// for more than one isn't set up. Without one a block is taken from the segregated size class lists,
+// the first block of the smallest class that surely fits.
+#define MEM_FIT_MASK 0xf0000
+#define MEM_FIRST_FIT 0x10000        // Lowest address block that fits
+#define MEM_NEXT_FIT 0x20000         // First block that fits after the one taken last
+#define MEM_BEST_FIT 0x40000         // Smallest block that fits
+#define MEM_ADDRESS_BEST_FIT 0x80000 // Smallest block that fits, the lowest address among equal sizes
+
+// Function declarations
 void mem_init(size_t size);
+void mem_init_ex(size_t size, unsigned int flags);
 void *mem_alloc(size_t size);
+void *mem_alloc_aligned(size_t size, size_t alignment); // alignment must be a power of two
 void mem_free(void* block);
+// Allocate or free count blocks under one lock acquisition. mem_alloc_batch allocates all
+// blocks or none and returns whether it did.
+bool mem_alloc_batch(void **blocks, const size_t *sizes, size_t count);
+void mem_free_batch(void **blocks, size_t count);
 void* mem_resize(void* block, size_t size);
+size_t mem_block_size(void *block); // Usable bytes of a used block, 0 for anything else
 void mem_deinit();
 void coalesce_free_blocks();
+// Give the whole pages of free blocks back to the kernel once they have stayed free for
+// delay_ms milliseconds, 0 turns it off. Out-of-band layout only, off by default.
+void mem_set_release_delay(unsigned int delay_ms);
+
+// Snapshot of a pool filled in by mem_stats. Byte counts are block sizes as the pool sees them,
+// blocks held in thread caches count as allocated. Block counts and the largest free block come
+// from a walk over the free lists, the rest is counted as the pool is used.
+typedef struct mem_statistics {
+    size_t allocated_bytes;
+    size_t free_bytes;
+    size_t peak_allocated_bytes; // Most bytes allocated at once since the pool was set up
+    size_t allocated_blocks;
+    size_t free_blocks;
+    size_t largest_free_block;
+    double fragmentation;        // 1 - largest_free_block / free_bytes, 0 when nothing is free
+    unsigned long allocs;        // Successful allocations, every block of a batch counts
+    unsigned long frees;
+    unsigned long resizes;
+    unsigned long failures;      // Allocations, batches and resizes that returned NULL
+} mem_statistics;
+
+void mem_stats(mem_statistics *stats);
+
+// Lock contention profile, only recorded when memory_manager.c is built with -DMEM_LOCK_PROFILE
+// (make lock_profile). Every acquisition of the pool mutex is counted for the operation taking it.
+// Histogram bucket b counts times of 2^b to 2^(b+1) ns, the first bucket everything below 2 ns
+// and the last everything above.
+#define MEM_LOCK_BUCKETS 32
+enum { MEM_LOCK_ALLOC, MEM_LOCK_FREE, MEM_LOCK_RESIZE, MEM_LOCK_OTHER, MEM_LOCK_OPS };
+
+typedef struct mem_lock_stats {
+    unsigned long acquisitions[MEM_LOCK_OPS];
+    unsigned long contended[MEM_LOCK_OPS]; // Acquisitions that had to wait for another thread
+    unsigned long wait_ns[MEM_LOCK_OPS];   // Total time spent waiting
+    unsigned long hold_ns[MEM_LOCK_OPS];   // Total time the mutex was held
+    unsigned long wait_histogram[MEM_LOCK_OPS][MEM_LOCK_BUCKETS];
+    unsigned long hold_histogram[MEM_LOCK_OPS][MEM_LOCK_BUCKETS];
+} mem_lock_stats;
+
+// False, and nothing filled in, unless lock profiling is compiled in. With profiling
+// mem_deinit prints the profile of the pool to stderr before tearing it down.
+bool mem_lock_profile(mem_lock_stats *stats);
+void mem_lock_profile_print(const mem_lock_stats *stats);
+
+// Debug checks, only compiled in with -DMEM_DEBUG (make debug builds libmemory_manager_debug.so).
+// Blocks get 16 byte redzones before and after the payload, new payloads are filled with 0xcd
+// and freed ones with 0xdd. Frees and resizes report overruns, double frees and pointers that
+// aren't blocks of the pool on stderr, and leave such blocks alone. mem_debug_errors gives the
+// number of reports so far, or false without the checks.
+bool mem_debug_errors(unsigned long *errors);
+
+// Sampling heap profile of every pool. About one in every sample_bytes allocated bytes (0 for
+// 512 KiB) is sampled with the call stack that allocated it, cheap enough to leave on. Per call
+// stack the profile estimates the bytes still allocated and those allocated since it started.
+// mem_profile_write writes them in the folded format of flame graph tools (flamegraph.pl,
+// speedscope): path gets the live bytes, path.alloc the allocated ones. mem_deinit writes the
+// profile to the path given to mem_profile_start, and after mem_profile_dump_on_signal so does
+// every signo. Setting MEM_PROFILE=path, and optionally MEM_PROFILE_RATE=bytes and
+// MEM_PROFILE_SIGNAL=number, starts profiling when the library is loaded, libmm_malloc.so
+// included. Functions of the executable only have names when it's linked with -rdynamic.
+bool mem_profile_start(size_t sample_bytes, const char *path);
+void mem_profile_stop();
+bool mem_profile_write(const char *path);
+bool mem_profile_dump_on_signal(int signo);
+
+// Independent pools, each with its own memory, metadata and lock. The mem_* functions
+// above work on a default pool.
+typedef struct mem_pool mem_pool;
+
+mem_pool *mem_pool_create(size_t size, unsigned int flags);
+void *mem_pool_alloc(mem_pool *pool, size_t size);
+void *mem_pool_alloc_aligned(mem_pool *pool, size_t size, size_t alignment);
+void mem_pool_free(mem_pool *pool, void *block);
+bool mem_pool_alloc_batch(mem_pool *pool, void **blocks, const size_t *sizes, size_t count);
+void mem_pool_free_batch(mem_pool *pool, void **blocks, size_t count);
+void *mem_pool_resize(mem_pool *pool, void *block, size_t size);
+size_t mem_pool_block_size(mem_pool *pool, void *block);
+void mem_pool_set_release_delay(mem_pool *pool, unsigned int delay_ms);
+void mem_pool_stats(mem_pool *pool, mem_statistics *stats);
+bool mem_pool_lock_profile(mem_pool *pool, mem_lock_stats *stats);
+void mem_pool_destroy(mem_pool *pool);
+
+// Slab caches hand out objects of one size from page sized slabs taken from the pool.
+// Free objects are linked through their own memory, so objects carry no metadata.
+// mem_slab_create takes its slabs from the default pool, mem_slab_create_in from pool.
+// Objects freed by a thread other than the one that created the cache are pushed onto a
+// lock-free stack with one CAS. The next allocation to find the freelist empty takes the
+// whole stack under the cache mutex, whichever thread makes it. Only slab caches have
+// this stack, mem_free and mem_pool_free from any thread take the pool lock (or the
+// thread cache of MEM_THREAD_CACHE) as usual.
+// Slabs start on a 16 byte boundary, so objects are 16 byte aligned when the object size is
+// a multiple of 16 and pointer aligned otherwise.
+typedef struct mem_slab_cache mem_slab_cache;
+
+mem_slab_cache *mem_slab_create(size_t object_size);
+mem_slab_cache *mem_slab_create_in(mem_pool *pool, size_t object_size);
+void *mem_slab_alloc(mem_slab_cache *cache);
+void mem_slab_free(mem_slab_cache *cache, void *object);
+void mem_slab_destroy(mem_slab_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
 
-#endif // MEMORY_MANAGER_H
\ No newline at end of file
+#endif // MEMORY_MANAGER_H
@@ -0,0 +1,206 @@
+#ifndef memory_manager_hpp
+#define memory_manager_hpp
+
+// C++ adaptors for the memory manager, header only. mem::pool_resource is a
+// std::pmr::memory_resource backed by a pool, mem::Allocator<T> an allocator for
+// the standard containers that draws from a pool_resource:
+//
+//     mem::pool_resource pool(64 << 20, MEM_MMAP | MEM_GROW);
+//     std::map<int, int, std::less<int>, mem::Allocator<std::pair<const int, int>>> m(pool);
+//     std::pmr::unordered_map<int, int> u(&pool);
+//
+// Requests of up to small_max bytes with an alignment of at most class_step come from a
+// slab cache per size class of class_step bytes, larger ones straight from the pool.
+// Allocator<T> picks the size class of single objects, the nodes of list, map and
+// unordered_map, at compile time. Both can free what the other allocated from the same
+// pool_resource. Containers must be gone before the pool_resource they use.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include "memory_manager.h"
+
+namespace mem {
+
+class pool_resource final : public std::pmr::memory_resource {
+public:
+    static constexpr std::size_t class_step = 16;
+    static constexpr std::size_t num_classes = 16;
+    static constexpr std::size_t small_max = class_step * num_classes;
+
+    // Size class of a request, classes start at 1..class_step bytes
+    static constexpr std::size_t class_of(std::size_t bytes) noexcept {
+        return bytes > 0 ? (bytes - 1) / class_step : 0;
+    }
+
+    // Whether requests of bytes aligned to alignment come from a slab cache
+    static constexpr bool is_small(std::size_t bytes, std::size_t alignment) noexcept {
+        return bytes <= small_max && alignment <= class_step;
+    }
+
+    // A new pool of size bytes, see mem_pool_create for the flags
+    explicit pool_resource(std::size_t size, unsigned int flags = MEM_OUT_OF_BAND)
+        : pool_(mem_pool_create(size, flags)), owned_(true), caches_() {
+        if (pool_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    // Allocate from an existing pool, which outlives the resource and stays the caller's
+    explicit pool_resource(mem_pool *pool) noexcept : pool_(pool), owned_(false), caches_() {}
+
+    pool_resource(const pool_resource &) = delete;
+    pool_resource &operator=(const pool_resource &) = delete;
+
+    ~pool_resource() override {
+        for (auto &cache : caches_) {
+            mem_slab_destroy(cache.load(std::memory_order_relaxed));
+        }
+        if (owned_) {
+            mem_pool_destroy(pool_);
+        }
+    }
+
+    mem_pool *pool() const noexcept { return pool_; }
+
+    // Object of size class Class from its slab cache
+    template <std::size_t Class>
+    void *allocate_small() {
+        static_assert(Class < num_classes, "no such size class");
+        void *object = mem_slab_alloc(cache(Class));
+        if (object == nullptr) {
+            throw std::bad_alloc();
+        }
+        return object;
+    }
+
+    template <std::size_t Class>
+    void deallocate_small(void *object) noexcept {
+        static_assert(Class < num_classes, "no such size class");
+        mem_slab_free(caches_[Class].load(std::memory_order_acquire), object);
+    }
+
+    // Block straight from the pool, for requests too large for the slab caches. Zero bytes
+    // still get a block of their own, as operator new would
+    void *allocate_large(std::size_t bytes, std::size_t alignment) {
+        void *block = mem_pool_alloc_aligned(pool_, bytes ? bytes : 1, alignment);
+        if (block == nullptr) {
+            throw std::bad_alloc();
+        }
+        return block;
+    }
+
+    void deallocate_large(void *block) noexcept { mem_pool_free(pool_, block); }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        if (is_small(bytes, alignment)) {
+            void *object = mem_slab_alloc(cache(class_of(bytes)));
+            if (object == nullptr) {
+                throw std::bad_alloc();
+            }
+            return object;
+        }
+        return allocate_large(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override {
+        if (is_small(bytes, alignment)) {
+            mem_slab_free(caches_[class_of(bytes)].load(std::memory_order_acquire), p);
+        } else {
+            deallocate_large(p);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    // Slab cache of a size class, created by whichever thread needs it first
+    mem_slab_cache *cache(std::size_t cls) {
+        mem_slab_cache *cache = caches_[cls].load(std::memory_order_acquire);
+        if (cache != nullptr) {
+            return cache;
+        }
+
+        mem_slab_cache *created = mem_slab_create_in(pool_, (cls + 1) * class_step);
+        if (created == nullptr) {
+            throw std::bad_alloc();
+        }
+        if (!caches_[cls].compare_exchange_strong(cache, created, std::memory_order_acq_rel)) {
+            mem_slab_destroy(created);  // Another thread was first, cache holds its cache
+            return cache;
+        }
+        return created;
+    }
+
+    mem_pool *pool_;
+    bool owned_;
+    std::atomic<mem_slab_cache *> caches_[num_classes];
+};
+
+// Allocator for the standard containers, copies and rebinds share the pool_resource
+template <class T>
+class Allocator {
+public:
+    using value_type = T;
+
+    explicit Allocator(pool_resource &resource) noexcept : resource_(&resource) {}
+
+    template <class U>
+    Allocator(const Allocator<U> &other) noexcept : resource_(other.resource()) {}
+
+    T *allocate(std::size_t n) {
+        if constexpr (small) {
+            if (n == 1) {
+                return static_cast<T *>(resource_->template allocate_small<size_class>());
+            }
+        }
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        if (pool_resource::is_small(n * sizeof(T), alignof(T))) {
+            return static_cast<T *>(resource_->allocate(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T *>(resource_->allocate_large(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        if constexpr (small) {
+            if (n == 1) {
+                resource_->template deallocate_small<size_class>(p);
+                return;
+            }
+        }
+        if (pool_resource::is_small(n * sizeof(T), alignof(T))) {
+            resource_->deallocate(p, n * sizeof(T), alignof(T));
+        } else {
+            resource_->deallocate_large(p);
+        }
+    }
+
+    pool_resource *resource() const noexcept { return resource_; }
+
+private:
+    static constexpr bool small = pool_resource::is_small(sizeof(T), alignof(T));
+    static constexpr std::size_t size_class = pool_resource::class_of(sizeof(T));
+
+    pool_resource *resource_;
+};
+
+template <class T, class U>
+bool operator==(const Allocator<T> &a, const Allocator<U> &b) noexcept {
+    return a.resource() == b.resource();
+}
+
+template <class T, class U>
+bool operator!=(const Allocator<T> &a, const Allocator<U> &b) noexcept {
+    return a.resource() != b.resource();
+}
+
+} // namespace mem
+
+#endif // memory_manager_hpp
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "memory_manager.h"
+
+// Drop-in replacement of the libc allocator, serving the whole process from
+// the default pool of memory_manager:
+//
+//   LD_PRELOAD=./libmm_malloc.so ./program
+//
+// The library carries its own copy of memory_manager built with hidden
+// symbols, so a program that uses memory_manager itself keeps a separate
+// default pool. The pool is an anonymous mapping that grows on demand, its
+// first chunk is MM_MALLOC_POOL_MB MiB (64 unless set). Setting it up takes
+// no libc allocation, so there is nothing to forward to while the pool
+// isn't there yet and pthread_once is all the bootstrap needed.
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define DEFAULT_POOL_MB 64
+#define POOL_FLAGS (MEM_MMAP | MEM_GROW | MEM_ALIGN_16) // malloc alignment is 16 bytes on 64-bit
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_init() {
+    size_t megabytes = DEFAULT_POOL_MB;
+    const char *setting = getenv("MM_MALLOC_POOL_MB");
+    if (setting != NULL && strtoul(setting, NULL, 10) > 0) {
+        megabytes = strtoul(setting, NULL, 10);
+    }
+    mem_init_ex(megabytes << 20, POOL_FLAGS);
+}
+
+// Allocate size bytes aligned to alignment, malloc(0) gets a block of its own
+static void *pool_alloc(size_t size, size_t alignment) {
+    pthread_once(&pool_once, pool_init);
+    void *block = mem_alloc_aligned(size > 0 ? size : 1, alignment);
+    if (block == NULL) {
+        errno = ENOMEM;
+    }
+    return block;
+}
+
+// Resize like realloc. The exported functions only call each other through
+// helpers like this one, a call to an exported symbol could bind elsewhere.
+static void *pool_resize(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return pool_alloc(size, 1);
+    }
+    if (size == 0) {
+        mem_free(ptr);
+        return NULL;
+    }
+    void *resized = mem_resize(ptr, size);
+    if (resized == NULL) {
+        errno = ENOMEM;
+    }
+    return resized;
+}
+
+static void *pool_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return pool_alloc(size, alignment);
+}
+
+EXPORT void *malloc(size_t size) {
+    return pool_alloc(size, 1);
+}
+
+EXPORT void free(void *ptr) {
+    if (ptr != NULL) {
+        mem_free(ptr);  // Unknown pointers are ignored
+    }
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = pool_alloc(nmemb * size, 1);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);  // Freed blocks are reused as they are
+    }
+    return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    return pool_resize(ptr, size);
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return pool_resize(ptr, nmemb * size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = pool_alloc(size, alignment);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    return pool_memalign(alignment, size);
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    return pool_memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return pool_alloc(size, sysconf(_SC_PAGESIZE));
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return pool_alloc((size + page - 1) & ~(page - 1), page);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    return mem_block_size(ptr);
+}
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE // For sched_getcpu and CPU affinity
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "memory_manager.h"
 #include <stdio.h>
 #include <assert.h>
@@ -11,7 +14,12 @@
 #include <dlfcn.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <malloc.h>
+#include <signal.h>
+#include <unistd.h>
 #include "common_defs.h"
+#include "cm2_trace.h"
 
 #include <unistd.h>
 
@@ -31,6 +39,7 @@ typedef struct
     int max_block_size;    // Maximum size of a block
     void **block_pointers; // Array to hold pointers to allocated blocks
     bool simulate_work;    // Flag to simulate work in the thread, i.e. put the thread to sleep for a while
+    bool batch;            // Allocate and free all blocks with mem_alloc_batch and mem_free_batch
 } thread_data_t;
 
 // Structure to hold test function parameters
@@ -42,6 +51,8 @@ typedef struct
     int num_blocks;
     size_t block_size;
     bool simulate_work;
+    bool batch;         // Use the batch entry points
+    unsigned int flags; // Flags passed to mem_init_ex
 } TestParams;
 
 // Function to calculate memory allocations for threads based on redistribution logic
@@ -269,7 +280,7 @@ void test_random_blocks_multithread(TestParams params)
     int total_blocks = 1000 + rand() % 10000;
     int mem_size = total_blocks * params.block_size;
 
-    mem_init(mem_size);
+    mem_init_ex(mem_size, params.flags);
 
     pthread_t threads[params.num_threads];
     thread_data_t thread_data[params.num_threads];
@@ -733,7 +744,7 @@ void *repeated_allocate_in_fragment(void *arg)
 void test_memory_fragmentation_multithread(TestParams params)
 {
     printf_yellow("  Testing \"memory fragmentation handling\" (threads: %d, mem_size: %zu, iterations: %d) ---> ", params.num_threads, params.memory_size, params.iterations);
-    mem_init(params.memory_size); // Initialize with specified memory size to accommodate load
+    mem_init_ex(params.memory_size, params.flags); // Initialize with specified memory size to accommodate load
 
     pthread_t threads[params.num_threads];
     thread_data_t params_t[params.num_threads]; // Array of thread data
@@ -783,6 +794,23 @@ void *thread_function(void *arg)
     char **blocks = (char **)malloc(num_allocations * sizeof(char *));
     my_assert(blocks != NULL); // Check that allocation was successful
 
+    if (params->batch)
+    {
+        // All blocks in one lock acquisition
+        size_t *sizes = malloc(num_allocations * sizeof(size_t));
+        for (int i = 0; i < num_allocations; i++)
+            sizes[i] = block_size;
+        my_assert(mem_alloc_batch((void **)blocks, sizes, num_allocations));
+        for (int i = 0; i < num_allocations; i++)
+            memset(blocks[i], thread_id * num_allocations + i, block_size);
+        for (int i = 0; i < num_allocations; i++)
+            sanityCheck(block_size, blocks[i], (char)(thread_id * num_allocations + i));
+        mem_free_batch((void **)blocks, num_allocations);
+        free(sizes);
+        free(blocks);
+        return NULL;
+    }
+
     for (int i = 0; i < num_allocations; i++)
     {
         // Allocate memory
@@ -830,6 +858,7 @@ void run_concurrency_test(TestParams params)
         params_t[i].num_blocks = params.num_blocks / params.num_threads;
         params_t[i].block_size = params.block_size;
         params_t[i].simulate_work = params.simulate_work;
+        params_t[i].batch = params.batch;
         pthread_create(&threads[i], NULL, thread_function, &params_t[i]);
     }
 
@@ -888,6 +917,1477 @@ void test_looking_for_out_of_bounds()
     printf("[PASS].\n");
 }
 
+/*
+ * Checks the in-band (boundary tag) layout: alignment, merging with both neighbours,
+ * ignoring double frees and keeping the data when a resize has to move the block.
+ */
+void test_in_band_layout()
+{
+    printf_yellow("  Testing \"in-band block layout\" ---> ");
+    mem_init_ex(4096, MEM_IN_BAND);
+
+    char *blocks[8];
+    for (int i = 0; i < 8; i++)
+    {
+        blocks[i] = mem_alloc(100);
+        my_assert(blocks[i] != NULL);
+        my_assert(((uintptr_t)blocks[i] % 16) == 0);
+        memset(blocks[i], i, 100);
+    }
+
+    // Free every other block first, so the rest merge with free blocks on both sides
+    for (int i = 0; i < 8; i += 2)
+        mem_free(blocks[i]);
+    for (int i = 1; i < 8; i += 2)
+    {
+        sanityCheck(100, blocks[i], i);
+        mem_free(blocks[i]);
+    }
+
+    // All blocks are merged back into one
+    char *big = mem_alloc(4096 - 64);
+    my_assert(big != NULL);
+    mem_free(big);
+    mem_free(big); // Double free is ignored
+
+    char *a = mem_alloc(64);
+    char *b = mem_alloc(64);
+    memset(a, 0x5A, 64);
+
+    // b is in the way, so the block has to move
+    char *c = mem_resize(a, 1024);
+    my_assert(c != NULL && c != a);
+    sanityCheck(64, c, 0x5A);
+
+    // The rest of the pool follows c, so it grows in place
+    mem_free(b);
+    my_assert(mem_resize(c, 2048) == c);
+    sanityCheck(64, c, 0x5A);
+    mem_free(c);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void *thread_cache_alloc_free(void *arg)
+{
+    void *block = mem_alloc(64);
+    my_assert(block != NULL);
+    mem_free(block);
+    return NULL;
+}
+
+/*
+ * Checks the per-thread caches: a freed block is handed out again to the same thread,
+ * double frees are ignored, and cached blocks go back to the pool when the pool runs
+ * dry and when their thread exits.
+ */
+void test_thread_cache()
+{
+    printf_yellow("  Testing \"thread cache\" ---> ");
+    mem_init_ex(4096, MEM_THREAD_CACHE);
+
+    void *a = mem_alloc(64);
+    my_assert(a != NULL);
+    mem_free(a);
+    mem_free(a); // Double free of a cached block is ignored
+    my_assert(mem_alloc(64) == a);
+    mem_free(a);
+
+    // Needs the blocks held by the cache of this thread
+    void *big = mem_alloc(4096 - 64);
+    my_assert(big != NULL);
+    mem_free(big);
+
+    // Blocks cached by other threads are flushed when they exit
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_cache_alloc_free, NULL);
+    pthread_join(thread, NULL);
+    big = mem_alloc(4096 - 64);
+    my_assert(big != NULL);
+    mem_free(big);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Checks the slab caches: objects don't overlap, freed objects are reused, a pool too small
+ * for a full slab still hands out every object that fits, and destroy gives the slabs back.
+ */
+void test_slab_cache()
+{
+    printf_yellow("  Testing \"slab cache\" ---> ");
+    mem_init(16 * 1024);
+    mem_slab_cache *cache = mem_slab_create(16);
+    my_assert(cache != NULL);
+
+    char *objects[1000];
+    for (int i = 0; i < 1000; i++)
+    {
+        objects[i] = mem_slab_alloc(cache);
+        my_assert(objects[i] != NULL);
+        memset(objects[i], i, 16);
+    }
+    for (int i = 0; i < 1000; i++)
+        sanityCheck(16, objects[i], (char)i);
+
+    // The last object freed is the first one handed out again
+    mem_slab_free(cache, objects[10]);
+    my_assert(mem_slab_alloc(cache) == objects[10]);
+
+    // The slabs go back to the pool
+    mem_slab_destroy(cache);
+    void *block = mem_alloc(16 * 1024);
+    my_assert(block != NULL);
+    mem_free(block);
+    mem_deinit();
+
+    // A pool with room for exactly three objects
+    mem_init(3 * 16);
+    cache = mem_slab_create(16);
+    for (int i = 0; i < 3; i++)
+        my_assert(mem_slab_alloc(cache) != NULL);
+    my_assert(mem_slab_alloc(cache) == NULL);
+    mem_slab_destroy(cache);
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+typedef struct
+{
+    mem_slab_cache *cache;
+    char **objects;
+    int count;
+} slab_free_data_t;
+
+void *thread_slab_free(void *arg)
+{
+    slab_free_data_t *data = arg;
+    for (int i = 0; i < data->count; i++)
+        mem_slab_free(data->cache, data->objects[i]);
+    return NULL;
+}
+
+/*
+ * Objects freed by other threads go through the remote stack: a pool with room for exactly
+ * 1024 objects is filled by the owner, freed by 4 threads, and must be refillable afterwards.
+ */
+void test_slab_remote_free()
+{
+    printf_yellow("  Testing \"slab cache remote frees\" ---> ");
+    mem_init(1024 * 16);
+    mem_slab_cache *cache = mem_slab_create(16);
+
+    char *objects[1024];
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < 1024; i++)
+        {
+            objects[i] = mem_slab_alloc(cache);
+            my_assert(objects[i] != NULL);
+            memset(objects[i], round, 16);
+        }
+        my_assert(mem_slab_alloc(cache) == NULL);
+
+        pthread_t threads[4];
+        slab_free_data_t data[4];
+        for (int t = 0; t < 4; t++)
+        {
+            data[t] = (slab_free_data_t){.cache = cache, .objects = objects + t * 256, .count = 256};
+            pthread_create(&threads[t], NULL, thread_slab_free, &data[t]);
+        }
+        for (int t = 0; t < 4; t++)
+            pthread_join(threads[t], NULL);
+    }
+
+    mem_slab_destroy(cache);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Checks the buddy layout: a pool that isn't a power of two is carved into power-of-two blocks,
+ * buddies merge back regardless of the order they are freed in, and resize keeps the data.
+ */
+void test_buddy_layout()
+{
+    printf_yellow("  Testing \"buddy block layout\" ---> ");
+
+    // 1000 bytes hold blocks of 512, 256, 128, 64 and 32 bytes
+    mem_init_ex(1000, MEM_BUDDY);
+    void *blocks[5];
+    for (int i = 0; i < 5; i++)
+    {
+        blocks[i] = mem_alloc(512 >> i);
+        my_assert(blocks[i] != NULL);
+    }
+    my_assert(mem_alloc(16) == NULL);
+    for (int i = 0; i < 5; i++)
+        mem_free(blocks[i]);
+    mem_deinit();
+
+    mem_init_ex(1024, MEM_BUDDY);
+    char *quarters[4];
+    for (int i = 0; i < 4; i++)
+    {
+        quarters[i] = mem_alloc(200); // Rounded up to 256
+        my_assert(quarters[i] != NULL);
+        memset(quarters[i], i, 200);
+    }
+    my_assert(mem_alloc(16) == NULL);
+
+    // Free out of order, the whole pool is one block again afterwards
+    int order[4] = {0, 2, 1, 3};
+    for (int i = 0; i < 4; i++)
+    {
+        sanityCheck(200, quarters[order[i]], order[i]);
+        mem_free(quarters[order[i]]);
+    }
+    mem_free(quarters[0]); // Double free is ignored
+    char *whole = mem_alloc(1024);
+    my_assert(whole != NULL);
+    mem_free(whole);
+
+    char *a = mem_alloc(100);
+    char *b = mem_alloc(100);
+    memset(a, 0x5A, 100);
+    my_assert(mem_resize(a, 128) == a); // Still fits the 128 byte block
+    char *c = mem_resize(a, 300);
+    my_assert(c != NULL && c != a);
+    sanityCheck(100, c, 0x5A);
+    mem_free(b);
+    mem_free(c);
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+void *thread_pool_alloc_free(void *arg)
+{
+    mem_pool *pool = arg;
+    for (int i = 0; i < 1000; i++)
+    {
+        char *block = mem_pool_alloc(pool, 16 + i % 200);
+        my_assert(block != NULL);
+        memset(block, 0x33, 16);
+        mem_pool_free(pool, block);
+    }
+    return NULL;
+}
+
+void test_pool_handles()
+{
+    printf_yellow("  Testing \"independent pool handles\" ---> ");
+
+    // Each pool has exactly its own capacity, the default pool is not touched
+    mem_init(100);
+    mem_pool *first = mem_pool_create(1000, MEM_OUT_OF_BAND);
+    mem_pool *second = mem_pool_create(500, MEM_IN_BAND);
+    my_assert(first != NULL && second != NULL);
+
+    char *a = mem_pool_alloc(first, 1000);
+    my_assert(a != NULL);
+    my_assert(mem_pool_alloc(first, 1) == NULL);
+    char *b = mem_pool_alloc(second, 200);
+    my_assert(b != NULL);
+    char *c = mem_alloc(100);
+    my_assert(c != NULL);
+    memset(a, 1, 1000);
+    memset(b, 2, 200);
+    memset(c, 3, 100);
+
+    // Freeing into the wrong pool is ignored
+    mem_pool_free(second, a);
+    mem_free(b);
+    my_assert(mem_pool_alloc(first, 1) == NULL);
+
+    // Destroying a pool gives everything back at once and leaves the others alone
+    mem_pool_destroy(first);
+    sanityCheck(200, b, 2);
+    sanityCheck(100, c, 3);
+    b = mem_pool_resize(second, b, 300);
+    my_assert(b != NULL);
+    sanityCheck(200, b, 2);
+    mem_pool_free(second, b);
+    mem_pool_destroy(second);
+    mem_free(c);
+    mem_deinit();
+
+    // Threads caching blocks of several pools at once, caches of destroyed pools are dropped
+    mem_pool *pools[6];
+    for (int i = 0; i < 6; i++)
+    {
+        pools[i] = mem_pool_create(64 * 1024, MEM_THREAD_CACHE);
+        my_assert(pools[i] != NULL);
+    }
+    pthread_t threads[6];
+    for (int i = 0; i < 6; i++)
+        pthread_create(&threads[i], NULL, thread_pool_alloc_free, pools[i]);
+    for (int i = 0; i < 6; i++)
+    {
+        thread_pool_alloc_free(pools[i]);
+        pthread_join(threads[i], NULL);
+    }
+    mem_pool_destroy(pools[0]);
+    for (int i = 1; i < 6; i++)
+    {
+        my_assert(mem_pool_alloc(pools[i], 60 * 1024) != NULL);
+        mem_pool_destroy(pools[i]);
+    }
+
+    // mem_init twice without mem_deinit starts the default pool over and leaves the others alone
+    first = mem_pool_create(1000, MEM_OUT_OF_BAND);
+    mem_init(100);
+    my_assert(mem_alloc(100) != NULL);
+    mem_init_ex(200, MEM_IN_BAND);
+    my_assert(mem_alloc(100) != NULL);
+    mem_pool_destroy(first);
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Checks mem_alloc_aligned on every layout and the pool-wide minimum alignment: pointers are
+ * aligned, the data stays intact, and the gaps in front of aligned blocks are given back.
+ */
+void test_aligned_alloc()
+{
+    printf_yellow("  Testing \"aligned allocation\" ---> ");
+
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_IN_BAND, MEM_THREAD_CACHE, MEM_BUDDY};
+    for (int l = 0; l < 4; l++)
+    {
+        mem_init_ex(64 * 1024, layouts[l]);
+        my_assert(mem_alloc_aligned(16, 24) == NULL); // Not a power of two
+
+        char *blocks[8];
+        for (int i = 0; i < 8; i++)
+        {
+            size_t alignment = (size_t)16 << i;
+            mem_alloc(1 + i); // Something unaligned in between
+            blocks[i] = mem_alloc_aligned(100, alignment);
+            my_assert(blocks[i] != NULL);
+            my_assert(((uintptr_t)blocks[i] & (alignment - 1)) == 0);
+            memset(blocks[i], i, 100);
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            sanityCheck(100, blocks[i], i);
+            mem_free(blocks[i]);
+        }
+        mem_deinit();
+    }
+
+    // Nothing is lost to the gaps once everything is freed
+    mem_init(4096);
+    void *a = mem_alloc(3);
+    void *b = mem_alloc_aligned(200, 256);
+    my_assert(b != NULL && ((uintptr_t)b & 255) == 0);
+    mem_free(a);
+    mem_free(b);
+    a = mem_alloc(4096);
+    my_assert(a != NULL);
+    mem_free(a);
+    mem_deinit();
+
+    // Back to back allocations of a 64 byte aligned pool each get their own cache line
+    unsigned int aligned_layouts[] = {MEM_ALIGN_64, MEM_IN_BAND | MEM_ALIGN_64, MEM_THREAD_CACHE | MEM_ALIGN_64, MEM_BUDDY | MEM_ALIGN_64, MEM_ALIGN_16};
+    for (int l = 0; l < 5; l++)
+    {
+        uintptr_t alignment = (aligned_layouts[l] & MEM_ALIGN_64) ? 64 : 16;
+        mem_init_ex(64 * 1024, aligned_layouts[l]);
+        char *previous = NULL;
+        for (int i = 0; i < 100; i++)
+        {
+            char *counter = mem_alloc(1 + i % 8);
+            my_assert(counter != NULL && ((uintptr_t)counter & (alignment - 1)) == 0);
+            my_assert(previous == NULL || (uintptr_t)counter / alignment != (uintptr_t)previous / alignment);
+            counter = mem_resize(counter, 100 + i);
+            my_assert(counter != NULL && ((uintptr_t)counter & (alignment - 1)) == 0);
+            previous = counter;
+        }
+        mem_deinit();
+    }
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Checks the batch entry points: a batch is allocated completely or not at all, and a freed
+ * batch, given in any order, coalesces back into one block.
+ */
+void test_batch_alloc_free()
+{
+    printf_yellow("  Testing \"batch alloc and free\" ---> ");
+
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_IN_BAND, MEM_THREAD_CACHE, MEM_BUDDY};
+    for (int l = 0; l < 4; l++)
+    {
+        mem_init_ex(64 * 1024, layouts[l]);
+        void *blocks[64];
+        size_t sizes[64];
+        for (int i = 0; i < 64; i++)
+            sizes[i] = 16 + (i * 37) % 500;
+        my_assert(mem_alloc_batch(blocks, sizes, 64));
+        for (int i = 0; i < 64; i++)
+        {
+            my_assert(blocks[i] != NULL);
+            memset(blocks[i], i, sizes[i]);
+        }
+        for (int i = 0; i < 64; i++)
+            sanityCheck(sizes[i], blocks[i], i);
+
+        // Shuffled, with a NULL and a duplicate
+        for (int i = 0; i < 64; i++)
+        {
+            int j = (i * 29) % 64;
+            void *tmp = blocks[i];
+            blocks[i] = blocks[j];
+            blocks[j] = tmp;
+        }
+        void *freed[66];
+        memcpy(freed, blocks, sizeof(blocks));
+        freed[64] = NULL;
+        freed[65] = blocks[3];
+        mem_free_batch(freed, 66);
+
+        // Room for everything but the in-band tags
+        void *whole = mem_alloc(64 * 1024 - 32);
+        my_assert(whole != NULL);
+        mem_free(whole);
+
+        // A batch that doesn't fit leaves the pool as it was
+        size_t too_much[3] = {1024, 1024, 128 * 1024};
+        my_assert(!mem_alloc_batch(blocks, too_much, 3));
+        my_assert(blocks[0] == NULL && blocks[1] == NULL && blocks[2] == NULL);
+        whole = mem_alloc(64 * 1024 - 32);
+        my_assert(whole != NULL);
+        mem_free(whole);
+        mem_deinit();
+    }
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Checks that mem_resize works in place: shrinking gives the tail back, growing takes in the
+ * free blocks on either side, and the data survives moving down into the previous block.
+ */
+void test_resize_in_place()
+{
+    printf_yellow("  Testing \"in-place resize\" ---> ");
+
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_IN_BAND};
+    for (int l = 0; l < 2; l++)
+    {
+        mem_init_ex(2048, layouts[l]);
+        char *a = mem_alloc(200);
+        char *b = mem_alloc(200);
+        char *c = mem_alloc(600);
+        my_assert(a != NULL && b != NULL && c != NULL);
+        memset(b, 0x5B, 200);
+
+        // Into the free block in front
+        mem_free(a);
+        char *r = mem_resize(b, 400);
+        my_assert(r == a);
+        sanityCheck(200, r, 0x5B);
+
+        // The tail goes back to the pool and can be allocated again
+        my_assert(mem_resize(r, 100) == r);
+        sanityCheck(100, r, 0x5B);
+        char *d = mem_alloc(250);
+        my_assert(d > r && d < c);
+
+        // Into the free block behind
+        mem_free(d);
+        my_assert(mem_resize(r, 400) == r);
+        sanityCheck(100, r, 0x5B);
+
+        // Last resort, move and copy
+        memset(r, 0x3C, 400);
+        char *moved = mem_resize(r, 800);
+        my_assert(moved != NULL && moved != r);
+        sanityCheck(400, moved, 0x3C);
+        mem_free(moved);
+        mem_free(c);
+        mem_deinit();
+    }
+
+    mem_init_ex(1024, MEM_BUDDY);
+    char *a = mem_alloc(100);
+    memset(a, 0x7A, 100);
+    my_assert(mem_resize(a, 256) == a);  // Merges with free right buddies
+    my_assert(mem_resize(a, 1024) == a);
+    sanityCheck(100, a, 0x7A);
+    my_assert(mem_resize(a, 16) == a);   // Upper halves are free again
+    char *b = mem_alloc(512);
+    my_assert(b == a + 512);
+    mem_free(b);
+    mem_free(a);
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Checks neighbour-only coalescing in the out-of-band layout, eager and lazy: after freeing every
+ * block in random order the pool is one block again, and lookups survive the address table growing.
+ */
+void test_neighbour_coalescing()
+{
+    printf_yellow("  Testing \"neighbour coalescing\" ---> ");
+
+    // A block merges with free neighbours on both sides
+    mem_init(300);
+    char *a = mem_alloc(100);
+    char *b = mem_alloc(100);
+    char *c = mem_alloc(100);
+    mem_free(a);
+    mem_free(c);
+    mem_free(b);
+    char *whole = mem_alloc(300);
+    my_assert(whole == a);
+    mem_free(whole);
+    mem_deinit();
+
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_LAZY_COALESCE};
+    const int count = 20001; // Sizes of 16, 32 and 48 bytes fill the pool exactly
+    char **blocks = malloc(count * sizeof(char *));
+    for (int l = 0; l < 2; l++)
+    {
+        mem_init_ex(count * 32, layouts[l]);
+        for (int i = 0; i < count; i++)
+        {
+            blocks[i] = mem_alloc(16 + (i % 3) * 16);
+            my_assert(blocks[i] != NULL);
+            blocks[i][0] = (char)i;
+        }
+        my_assert(mem_alloc(1) == NULL);
+
+        srand(l);
+        for (int i = count - 1; i > 0; i--)
+        {
+            int j = rand() % (i + 1);
+            char *tmp = blocks[i];
+            blocks[i] = blocks[j];
+            blocks[j] = tmp;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            mem_free(blocks[i]);
+            mem_free(blocks[i]); // Double free is ignored
+        }
+
+        whole = mem_alloc(count * 32);
+        my_assert(whole != NULL);
+        mem_free(whole);
+        mem_deinit();
+    }
+    free(blocks);
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Checks pools backed by anonymous mappings: every mapping option gives a usable pool of the
+ * requested size in each layout, and huge page pools start on a 2 MiB boundary.
+ */
+void test_mapped_pools()
+{
+    printf_yellow("  Testing \"mapped pools\" ---> ");
+
+    const size_t size = 3 * 1024 * 1024 + 100;
+    unsigned int mappings[] = {MEM_MMAP, MEM_POPULATE, MEM_HUGE_PAGES, MEM_HUGE_PAGES | MEM_POPULATE, MEM_HUGETLB};
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_IN_BAND, MEM_BUDDY};
+    for (int m = 0; m < 5; m++)
+    {
+        for (int l = 0; l < 3; l++)
+        {
+            mem_pool *pool = mem_pool_create(size, mappings[m] | layouts[l]);
+            my_assert(pool != NULL);
+            size_t block_size = layouts[l] == MEM_OUT_OF_BAND ? size : 1024 * 1024;
+            char *block = mem_pool_alloc(pool, block_size);
+            my_assert(block != NULL);
+            if (layouts[l] == MEM_OUT_OF_BAND)
+            {
+                // The pool is full, mapping whole pages doesn't make it larger
+                my_assert(mem_pool_alloc(pool, 1) == NULL);
+                if (mappings[m] & (MEM_HUGE_PAGES | MEM_HUGETLB))
+                {
+                    my_assert(((uintptr_t)block & (2 * 1024 * 1024 - 1)) == 0);
+                }
+            }
+            memset(block, m + 1, block_size);
+            sanityCheck(block_size, block, m + 1);
+            mem_pool_free(pool, block);
+            mem_pool_destroy(pool);
+        }
+    }
+
+    // The default pool takes the same flags and can be set up again with plain heap memory
+    mem_init_ex(size, MEM_HUGE_PAGES | MEM_POPULATE);
+    char *block = mem_alloc(size);
+    my_assert(block != NULL);
+    memset(block, 7, size);
+    mem_free(block);
+    mem_deinit();
+    mem_init(size);
+    block = mem_alloc(size);
+    my_assert(block != NULL);
+    mem_free(block);
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Checks growing pools and the release of idle pages: a MEM_GROW pool keeps serving allocations
+ * past its initial size, and the pages of a block freed longer than the release delay stop being resident.
+ */
+void test_growing_pool()
+{
+    printf_yellow("  Testing \"growing pool and idle release\" ---> ");
+
+    // Allocations past the initial size map new chunks, large ones included
+    mem_pool *pool = mem_pool_create(4096, MEM_GROW);
+    my_assert(pool != NULL);
+    char *blocks[64];
+    for (int i = 0; i < 64; i++)
+    {
+        size_t size = i == 40 ? 1024 * 1024 : 1000;
+        blocks[i] = mem_pool_alloc(pool, size);
+        my_assert(blocks[i] != NULL);
+        memset(blocks[i], i, size);
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        sanityCheck(i == 40 ? 1024 * 1024 : 1000, blocks[i], i);
+        mem_pool_free(pool, blocks[i]);
+    }
+    char *first = mem_pool_alloc(pool, 4096);
+    my_assert(first != NULL);
+    mem_pool_free(pool, first);
+    mem_pool_destroy(pool);
+
+    // Without MEM_GROW the pool stays full
+    pool = mem_pool_create(4096, MEM_OUT_OF_BAND);
+    my_assert(mem_pool_alloc(pool, 4096) != NULL);
+    my_assert(mem_pool_alloc(pool, 1) == NULL);
+    mem_pool_destroy(pool);
+
+    // Pages of a block that stays free past the delay are given back, a used block keeps its pages
+    const size_t pages = 64;
+    long page_size = sysconf(_SC_PAGESIZE);
+    pool = mem_pool_create(2 * pages * page_size, MEM_MMAP);
+    char *used = mem_pool_alloc(pool, pages * page_size);
+    char *idle = mem_pool_alloc(pool, pages * page_size);
+    my_assert(used != NULL && idle != NULL);
+    memset(used, 1, pages * page_size);
+    memset(idle, 2, pages * page_size);
+    mem_pool_free(pool, idle);
+    mem_pool_set_release_delay(pool, 5);
+    usleep(100 * 1000);
+
+    unsigned char resident[pages];
+    my_assert(mincore(idle, pages * page_size, resident) == 0);
+    size_t released = 0;
+    for (size_t i = 0; i < pages; i++)
+        released += !(resident[i] & 1);
+    my_assert(released == pages);
+    my_assert(mincore(used, pages * page_size, resident) == 0);
+    for (size_t i = 0; i < pages; i++)
+        my_assert(resident[i] & 1);
+    sanityCheck(pages * page_size, used, 1);
+
+    // Released memory can be allocated again
+    idle = mem_pool_alloc(pool, pages * page_size);
+    my_assert(idle != NULL);
+    memset(idle, 3, pages * page_size);
+    sanityCheck(pages * page_size, idle, 3);
+    mem_pool_set_release_delay(pool, 0);
+    mem_pool_destroy(pool);
+
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Checks where each placement policy puts a block. The pool holds free blocks of 200 bytes at 0 and 400,
+ * 100 bytes at 250 and 350 bytes at 650, with the block at 400 freed last.
+ */
+void test_placement_policies()
+{
+    printf_yellow("  Testing \"placement policies\" ---> ");
+
+    unsigned int policies[] = {MEM_FIRST_FIT, MEM_NEXT_FIT, MEM_BEST_FIT, MEM_ADDRESS_BEST_FIT, MEM_OUT_OF_BAND};
+    size_t expected[] = {0, 650, 400, 0, 0};
+    size_t sizes[] = {200, 50, 100, 50, 200, 50};
+    for (int p = 0; p < 5; p++)
+    {
+        mem_pool *pool = mem_pool_create(1000, policies[p]);
+        char *blocks[6];
+        for (int i = 0; i < 6; i++)
+        {
+            blocks[i] = mem_pool_alloc(pool, sizes[i]);
+            my_assert(blocks[i] != NULL);
+        }
+        char *base = blocks[0];
+        mem_pool_free(pool, blocks[2]);
+        mem_pool_free(pool, blocks[0]);
+        mem_pool_free(pool, blocks[4]);
+
+        char *block = mem_pool_alloc(pool, 150);
+        my_assert(block != NULL);
+        if (policies[p] != MEM_OUT_OF_BAND)
+            my_assert((size_t)(block - base) == expected[p]);
+
+        // Every policy still fills the pool exactly, largest piece first so each request has one exact fit
+        size_t free_at[] = {0, 250, 400, 650};
+        size_t rest[] = {200, 100, 200, 350};
+        for (int i = 0; i < 4; i++)
+        {
+            if ((size_t)(block - base) == free_at[i])
+                rest[i] -= 150;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            int largest = 0;
+            for (int j = 1; j < 4; j++)
+                largest = rest[j] > rest[largest] ? j : largest;
+            my_assert(mem_pool_alloc(pool, rest[largest]) != NULL);
+            rest[largest] = 0;
+        }
+        my_assert(mem_pool_alloc(pool, 1) == NULL);
+        mem_pool_destroy(pool);
+    }
+
+    // Two policies at once are refused rather than read as a third
+    my_assert(mem_pool_create(1000, MEM_FIRST_FIT | MEM_NEXT_FIT) == NULL);
+    my_assert(mem_pool_create(1000, MEM_BEST_FIT | MEM_ADDRESS_BEST_FIT | MEM_MMAP) == NULL);
+    mem_init_ex(1000, MEM_NEXT_FIT | MEM_BEST_FIT);
+    my_assert(mem_alloc(1) == NULL);
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+void *thread_count_operations(void *arg)
+{
+    mem_pool *pool = arg;
+    for (int i = 0; i < 1000; i++)
+    {
+        void *block = mem_pool_alloc(pool, 64);
+        my_assert(block != NULL);
+        mem_pool_free(pool, block);
+    }
+    return NULL;
+}
+
+/*
+ * Checks mem_stats: exact byte, block and fragmentation figures for the out-of-band layout, consistent ones
+ * for the other layouts, and operation counts that add up over several threads.
+ */
+void test_stats()
+{
+    printf_yellow("  Testing \"mem_stats\" ---> ");
+
+    mem_statistics stats;
+    mem_init(10000);
+    char *a = mem_alloc(100);
+    char *b = mem_alloc(200);
+    char *c = mem_alloc(300);
+    my_assert(mem_alloc(20000) == NULL);
+    mem_free(b);
+    mem_stats(&stats);
+    my_assert(stats.allocated_bytes == 400 && stats.allocated_blocks == 2);
+    my_assert(stats.free_bytes == 9600 && stats.free_blocks == 2);
+    my_assert(stats.largest_free_block == 9400);
+    my_assert(fabs(stats.fragmentation - (1 - 9400.0 / 9600)) < 1e-9);
+    my_assert(stats.peak_allocated_bytes == 600);
+    my_assert(stats.allocs == 3 && stats.frees == 1 && stats.failures == 1 && stats.resizes == 0);
+
+    a = mem_resize(a, 150);
+    my_assert(mem_resize(c, 20000) == NULL);
+    mem_free(a);
+    mem_free(c);
+    mem_stats(&stats);
+    my_assert(stats.allocated_bytes == 0 && stats.allocated_blocks == 0);
+    my_assert(stats.free_bytes == 10000 && stats.free_blocks == 1 && stats.fragmentation == 0);
+    my_assert(stats.peak_allocated_bytes == 600);
+    my_assert(stats.resizes == 1 && stats.failures == 2 && stats.frees == 3);
+    mem_deinit();
+
+    // Allocated and free bytes always add up to the same total
+    unsigned int layouts[] = {MEM_IN_BAND, MEM_BUDDY, MEM_THREAD_CACHE, MEM_OUT_OF_BAND};
+    for (int l = 0; l < 4; l++)
+    {
+        mem_pool *pool = mem_pool_create(100000, layouts[l]);
+        mem_pool_stats(pool, &stats);
+        size_t total = stats.allocated_bytes + stats.free_bytes;
+        my_assert(total > 0 && total <= 100000);
+
+        void *blocks[100];
+        for (int i = 0; i < 100; i++)
+            blocks[i] = mem_pool_alloc(pool, 1 + i * 5);
+        for (int i = 0; i < 100; i += 3)
+            blocks[i] = mem_pool_resize(pool, blocks[i], 700 - i * 5);
+        mem_pool_stats(pool, &stats);
+        my_assert(stats.allocated_bytes + stats.free_bytes == total);
+        my_assert(stats.allocated_blocks >= 100 && stats.largest_free_block <= stats.free_bytes);
+        my_assert(stats.peak_allocated_bytes >= stats.allocated_bytes);
+        for (int i = 0; i < 100; i++)
+            mem_pool_free(pool, blocks[i]);
+        mem_pool_stats(pool, &stats);
+        my_assert(stats.allocated_bytes + stats.free_bytes == total);
+        my_assert(stats.allocs == 100 && stats.frees == 100 && stats.resizes == 34);
+        mem_pool_destroy(pool);
+    }
+
+    // Counts of several threads add up
+    mem_pool *pool = mem_pool_create(100000, MEM_THREAD_CACHE);
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++)
+        pthread_create(&threads[i], NULL, thread_count_operations, pool);
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+    mem_pool_stats(pool, &stats);
+    my_assert(stats.allocs == 8000 && stats.frees == 8000 && stats.failures == 0);
+    mem_pool_destroy(pool);
+
+    printf_green("[PASS].\n");
+}
+
+// Sum of the buckets of a lock profile histogram
+static unsigned long histogram_total(const unsigned long *histogram)
+{
+    unsigned long total = 0;
+    for (int bucket = 0; bucket < MEM_LOCK_BUCKETS; bucket++)
+        total += histogram[bucket];
+    return total;
+}
+
+/*
+ * Checks the lock profile when built with make lock_profile: every mutex acquisition is counted for the
+ * operation that took it and lands in one bucket of each histogram. Without profiling there is nothing to read.
+ */
+void test_lock_profile()
+{
+    printf_yellow("  Testing \"lock profile\" ---> ");
+
+    mem_lock_stats stats;
+    mem_init(10000);
+    if (!mem_lock_profile(&stats))
+    {
+        mem_deinit();
+        printf_green("[PASS] (not compiled in).\n");
+        return;
+    }
+
+    void *blocks[10];
+    for (int i = 0; i < 10; i++)
+        blocks[i] = mem_alloc(100);
+    for (int i = 0; i < 5; i++)
+        blocks[i] = mem_resize(blocks[i], 200);
+    for (int i = 0; i < 10; i++)
+        mem_free(blocks[i]);
+
+    my_assert(mem_lock_profile(&stats));
+    my_assert(stats.acquisitions[MEM_LOCK_ALLOC] == 10);
+    my_assert(stats.acquisitions[MEM_LOCK_RESIZE] == 5);
+    my_assert(stats.acquisitions[MEM_LOCK_FREE] == 10);
+    for (int op = 0; op < MEM_LOCK_OPS; op++)
+    {
+        my_assert(stats.contended[op] <= stats.acquisitions[op]);
+        my_assert(histogram_total(stats.wait_histogram[op]) == stats.acquisitions[op]);
+        my_assert(histogram_total(stats.hold_histogram[op]) == stats.acquisitions[op]);
+    }
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+void *thread_mixed_sizes(void *arg)
+{
+    mem_pool *pool = arg;
+    unsigned int seed = (unsigned int)(uintptr_t)&seed;
+    unsigned char *blocks[16] = {NULL};
+    size_t sizes[16] = {0};
+    for (int i = 0; i < 2000; i++)
+    {
+        int slot = rand_r(&seed) % 16;
+        if (blocks[slot] != NULL)
+        {
+            for (size_t j = 0; j < sizes[slot]; j += 512)
+                my_assert(blocks[slot][j] == (unsigned char)slot);
+            mem_pool_free(pool, blocks[slot]);
+        }
+        // Every other slot holds small nodes, the rest large buffers
+        sizes[slot] = slot % 2 == 0 ? 16 + rand_r(&seed) % 48 : 65536 + rand_r(&seed) % 65536;
+        blocks[slot] = mem_pool_alloc(pool, sizes[slot]);
+        my_assert(blocks[slot] != NULL);
+        memset(blocks[slot], slot, sizes[slot]);
+    }
+    for (int slot = 0; slot < 16; slot++)
+        mem_pool_free(pool, blocks[slot]);
+    return NULL;
+}
+
+void test_regions()
+{
+    printf_yellow("  Testing \"MEM_REGIONS\" ---> ");
+
+    // Eight regions of 1 MiB, small blocks start in the first, large ones in the last
+    const size_t region = 1 << 20;
+    mem_statistics stats;
+    mem_pool *pool = mem_pool_create(8 * region, MEM_REGIONS);
+    char *a = mem_pool_alloc(pool, 16);
+    char *b = mem_pool_alloc(pool, 512 * 1024);
+    my_assert(a != NULL && b == a + 7 * region);
+
+    // A full region hands over to the next one, wrapping around
+    char *c = mem_pool_alloc(pool, 600 * 1024);
+    char *d = mem_pool_alloc(pool, 300 * 1024);
+    my_assert(c == a + 16 && d == b + 512 * 1024);
+    my_assert(mem_pool_alloc(pool, region + 1) == NULL);
+
+    // Resizing moves a block to another region when its own is full
+    memset(b, 0x5a, 512 * 1024);
+    my_assert(mem_pool_resize(pool, b, region + 1) == NULL);
+    b = mem_pool_resize(pool, b, 700 * 1024);
+    my_assert(b == a + region);
+    for (size_t i = 0; i < 512 * 1024; i++)
+        my_assert((unsigned char)b[i] == 0x5a);
+
+    // Unknown addresses are ignored
+    int outside;
+    mem_pool_free(pool, &outside);
+    my_assert(mem_pool_resize(pool, &outside, 100) == NULL);
+
+    mem_pool_stats(pool, &stats);
+    my_assert(stats.allocated_blocks == 4 && stats.allocated_bytes == 16 + 600 * 1024 + 300 * 1024 + 700 * 1024);
+    my_assert(stats.allocated_bytes + stats.free_bytes == 8 * region);
+    mem_pool_free(pool, a);
+    mem_pool_free(pool, b);
+    mem_pool_free(pool, c);
+    mem_pool_free(pool, d);
+    mem_pool_stats(pool, &stats);
+    my_assert(stats.allocated_bytes == 0 && stats.free_bytes == 8 * region);
+    my_assert(stats.free_blocks == 8 && stats.largest_free_block == region);
+    my_assert(stats.allocs == 4 && stats.frees == 5 && stats.resizes == 1 && stats.failures == 3);
+    mem_pool_destroy(pool);
+
+    // Small and large blocks from many threads
+    pool = mem_pool_create(64 * region, MEM_REGIONS);
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++)
+        pthread_create(&threads[i], NULL, thread_mixed_sizes, pool);
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+    mem_pool_stats(pool, &stats);
+    my_assert(stats.allocated_bytes == 0 && stats.free_bytes == 64 * region && stats.free_blocks == 8);
+    mem_pool_destroy(pool);
+
+    // Lazily coalesced default pool, and a pool too small to split
+    mem_init_ex(8 * region, MEM_REGIONS | MEM_LAZY_COALESCE);
+    void *blocks[100];
+    size_t sizes[100];
+    for (int i = 0; i < 100; i++)
+        sizes[i] = 40;
+    my_assert(mem_alloc_batch(blocks, sizes, 100));
+    mem_free_batch(blocks, 100);
+    coalesce_free_blocks();
+    mem_stats(&stats);
+    my_assert(stats.free_blocks == 8 && stats.allocated_blocks == 0);
+    mem_deinit();
+
+    pool = mem_pool_create(10000, MEM_REGIONS);
+    my_assert(mem_pool_alloc(pool, 9000) != NULL);
+    mem_pool_destroy(pool);
+
+    printf_green("[PASS].\n");
+}
+
+typedef struct
+{
+    mem_pool *pool;
+    int arenas;
+    size_t region_size;
+} cpu_arena_params;
+
+// Allocates on every CPU it may run on, pinned there, and checks the block comes from that CPU's arena
+void *thread_cpu_arenas(void *arg)
+{
+    cpu_arena_params *params = arg;
+    char *base = mem_pool_alloc(params->pool, 0);
+    cpu_set_t allowed, pinned;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        if (sched_setaffinity(0, sizeof(pinned), &pinned) != 0)
+            continue;
+        my_assert(sched_getcpu() == cpu);
+        char *block = mem_pool_alloc(params->pool, 100);
+        my_assert(block != NULL);
+        my_assert((size_t)(block - base) / params->region_size == (size_t)(cpu % params->arenas));
+        mem_pool_free(params->pool, block);
+    }
+    return NULL;
+}
+
+void test_cpu_arenas()
+{
+    printf_yellow("  Testing \"MEM_CPU_ARENAS\" ---> ");
+
+    // One arena of 1 MiB per configured CPU
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    int arenas = cpus < 1 ? 1 : cpus > 64 ? 64 : (int)cpus;
+    const size_t region = 1 << 20;
+    mem_statistics stats;
+    mem_pool *pool = mem_pool_create(arenas * region, MEM_CPU_ARENAS);
+    my_assert(pool != NULL);
+    mem_pool_stats(pool, &stats);
+    my_assert(stats.free_blocks == (size_t)arenas && stats.largest_free_block == region);
+
+    pthread_t thread;
+    cpu_arena_params params = {pool, arenas, region};
+    pthread_create(&thread, NULL, thread_cpu_arenas, &params);
+    pthread_join(thread, NULL);
+    mem_pool_destroy(pool);
+
+    // Many more threads than arenas
+    pool = mem_pool_create(arenas * 32 * region, MEM_CPU_ARENAS | MEM_LAZY_COALESCE);
+    pthread_t threads[16];
+    for (int i = 0; i < 16; i++)
+        pthread_create(&threads[i], NULL, thread_mixed_sizes, pool);
+    for (int i = 0; i < 16; i++)
+        pthread_join(threads[i], NULL);
+    mem_pool_stats(pool, &stats);
+    my_assert(stats.allocated_bytes == 0 && stats.free_bytes == arenas * 32 * region);
+    my_assert(stats.allocs == 16 * 2000 && stats.failures == 0);
+    mem_pool_destroy(pool);
+
+    // Only the out-of-band layout has arenas
+    pool = mem_pool_create(arenas * region, MEM_CPU_ARENAS | MEM_IN_BAND);
+    mem_pool_stats(pool, &stats);
+    my_assert(stats.free_blocks == 1);
+    mem_pool_destroy(pool);
+
+    printf_green("[PASS].\n");
+}
+
+void *thread_preload_malloc(void *arg)
+{
+    (void)arg;
+    unsigned int seed = (unsigned int)(uintptr_t)&seed;
+    unsigned char *blocks[32] = {NULL};
+    for (int i = 0; i < 5000; i++)
+    {
+        int slot = rand_r(&seed) % 32;
+        if (blocks[slot] != NULL)
+        {
+            my_assert(blocks[slot][0] == slot);
+            blocks[slot] = realloc(blocks[slot], 1 + rand_r(&seed) % 4096);
+            my_assert(blocks[slot] != NULL && blocks[slot][0] == slot);
+            free(blocks[slot]);
+        }
+        size_t size = 1 + rand_r(&seed) % 2048;
+        blocks[slot] = malloc(size);
+        my_assert(blocks[slot] != NULL && ((uintptr_t)blocks[slot] & 15) == 0);
+        my_assert(malloc_usable_size(blocks[slot]) >= size);
+        blocks[slot][0] = slot;
+    }
+    for (int slot = 0; slot < 32; slot++)
+        free(blocks[slot]);
+    return NULL;
+}
+
+void test_malloc_preload()
+{
+    // Runs again in a child process with the library preloaded
+    void *library = dlopen("./libmm_malloc.so", RTLD_NOW | RTLD_NOLOAD);
+    if (library == NULL)
+    {
+        fflush(stdout);
+        my_assert(system("LD_PRELOAD=./libmm_malloc.so ./test_memory_manager 20") == 0);
+        // And other programs served by it
+        my_assert(system("LD_PRELOAD=./libmm_malloc.so sh -c 'ls / | sort | wc -l' > /dev/null") == 0);
+        return;
+    }
+
+    printf_yellow("  Testing \"libmm_malloc.so\" ---> ");
+    my_assert(dlsym(RTLD_DEFAULT, "malloc") == dlsym(library, "malloc"));
+    my_assert(dlsym(RTLD_DEFAULT, "malloc_usable_size") == dlsym(library, "malloc_usable_size"));
+
+    // Zero sized blocks are distinct, calloc clears reused memory
+    volatile size_t zero = 0, huge = (size_t)-1;
+    char *a = malloc(zero);
+    char *b = malloc(zero);
+    my_assert(a != NULL && b != NULL && a != b);
+    free(a);
+    free(b);
+    a = malloc(1000);
+    memset(a, 0xff, 1000);
+    free(a);
+    int *zeroed = calloc(250, sizeof(int));
+    for (int i = 0; i < 250; i++)
+        my_assert(zeroed[i] == 0);
+    my_assert(calloc(huge, 16) == NULL);
+
+    // realloc keeps the contents, realloc to zero frees
+    char *text = realloc(NULL, 6);
+    strcpy(text, "hello");
+    text = realloc(text, 100000);
+    my_assert(text != NULL && strcmp(text, "hello") == 0 && malloc_usable_size(text) >= 100000);
+    my_assert(realloc(text, zero) == NULL);
+    my_assert(malloc_usable_size(text) == 0);
+
+    // Aligned allocation
+    void *aligned = NULL;
+    my_assert(posix_memalign(&aligned, 4096, 100) == 0 && ((uintptr_t)aligned & 4095) == 0);
+    my_assert(posix_memalign(&aligned, 24, 100) == EINVAL);
+    char *line = aligned_alloc(64, 64);
+    my_assert(line != NULL && ((uintptr_t)line & 63) == 0);
+    free(aligned);
+    free(line);
+    free(zeroed);
+
+    // The pool grows past its first chunk of 64 MiB
+    void *large = malloc((size_t)200 << 20);
+    my_assert(large != NULL);
+    free(large);
+
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++)
+        pthread_create(&threads[i], NULL, thread_preload_malloc, NULL);
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+    dlclose(library);
+
+    printf_green("[PASS].\n");
+}
+
+void *thread_traced_mallocs(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < 10000; i++)
+        free(malloc(77));
+    return NULL;
+}
+
+void test_trace_interposer()
+{
+    // Runs again in a child process with the interposer preloaded, then reads its trace
+    void *library = dlopen("./libmymalloc.so", RTLD_NOW | RTLD_NOLOAD);
+    if (library == NULL)
+    {
+        fflush(stdout);
+        remove("test_trace.bin");
+        my_assert(system("CM2_TRACE=test_trace.bin LD_PRELOAD=./libmymalloc.so ./test_memory_manager 21") == 0);
+
+        printf_yellow("  Testing \"trace file\" ---> ");
+        FILE *file = fopen("test_trace.bin", "rb");
+        my_assert(file != NULL);
+        if (file == NULL)
+            return;
+        trace_header header;
+        my_assert(fread(&header, sizeof(header), 1, file) == 1);
+        my_assert(memcmp(header.magic, TRACE_MAGIC, 8) == 0 && header.record_size == sizeof(trace_record));
+
+        // The realloc chain of the child, and every malloc of its threads
+        trace_record record;
+        uint64_t block = 0, last_time[4096] = {0};
+        int chain = 0, mallocs = 0;
+        while (fread(&record, sizeof(record), 1, file) == 1)
+        {
+            my_assert(record.op != TRACE_LOST);
+            my_assert(record.time_ns >= last_time[record.thread_id % 4096]); // In order per thread
+            last_time[record.thread_id % 4096] = record.time_ns;
+            if (record.op == TRACE_MALLOC && record.size == 12345 && chain == 0)
+            {
+                block = record.address;
+                chain = 1;
+            }
+            else if (record.op == TRACE_REALLOC_START && record.address == block && record.size == 23456 && chain == 1)
+                chain = 2;
+            else if (record.op == TRACE_REALLOC && record.arg == block && record.size == 23456 && chain == 2)
+            {
+                block = record.address;
+                chain = 3;
+            }
+            else if (record.op == TRACE_FREE && record.address == block && chain == 3)
+                chain = 4;
+            mallocs += record.op == TRACE_MALLOC && record.size == 77;
+        }
+        fclose(file);
+        my_assert(chain == 4 && mallocs == 8 * 10000);
+        my_assert(system("./cm2_decode -c -s test_trace.bin > /dev/null") == 0);
+        remove("test_trace.bin");
+        printf_green("[PASS].\n");
+        return;
+    }
+
+    char *block = malloc(12345);
+    block = realloc(block, 23456);
+    free(block);
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++)
+        pthread_create(&threads[i], NULL, thread_traced_mallocs, NULL);
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+    dlclose(library);
+}
+
+static void write_trace_record(FILE *file, uint64_t time_ns, uint32_t thread_id, uint32_t op, uint64_t address, uint64_t arg, uint64_t size)
+{
+    trace_record record = {time_ns, address, arg, size, thread_id, op};
+    fwrite(&record, sizeof(record), 1, file);
+}
+
+void test_trace_replay()
+{
+    printf_yellow("  Testing \"replay of a synthetic trace\" ---> ");
+    FILE *file = fopen("test_replay.bin", "wb");
+    my_assert(file != NULL);
+    if (file == NULL)
+        return;
+    trace_header header = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record)};
+    fwrite(&header, sizeof(header), 1, file);
+
+    // Thread 2's records come first in the file but later in time, blocks of thread 1 are
+    // freed and resized by thread 2, 0x9999 was never allocated. 0x1000 is reused by
+    // thread 2 while thread 1's realloc of it hasn't returned yet.
+    write_trace_record(file, 50, 2, TRACE_REALLOC, 0x5000, 0x4000, 600);
+    write_trace_record(file, 60, 2, TRACE_FREE, 0x9999, 0, 0);
+    write_trace_record(file, 38, 2, TRACE_MALLOC, 0x1000, 0, 50);
+    write_trace_record(file, 80, 2, TRACE_FREE, 0x5000, 0, 0);
+    write_trace_record(file, 10, 1, TRACE_MALLOC, 0x1000, 0, 100);
+    write_trace_record(file, 20, 1, TRACE_CALLOC, 0x2000, 4, 100);
+    write_trace_record(file, 30, 1, TRACE_MEMALIGN, 0x3000, 64, 200);
+    write_trace_record(file, 35, 1, TRACE_REALLOC_START, 0x1000, 0, 300);
+    write_trace_record(file, 40, 1, TRACE_REALLOC, 0x4000, 0x1000, 300);
+    write_trace_record(file, 45, 1, TRACE_MMAP, 0x7000, 0, 4096);
+    write_trace_record(file, 90, 1, TRACE_FREE, 0x2000, 0, 0);
+    write_trace_record(file, 95, 1, TRACE_FREE, 0x3000, 0, 0);
+    write_trace_record(file, 99, 2, TRACE_REALLOC, 0, 0x1000, 0);
+
+    // Many threads, each freeing what the one before allocated
+    for (uint32_t t = 10; t < 18; t++)
+        for (uint64_t i = 0; i < 2000; i++)
+        {
+            uint64_t time = 1000 + i * 100 + t;
+            write_trace_record(file, time, t, TRACE_MALLOC, (t << 20) + i * 16, 0, 1 + i % 300);
+            if (t > 10)
+                write_trace_record(file, time + 1, t, TRACE_FREE, ((t - 1) << 20) + i * 16, 0, 0);
+        }
+    fclose(file);
+
+    fflush(stdout);
+    my_assert(system("./trace_replay test_replay.bin > test_replay.out") == 0);
+    file = fopen("test_replay.out", "r");
+    my_assert(file != NULL);
+    if (file != NULL)
+    {
+        char line[256];
+        size_t ops = 0, threads = 0, skipped = 0;
+        my_assert(fscanf(file, "%zu ops in %zu threads, %*u blocks, %zu records", &ops, &threads, &skipped) == 3);
+        my_assert(ops == 10 + 8 * 2000 + 7 * 2000 && threads == 10 && skipped == 1);
+        int backends = 0;
+        while (fgets(line, sizeof(line), file) != NULL)
+            backends += strncmp(line, "mm ", 3) == 0 || strncmp(line, "glibc ", 6) == 0;
+        my_assert(backends == 2);
+        fclose(file);
+    }
+    my_assert(system("./trace_replay -b mm -f 0x4000 test_replay.bin > /dev/null") == 0);
+    my_assert(system("./trace_replay test_replay.out 2> /dev/null") != 0); // Not a trace
+    remove("test_replay.bin");
+    remove("test_replay.out");
+    printf_green("[PASS].\n");
+}
+
+// Bytes of a folded profile in the stacks that pass through function, -1 without the file
+static double folded_bytes(const char *path, const char *function)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    char line[16384];
+    double bytes = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char *value = strrchr(line, ' ');
+        char *frame = strstr(line, function);
+        if (value != NULL && frame != NULL && frame < value)
+            bytes += atof(value + 1);
+    }
+    fclose(file);
+    return bytes;
+}
+
+// Non-static and not inlined, so the profile names them
+void __attribute__((noinline)) profile_kept_allocs(mem_pool *pool, void **blocks, int count)
+{
+    for (int i = 0; i < count; i++)
+        blocks[i] = pool != NULL ? mem_pool_alloc(pool, 1024) : mem_alloc(1024);
+}
+
+void __attribute__((noinline)) profile_freed_allocs(int count)
+{
+    for (int i = 0; i < count; i++)
+        mem_free(mem_alloc(1024));
+}
+
+void test_heap_profile()
+{
+    static void *blocks[2000];
+    mem_init(16 * 1024 * 1024);
+
+    printf_yellow("  Testing \"live and allocated bytes per call stack\" ---> ");
+    my_assert(mem_profile_start(4096, "test_profile.heap"));
+    profile_kept_allocs(NULL, blocks, 2000);
+    profile_freed_allocs(8000);
+    my_assert(mem_profile_write("test_profile.heap"));
+    // One sample per 4 KiB, estimates are within a few percent
+    double kept = folded_bytes("test_profile.heap", "profile_kept_allocs");
+    double freed = folded_bytes("test_profile.heap", "profile_freed_allocs");
+    double allocated = folded_bytes("test_profile.heap.alloc", "profile_freed_allocs");
+    my_assert(kept > 2000 * 1024 * 0.75 && kept < 2000 * 1024 * 1.25);
+    my_assert(freed < 2000 * 1024 * 0.05);
+    my_assert(allocated > 8000 * 1024 * 0.75 && allocated < 8000 * 1024 * 1.25);
+    my_assert(folded_bytes("test_profile.heap", "test_heap_profile") >= kept);
+    my_assert(folded_bytes("test_profile.heap", "mem_alloc") == 0); // The allocator's own frames are left out
+    printf_green("[PASS].\n");
+
+    printf_yellow("  Testing \"profile written on signal\" ---> ");
+    remove("test_profile.heap");
+    my_assert(mem_profile_dump_on_signal(SIGUSR2));
+    raise(SIGUSR2);
+    for (int i = 0; i < 200 && folded_bytes("test_profile.heap", "profile_kept_allocs") <= 0; i++)
+        usleep(10000);
+    my_assert(folded_bytes("test_profile.heap", "profile_kept_allocs") > 0);
+    signal(SIGUSR2, SIG_DFL);
+    printf_green("[PASS].\n");
+
+    printf_yellow("  Testing \"freed and destroyed blocks leave the profile\" ---> ");
+    mem_pool *pool = mem_pool_create(4 * 1024 * 1024, MEM_REGIONS);
+    profile_kept_allocs(pool, blocks, 2000);
+    my_assert(mem_profile_write("test_profile.heap"));
+    my_assert(folded_bytes("test_profile.heap", "profile_kept_allocs") > 2 * 2000 * 1024 * 0.75);
+    mem_pool_destroy(pool);
+    profile_kept_allocs(NULL, blocks, 1000);
+    for (int i = 0; i < 1000; i++)
+        mem_free(blocks[i]);
+    mem_deinit(); // Writes the profile, the 2000 blocks of the first round are left
+    kept = folded_bytes("test_profile.heap", "profile_kept_allocs");
+    my_assert(kept > 2000 * 1024 * 0.75 && kept < 2000 * 1024 * 1.25);
+    mem_profile_stop();
+    remove("test_profile.heap");
+    remove("test_profile.heap.alloc");
+    printf_green("[PASS].\n");
+}
+
+// Reports of the debug checks since the last call
+static unsigned long debug_reports()
+{
+    static unsigned long last = 0;
+    unsigned long errors = 0;
+    mem_debug_errors(&errors);
+    unsigned long reports = errors - last;
+    last = errors;
+    return reports;
+}
+
+void test_debug_checks()
+{
+    unsigned long errors;
+    if (!mem_debug_errors(&errors))
+    {
+        // Runs again with the debug variant in front of the library
+        fflush(stdout);
+        my_assert(system("LD_PRELOAD=./libmemory_manager_debug.so ./test_memory_manager 24 2> /dev/null") == 0);
+        return;
+    }
+    debug_reports();
+
+    unsigned int layouts[] = {MEM_OUT_OF_BAND, MEM_IN_BAND, MEM_BUDDY, MEM_REGIONS | MEM_MMAP, MEM_THREAD_CACHE, MEM_ALIGN_64};
+    const char *names[] = {"out-of-band", "in-band", "buddy", "regions", "thread cache", "64 byte aligned"};
+    for (int l = 0; l < 6; l++)
+    {
+        printf_yellow("  Testing \"redzones and poisoning, %s\" ---> ", names[l]);
+        mem_init_ex(1024 * 1024, layouts[l]);
+
+        // Fresh payloads are poisoned, checked blocks report nothing
+        unsigned char *block = mem_alloc(100);
+        my_assert(block != NULL && block[0] == 0xcd && block[99] == 0xcd);
+        my_assert(mem_block_size(block) == 100);
+        memset(block, 1, 100);
+        mem_free(block);
+        my_assert(debug_reports() == 0);
+
+        // One byte past the end and one before the start
+        block = mem_alloc(100);
+        block[100] = 1;
+        mem_free(block);
+        my_assert(debug_reports() == 1);
+        block = mem_alloc(100);
+        block[-1] = 1;
+        mem_free(block);
+        my_assert(debug_reports() == 1);
+
+        // Double free, and a pointer that was never handed out
+        block = mem_alloc(100);
+        mem_free(block);
+        mem_free(block);
+        my_assert(debug_reports() == 1);
+        int local;
+        mem_free(&local);
+        my_assert(mem_resize(&local, 10) == NULL);
+        my_assert(debug_reports() == 2);
+
+        // Resized blocks keep their data and get new redzones
+        block = mem_alloc(100);
+        for (int i = 0; i < 100; i++)
+            block[i] = i;
+        block = mem_resize(block, 5000);
+        my_assert(block != NULL && block[99] == 99 && block[100] == 0xcd && mem_block_size(block) == 5000);
+        block[4999] = 1;
+        mem_free(block);
+        my_assert(debug_reports() == 0);
+        block = mem_resize(mem_alloc(5000), 10);
+        block[10] = 1;
+        mem_free(block);
+        my_assert(debug_reports() == 1);
+
+        // Aligned and batched blocks
+        block = mem_alloc_aligned(200, 256);
+        my_assert(block != NULL && ((uintptr_t)block & 255) == 0);
+        mem_free(block);
+        void *blocks[8];
+        size_t sizes[8] = {1, 16, 17, 100, 2, 300, 4000, 64};
+        my_assert(mem_alloc_batch(blocks, sizes, 8));
+        mem_free_batch(blocks, 8);
+        my_assert(debug_reports() == 0);
+        mem_deinit();
+        printf_green("[PASS].\n");
+    }
+
+    printf_yellow("  Testing \"freed payloads are poisoned\" ---> ");
+    mem_init(1024 * 1024);
+    unsigned char *block = mem_alloc(100);
+    unsigned char *next = mem_alloc(100); // Keeps the freed block from merging
+    mem_free(block);
+    my_assert(block[0] == 0xdd && block[99] == 0xdd);
+    mem_free(next);
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
 int main(int argc, char *argv[])
 {
 #ifdef VERSION
@@ -903,7 +2403,28 @@ int main(int argc, char *argv[])
         printf("  0. tests various functions with a base number of threads\n");
         printf("  1. tests various functions across variious configurations (number of threads, memory sizes,  iterations)\n");
         printf("  2. stress tests various functions with various configurations. This may take some time (especially if simulate_work flag is set to true.\n");
-        printf("  3. test_looking_for_out_of_bounds, needs LD_PRELOAD=./libmymalloc.so .\n\n");
+        printf("  3. test_looking_for_out_of_bounds, needs LD_PRELOAD=./libmymalloc.so .\n");
+        printf("  4. tests the in-band (boundary tag) block layout.\n");
+        printf("  5. tests the per-thread caches.\n");
+        printf("  6. tests the slab caches.\n");
+        printf("  7. tests the buddy block layout.\n");
+        printf("  8. tests independent pool handles.\n");
+        printf("  9. tests aligned allocation.\n");
+        printf("  10. tests batch alloc and free.\n");
+        printf("  11. tests in-place resize.\n");
+        printf("  12. tests neighbour coalescing.\n");
+        printf("  13. tests mapped pools.\n");
+        printf("  14. tests growing pools and idle release.\n");
+        printf("  15. tests placement policies.\n");
+        printf("  16. tests allocator statistics.\n");
+        printf("  17. tests the lock profile (make lock_profile).\n");
+        printf("  18. tests pools split into regions.\n");
+        printf("  19. tests per-CPU arenas.\n");
+        printf("  20. tests the malloc replacement libmm_malloc.so.\n");
+        printf("  21. tests the tracing interposer libmymalloc.so and its trace file.\n");
+        printf("  22. tests the replay of allocation traces by trace_replay.\n");
+        printf("  23. tests the sampling heap profile.\n");
+        printf("  24. tests the debug checks of libmemory_manager_debug.so.\n\n");
         return 1;
     }
 
@@ -987,6 +2508,127 @@ int main(int argc, char *argv[])
         test_looking_for_out_of_bounds();
         break;
 
+    case 4:
+        printf("\n*** Testing the in-band block layout: ***\n");
+        test_in_band_layout();
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .flags = MEM_IN_BAND});
+        break;
+
+    case 5:
+        printf("\n*** Testing the per-thread caches: ***\n");
+        test_thread_cache();
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .flags = MEM_THREAD_CACHE});
+        break;
+
+    case 6:
+        printf("\n*** Testing the slab caches: ***\n");
+        test_slab_cache();
+        test_slab_remote_free();
+        break;
+
+    case 7:
+        printf("\n*** Testing the buddy block layout: ***\n");
+        test_buddy_layout();
+        test_memory_fragmentation_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 2048, .iterations = 100, .flags = MEM_BUDDY});
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .flags = MEM_BUDDY});
+        break;
+
+    case 8:
+        printf("\n*** Testing independent pool handles: ***\n");
+        test_pool_handles();
+        break;
+
+    case 9:
+        printf("\n*** Testing aligned allocation: ***\n");
+        test_aligned_alloc();
+        break;
+
+    case 10:
+        printf("\n*** Testing batch alloc and free: ***\n");
+        test_batch_alloc_free();
+        for (int i = 0; i < 4; i++)
+            run_concurrency_test((TestParams){.num_threads = pow(2, i), .num_blocks = 1 << 12, .block_size = 128, .batch = true});
+        break;
+
+    case 11:
+        printf("\n*** Testing in-place resize: ***\n");
+        test_resize_in_place();
+        break;
+
+    case 12:
+        printf("\n*** Testing neighbour coalescing: ***\n");
+        test_neighbour_coalescing();
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .flags = MEM_LAZY_COALESCE});
+        break;
+
+    case 13:
+        printf("\n*** Testing mapped pools: ***\n");
+        test_mapped_pools();
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .flags = MEM_HUGE_PAGES});
+        break;
+
+    case 14:
+        printf("\n*** Testing growing pools: ***\n");
+        test_growing_pool();
+        test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .flags = MEM_GROW});
+        break;
+
+    case 15:
+        printf("\n*** Testing placement policies: ***\n");
+        test_placement_policies();
+        for (int i = 0; i < 4; i++)
+        {
+            unsigned int policy = (unsigned int[]){MEM_FIRST_FIT, MEM_NEXT_FIT, MEM_BEST_FIT, MEM_ADDRESS_BEST_FIT}[i];
+            test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024, .flags = policy});
+            test_memory_fragmentation_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 2048, .iterations = 100, .flags = policy});
+        }
+        break;
+
+    case 16:
+        printf("\n*** Testing allocator statistics: ***\n");
+        test_stats();
+        break;
+
+    case 17:
+        printf("\n*** Testing the lock profile: ***\n");
+        test_lock_profile();
+        break;
+
+    case 18:
+        printf("\n*** Testing pools split into regions: ***\n");
+        test_regions();
+        break;
+
+    case 19:
+        printf("\n*** Testing per-CPU arenas: ***\n");
+        test_cpu_arenas();
+        break;
+
+    case 20:
+        printf("\n*** Testing the malloc replacement: ***\n");
+        test_malloc_preload();
+        break;
+
+    case 21:
+        printf("\n*** Testing the tracing interposer: ***\n");
+        test_trace_interposer();
+        break;
+
+    case 22:
+        printf("\n*** Testing trace replay: ***\n");
+        test_trace_replay();
+        break;
+
+    case 23:
+        printf("\n*** Testing heap profile: ***\n");
+        test_heap_profile();
+        break;
+
+    case 24:
+        printf("\n*** Testing debug checks: ***\n");
+        test_debug_checks();
+        break;
+
     default:
         printf("Invalid test function\n");
         break;
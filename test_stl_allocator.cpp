@@ -0,0 +1,270 @@
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "memory_manager.hpp"
+#include "common_defs.h"
+
+#include "gitdata.h"
+
+template <class T>
+using pool_list = std::list<T, mem::Allocator<T>>;
+template <class K, class V>
+using pool_map = std::map<K, V, std::less<K>, mem::Allocator<std::pair<const K, V>>>;
+template <class K, class V>
+using pool_unordered_map = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, mem::Allocator<std::pair<const K, V>>>;
+
+// Size classes are resolved at compile time
+static_assert(mem::pool_resource::class_of(1) == 0, "first class");
+static_assert(mem::pool_resource::class_of(16) == 0, "first class");
+static_assert(mem::pool_resource::class_of(17) == 1, "second class");
+static_assert(mem::pool_resource::is_small(256, 16), "largest slab object");
+static_assert(!mem::pool_resource::is_small(257, 16), "too large for a slab");
+static_assert(!mem::pool_resource::is_small(16, 32), "too aligned for a slab");
+
+struct alignas(64) cache_line
+{
+    char bytes[64];
+};
+
+void test_stl_allocator()
+{
+    printf_yellow("  Testing \"Allocator<T> with standard containers\" ---> ");
+    mem::pool_resource pool(16 << 20, MEM_MMAP | MEM_GROW);
+    mem_statistics stats;
+    size_t allocated[2];
+
+    for (int round = 0; round < 2; round++)
+    {
+        pool_list<int> list{mem::Allocator<int>(pool)};
+        pool_map<int, int> map{mem::Allocator<std::pair<const int, int>>(pool)};
+        pool_unordered_map<int, int> hash{mem::Allocator<std::pair<const int, int>>(pool)};
+        std::vector<cache_line, mem::Allocator<cache_line>> lines{mem::Allocator<cache_line>(pool)};
+
+        for (int i = 0; i < 10000; i++)
+        {
+            list.push_back(i);
+            map[i] = -i;
+            hash[i] = 2 * i;
+        }
+        for (int i = 0; i < 100; i++)
+            lines.emplace_back();
+
+        // Everything came from the pool
+        mem_pool_stats(pool.pool(), &stats);
+        my_assert(stats.allocated_bytes >= 10000 * 3 * 2 * sizeof(int) + 100 * sizeof(cache_line));
+        allocated[round] = stats.allocated_bytes;
+        my_assert(((uintptr_t)lines.data() & 63) == 0);
+
+        for (int i = 0; i < 10000; i += 2)
+        {
+            map.erase(i);
+            hash.erase(i);
+        }
+        list.remove_if([](int value)
+                       { return value % 2 == 0; });
+
+        int expected = 1;
+        for (int value : list)
+        {
+            my_assert(value == expected);
+            expected += 2;
+        }
+        my_assert(map.size() == 5000 && hash.size() == 5000);
+        for (int i = 1; i < 10000; i += 2)
+        {
+            my_assert(map.at(i) == -i);
+            my_assert(hash.at(i) == 2 * i);
+        }
+
+        // Copies share the pool
+        pool_map<int, int> copy = map;
+        my_assert(copy.get_allocator() == map.get_allocator());
+        my_assert(copy == map);
+    }
+
+    // The second round reused the nodes of the first from the slab caches
+    my_assert(allocated[1] == allocated[0]);
+
+    // A full pool throws
+    mem::pool_resource small(4096);
+    pool_list<int> list{mem::Allocator<int>(small)};
+    bool thrown = false;
+    try
+    {
+        for (int i = 0; i < 4096; i++)
+            list.push_back(i);
+    }
+    catch (const std::bad_alloc &)
+    {
+        thrown = true;
+    }
+    my_assert(thrown);
+    my_assert(list.size() > 0 && list.size() < 4096);
+    list.clear();
+
+    printf_green("[PASS].\n");
+}
+
+void test_pmr_resource()
+{
+    printf_yellow("  Testing \"pool_resource as std::pmr::memory_resource\" ---> ");
+    mem_pool *handle = mem_pool_create(16 << 20, MEM_IN_BAND);
+    my_assert(handle != NULL);
+
+    {
+        mem::pool_resource pool(handle);
+        std::pmr::vector<int> vector(&pool);
+        std::pmr::map<int, std::pmr::string> map(&pool);
+        std::pmr::unordered_map<int, int> hash(&pool);
+        for (int i = 0; i < 10000; i++)
+        {
+            vector.push_back(i);
+            map.emplace(i, std::pmr::string(40, (char)('a' + i % 26)));
+            hash[i] = i;
+        }
+        for (int i = 0; i < 10000; i++)
+        {
+            my_assert(vector[i] == i);
+            my_assert(map.at(i).size() == 40 && map.at(i)[39] == (char)('a' + i % 26));
+            my_assert(hash.at(i) == i);
+        }
+        my_assert(*map.get_allocator().resource() == pool);
+
+        // Alignments beyond the size classes come from the pool
+        void *line = pool.allocate(64, 64);
+        my_assert(((uintptr_t)line & 63) == 0);
+        pool.deallocate(line, 64, 64);
+        void *page = pool.allocate(100, 4096);
+        my_assert(((uintptr_t)page & 4095) == 0);
+        pool.deallocate(page, 100, 4096);
+
+        // Empty requests get distinct blocks too
+        void *empty = pool.allocate(0, 32);
+        void *other = pool.allocate(0, 32);
+        my_assert(empty != NULL && other != NULL && empty != other);
+        my_assert(((uintptr_t)empty & 31) == 0 && ((uintptr_t)other & 31) == 0);
+        pool.deallocate(other, 0, 32);
+        pool.deallocate(empty, 0, 32);
+
+        // Objects of one size class are interchangeable between the two interfaces
+        using record = std::pair<void *, char[40]>;
+        void *object = pool.allocate(sizeof(record), 16);
+        my_assert(((uintptr_t)object & 15) == 0);
+        pool.deallocate(object, sizeof(record), 16);
+        mem::Allocator<record> records(pool);
+        record *first = records.allocate(1);
+        my_assert((void *)first == object);
+        pool.deallocate(first, sizeof(record), alignof(record));
+        my_assert(pool.allocate(sizeof(record)) == object);
+        pool.deallocate(object, sizeof(record));
+    }
+
+    // A borrowed pool stays with its owner
+    void *block = mem_pool_alloc(handle, 1024);
+    my_assert(block != NULL);
+    mem_pool_free(handle, block);
+    mem_pool_destroy(handle);
+
+    printf_green("[PASS].\n");
+}
+
+void test_stl_threads()
+{
+    printf_yellow("  Testing \"containers of one pool across threads\" ---> ");
+    mem::pool_resource pool(64 << 20, MEM_MMAP | MEM_GROW);
+
+    // Each thread fills its own map, then the maps are destroyed by the next thread
+    const int num_threads = 4;
+    std::vector<pool_map<int, int> *> maps(num_threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++)
+    {
+        threads.emplace_back([&pool, &maps, t]()
+                             {
+            auto *map = new pool_map<int, int>(mem::Allocator<std::pair<const int, int>>(pool));
+            for (int i = 0; i < 20000; i++)
+                (*map)[i] = i + t;
+            maps[t] = map; });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    threads.clear();
+
+    for (int t = 0; t < num_threads; t++)
+    {
+        threads.emplace_back([&maps, t, num_threads]()
+                             {
+            pool_map<int, int> *map = maps[(t + 1) % num_threads];
+            int offset = (t + 1) % num_threads;
+            for (int i = 0; i < 20000; i++)
+                my_assert(map->at(i) == i + offset);
+            delete map; });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    // The nodes freed by other threads are handed out again
+    mem_statistics stats;
+    mem_pool_stats(pool.pool(), &stats);
+    size_t allocated = stats.allocated_bytes;
+    {
+        pool_map<int, int> map{mem::Allocator<std::pair<const int, int>>(pool)};
+        for (int i = 0; i < num_threads * 20000; i++)
+            map[i] = i;
+        mem_pool_stats(pool.pool(), &stats);
+        my_assert(stats.allocated_bytes == allocated);
+    }
+
+    printf_green("[PASS].\n");
+}
+
+int main(int argc, char *argv[])
+{
+#ifdef VERSION
+    printf("Build Version; %s \n", VERSION);
+#endif
+    printf("Git Version; %s/%s \n", git_date, git_sha);
+
+    if (argc < 2)
+    {
+        printf("Usage: %s <test function>\n", argv[0]);
+        printf("Available test functions:\n");
+
+        printf("  0. runs all tests\n");
+        printf("  1. tests mem::Allocator with list, map, unordered_map and vector.\n");
+        printf("  2. tests mem::pool_resource with the std::pmr containers.\n");
+        printf("  3. tests containers of one pool across threads.\n\n");
+        return 1;
+    }
+
+    int test = atoi(argv[1]);
+    if (test < 0 || test > 3)
+    {
+        printf("Invalid test function\n");
+        return 1;
+    }
+
+    if (test == 0 || test == 1)
+    {
+        printf("\n*** Testing mem::Allocator: ***\n");
+        test_stl_allocator();
+    }
+    if (test == 0 || test == 2)
+    {
+        printf("\n*** Testing mem::pool_resource: ***\n");
+        test_pmr_resource();
+    }
+    if (test == 0 || test == 3)
+    {
+        printf("\n*** Testing containers across threads: ***\n");
+        test_stl_threads();
+    }
+
+    return 0;
+}
@@ -0,0 +1,497 @@
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cm2_trace.h"
+#include "memory_manager.h"
+
+// Replays an allocation trace of the cM2.c interposer against the memory
+// manager and against glibc:
+//
+//   trace_replay [-b mm|glibc] [-m pool_mb] [-f flags] trace_file
+//
+// Every block of the trace gets an id, so the replay doesn't depend on the
+// addresses seen when it was recorded. Each recorded thread is replayed by a
+// thread of its own, in the order it made its calls. A thread that frees or
+// resizes a block of another thread waits until that block exists, the wait
+// isn't timed. Reports ops/s, latency percentiles of single calls and, for
+// the memory manager, the peak bytes allocated in the pool.
+//
+// -m sets the first chunk of the pool (twice the trace's peak by default),
+// -f the flags of mem_init_ex (MEM_MMAP | MEM_GROW by default).
+
+#define DEFAULT_FLAGS (MEM_MMAP | MEM_GROW)
+#define NO_BLOCK UINT32_MAX
+#define GONE ((void *)-1)  // Block given back, or whose allocation returned NULL in the replay
+
+enum { REPLAY_ALLOC, REPLAY_CALLOC, REPLAY_MEMALIGN, REPLAY_REALLOC, REPLAY_FREE };
+
+typedef struct replay_op {
+    uint32_t op;
+    uint32_t block;            // Block made, or the one freed
+    uint32_t from;             // Block passed to realloc
+    uint32_t count;            // calloc element count
+    uint64_t size;
+    uint64_t alignment;
+} replay_op;
+
+typedef struct replay_thread {
+    uint32_t thread_id;
+    size_t count, capacity;
+    replay_op *ops;
+    uint32_t *latencies;       // ns per op, filled by the replay
+    bool in_realloc;           // TRACE_REALLOC_START seen, its TRACE_REALLOC not yet
+    uint32_t realloc_from;     // Block that realloc gives up
+} replay_thread;
+
+typedef struct replay_backend {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void *(*zalloc)(size_t count, size_t size);
+    void *(*aligned)(size_t alignment, size_t size);
+    void *(*resize)(void *block, size_t size);
+    void (*release)(void *block);
+} replay_backend;
+
+typedef struct replay {
+    replay_thread *threads;
+    size_t num_threads;
+    uint32_t num_blocks;
+    size_t ops, skipped;
+    size_t peak_bytes;         // Most bytes the trace had allocated at once
+    uint64_t *sizes;           // Bytes of each block
+    const replay_backend *backend;
+    void *_Atomic *blocks;     // NULL until made
+    atomic_size_t corrupt;     // Blocks that didn't keep their contents
+    pthread_barrier_t start;
+} replay;
+
+static void *mm_zalloc(size_t count, size_t size) {
+    void *block = mem_alloc(count * size);
+    if (block != NULL) {
+        memset(block, 0, count * size);
+    }
+    return block;
+}
+
+static void *mm_aligned(size_t alignment, size_t size) {
+    return mem_alloc_aligned(size, alignment);
+}
+
+static const replay_backend backends[] = {
+    { "mm", mem_alloc, mm_zalloc, mm_aligned, mem_resize, mem_free },
+    { "glibc", malloc, calloc, memalign, realloc, free },
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Open addressing map from the addresses of live blocks to their ids
+typedef struct address_map {
+    uint64_t *keys;            // 0 is empty, 1 a removed entry
+    uint32_t *values;
+    size_t mask;
+} address_map;
+
+static size_t map_find(const address_map *map, uint64_t address, bool insert) {
+    size_t i = (address * 0x9E3779B97F4A7C15ULL >> 17) & map->mask;
+    size_t removed = SIZE_MAX;
+    while (map->keys[i] != 0 && map->keys[i] != address) {
+        if (map->keys[i] == 1 && removed == SIZE_MAX) {
+            removed = i;
+        }
+        i = (i + 1) & map->mask;
+    }
+    return insert && map->keys[i] == 0 && removed != SIZE_MAX ? removed : i;
+}
+
+static uint32_t map_take(address_map *map, uint64_t address) {
+    size_t i = map_find(map, address, false);
+    if (map->keys[i] != address) {
+        return NO_BLOCK;
+    }
+    map->keys[i] = 1;
+    return map->values[i];
+}
+
+static void map_put(address_map *map, uint64_t address, uint32_t block) {
+    size_t i = map_find(map, address, true);
+    map->keys[i] = address;
+    map->values[i] = block;
+}
+
+// Time order, records of the same time keep their file order and with it each thread's order
+static int compare_records(const void *a, const void *b, void *records) {
+    const trace_record *x = (trace_record *)records + *(const size_t *)a;
+    const trace_record *y = (trace_record *)records + *(const size_t *)b;
+    if (x->time_ns != y->time_ns) {
+        return x->time_ns < y->time_ns ? -1 : 1;
+    }
+    return (x > y) - (x < y);
+}
+
+static replay_thread *thread_of(replay *r, uint32_t thread_id) {
+    for (size_t i = 0; i < r->num_threads; i++) {
+        if (r->threads[r->num_threads - 1 - i].thread_id == thread_id) {
+            return &r->threads[r->num_threads - 1 - i];
+        }
+    }
+    r->threads = realloc(r->threads, (r->num_threads + 1) * sizeof(replay_thread));
+    memset(&r->threads[r->num_threads], 0, sizeof(replay_thread));
+    r->threads[r->num_threads].thread_id = thread_id;
+    return &r->threads[r->num_threads++];
+}
+
+// Read a trace and turn it into per-thread operations on block ids
+static bool load_trace(const char *path, replay *r) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, 8) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(trace_record)) {
+        fprintf(stderr, "%s: not a version %d cM2 trace\n", path, TRACE_VERSION);
+        fclose(file);
+        return false;
+    }
+    size_t count = 0, capacity = 65536;
+    trace_record *records = malloc(capacity * sizeof(trace_record));
+    size_t read;
+    while ((read = fread(records + count, sizeof(trace_record), capacity - count, file)) > 0) {
+        count += read;
+        if (count == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(trace_record));
+        }
+    }
+    fclose(file);
+
+    // Threads' records are interleaved in flush order, the ids need them in time order
+    size_t *order = malloc((count + 1) * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    qsort_r(order, count, sizeof(size_t), compare_records, records);
+
+    address_map map;
+    map.mask = 1024;
+    while (map.mask < count * 2) {
+        map.mask *= 2;
+    }
+    map.keys = calloc(map.mask, sizeof(uint64_t));
+    map.values = malloc(map.mask * sizeof(uint32_t));
+    map.mask--;
+    uint64_t *sizes = malloc((count + 1) * sizeof(uint64_t));
+    size_t live_bytes = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        trace_record *t = &records[order[i]];
+        replay_op op = { .block = NO_BLOCK, .from = NO_BLOCK, .size = t->size };
+        switch (t->op) {
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+        case TRACE_MEMALIGN:
+            if (t->address == 0) {
+                continue;  // Failed when it was recorded
+            }
+            op.op = t->op == TRACE_MALLOC ? REPLAY_ALLOC : t->op == TRACE_CALLOC ? REPLAY_CALLOC : REPLAY_MEMALIGN;
+            if (t->op == TRACE_CALLOC) {
+                op.count = t->arg > 0 ? t->arg : 1;
+                op.size = t->size / op.count;
+            }
+            op.alignment = t->arg;
+            break;
+        case TRACE_REALLOC_START: {
+            // The block may be reused by another thread before the realloc returns
+            replay_thread *thread = thread_of(r, t->thread_id);
+            thread->in_realloc = true;
+            thread->realloc_from = map_take(&map, t->address);
+            continue;
+        }
+        case TRACE_REALLOC: {
+            replay_thread *thread = thread_of(r, t->thread_id);
+            if (thread->in_realloc) {
+                op.from = thread->realloc_from;
+                thread->in_realloc = false;
+            } else {
+                op.from = t->arg != 0 ? map_take(&map, t->arg) : NO_BLOCK;  // Its start was lost
+            }
+            if (t->address == 0 && t->size > 0) {
+                if (op.from != NO_BLOCK) {
+                    map_put(&map, t->arg, op.from);
+                }
+                continue;  // Failed, the block stayed where it was
+            }
+            if (op.from == NO_BLOCK && t->arg != 0) {
+                r->skipped++;  // Resizes a block the trace never made, replay it as malloc
+            }
+            if (op.from != NO_BLOCK) {
+                live_bytes -= sizes[op.from];
+            }
+            op.op = t->address == 0 ? REPLAY_FREE : op.from == NO_BLOCK ? REPLAY_ALLOC : REPLAY_REALLOC;
+            if (op.op == REPLAY_FREE) {
+                if (op.from == NO_BLOCK) {
+                    continue;
+                }
+                op.block = op.from;
+            }
+            break;
+        }
+        case TRACE_FREE:
+            if (t->address == 0) {
+                continue;
+            }
+            op.op = REPLAY_FREE;
+            op.block = map_take(&map, t->address);
+            if (op.block == NO_BLOCK) {
+                r->skipped++;
+                continue;
+            }
+            live_bytes -= sizes[op.block];
+            break;
+        default:
+            continue;  // mmap and munmap aren't served by the allocator
+        }
+        if (op.op != REPLAY_FREE) {
+            if (map_take(&map, t->address) != NO_BLOCK) {
+                r->skipped++;  // Made again without a free in between, the old block leaks
+            }
+            op.block = r->num_blocks++;
+            sizes[op.block] = t->size;
+            live_bytes += sizes[op.block];
+            if (live_bytes > r->peak_bytes) {
+                r->peak_bytes = live_bytes;
+            }
+            map_put(&map, t->address, op.block);
+        }
+        replay_thread *thread = thread_of(r, t->thread_id);
+        if (thread->count == thread->capacity) {
+            thread->capacity = thread->capacity > 0 ? thread->capacity * 2 : 1024;
+            thread->ops = realloc(thread->ops, thread->capacity * sizeof(replay_op));
+        }
+        thread->ops[thread->count++] = op;
+        r->ops++;
+    }
+    r->sizes = sizes;
+    free(map.keys);
+    free(map.values);
+    free(order);
+    free(records);
+    for (size_t i = 0; i < r->num_threads; i++) {
+        r->threads[i].latencies = malloc((r->threads[i].count + 1) * sizeof(uint32_t));
+    }
+    return true;
+}
+
+// Wait for a block of another thread, NULL when its allocation failed
+static void *wait_block(replay *r, uint32_t block) {
+    void *ptr;
+    while ((ptr = atomic_load_explicit(&r->blocks[block], memory_order_acquire)) == NULL) {
+        sched_yield();
+    }
+    return ptr == GONE ? NULL : ptr;
+}
+
+// The first bytes of a block hold its id, so lost contents show up
+static void check_block(replay *r, void *ptr, uint32_t block, uint64_t size) {
+    if (ptr != NULL && size >= sizeof(uint32_t) && memcmp(ptr, &block, sizeof(uint32_t)) != 0) {
+        atomic_fetch_add(&r->corrupt, 1);
+    }
+}
+
+static void mark_block(replay *r, void *ptr, uint32_t block, uint64_t size) {
+    if (ptr != NULL && size >= sizeof(uint32_t)) {
+        memcpy(ptr, &block, sizeof(uint32_t));
+    }
+    atomic_store_explicit(&r->blocks[block], ptr != NULL ? ptr : GONE, memory_order_release);
+}
+
+static replay *current;
+
+static void *replay_thread_main(void *arg) {
+    replay *r = current;
+    replay_thread *thread = arg;
+    const replay_backend *b = r->backend;
+
+    pthread_barrier_wait(&r->start);
+    for (size_t i = 0; i < thread->count; i++) {
+        replay_op *op = &thread->ops[i];
+        size_t size = op->size > 0 ? op->size : 1;  // Every block of the trace was a block of its own
+        void *ptr = NULL, *old = NULL;
+        uint64_t start = 0, end = 0;
+        switch (op->op) {
+        case REPLAY_ALLOC:
+            start = now_ns();
+            ptr = b->alloc(size);
+            end = now_ns();
+            break;
+        case REPLAY_CALLOC:
+            start = now_ns();
+            ptr = b->zalloc(op->count, size);
+            end = now_ns();
+            break;
+        case REPLAY_MEMALIGN:
+            start = now_ns();
+            ptr = b->aligned(op->alignment, size);
+            end = now_ns();
+            break;
+        case REPLAY_REALLOC:
+            old = wait_block(r, op->from);
+            check_block(r, old, op->from, r->sizes[op->from]);
+            atomic_store_explicit(&r->blocks[op->from], GONE, memory_order_relaxed);
+            start = now_ns();
+            ptr = old != NULL ? b->resize(old, size) : b->alloc(size);
+            end = now_ns();
+            if (ptr == NULL && old != NULL) {
+                b->release(old);
+            }
+            break;
+        case REPLAY_FREE:
+            old = wait_block(r, op->block);
+            check_block(r, old, op->block, r->sizes[op->block]);
+            atomic_store_explicit(&r->blocks[op->block], GONE, memory_order_relaxed);
+            start = now_ns();
+            if (old != NULL) {
+                b->release(old);
+            }
+            end = now_ns();
+            break;
+        }
+        if (op->op != REPLAY_FREE) {
+            mark_block(r, ptr, op->block, r->sizes[op->block]);
+        }
+        thread->latencies[i] = end - start < UINT32_MAX ? end - start : UINT32_MAX;
+    }
+    return NULL;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Replay the whole trace once, returns false if blocks lost their contents
+static bool run_replay(replay *r, const replay_backend *backend, size_t pool_size, unsigned int flags) {
+    r->backend = backend;
+    r->blocks = calloc(r->num_blocks + 1, sizeof(void *));
+    atomic_store(&r->corrupt, 0);
+    if (backend->alloc == mem_alloc) {
+        mem_init_ex(pool_size, flags);
+    }
+
+    pthread_t *threads = malloc(r->num_threads * sizeof(pthread_t));
+    pthread_barrier_init(&r->start, NULL, r->num_threads + 1);
+    current = r;
+    for (size_t t = 0; t < r->num_threads; t++) {
+        pthread_create(&threads[t], NULL, replay_thread_main, &r->threads[t]);
+    }
+    pthread_barrier_wait(&r->start);
+    uint64_t start = now_ns();
+    for (size_t t = 0; t < r->num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+    pthread_barrier_destroy(&r->start);
+
+    char peak[32] = "-";
+    if (backend->alloc == mem_alloc) {
+        mem_statistics stats;
+        mem_stats(&stats);
+        snprintf(peak, sizeof(peak), "%.2f", stats.peak_allocated_bytes / 1048576.0);
+    }
+    // Blocks the trace never freed
+    for (uint32_t i = 0; i < r->num_blocks; i++) {
+        void *ptr = atomic_load(&r->blocks[i]);
+        if (ptr != NULL && ptr != GONE) {
+            backend->release(ptr);
+        }
+    }
+    if (backend->alloc == mem_alloc) {
+        mem_deinit();
+    }
+
+    uint32_t *latencies = malloc((r->ops + 1) * sizeof(uint32_t));
+    size_t n = 0;
+    for (size_t t = 0; t < r->num_threads; t++) {
+        memcpy(latencies + n, r->threads[t].latencies, r->threads[t].count * sizeof(uint32_t));
+        n += r->threads[t].count;
+    }
+    qsort(latencies, n, sizeof(uint32_t), compare_u32);
+    printf("%-8s %12.0f %8u %8u %8u %8u %10u %12s\n", backend->name, n / (elapsed / 1e9),
+           latencies[n / 2], latencies[n * 90 / 100], latencies[n * 99 / 100], latencies[n * 999 / 1000],
+           latencies[n - 1], peak);
+
+    size_t corrupt = atomic_load(&r->corrupt);
+    if (corrupt > 0) {
+        fprintf(stderr, "%s: %zu blocks lost their contents\n", backend->name, corrupt);
+    }
+    free(latencies);
+    free(threads);
+    free(r->blocks);
+    return corrupt == 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *only = NULL;
+    size_t pool_mb = 0;
+    unsigned int flags = DEFAULT_FLAGS;
+    int option;
+    while ((option = getopt(argc, argv, "b:m:f:")) != -1) {
+        if (option == 'b') {
+            only = optarg;
+        } else if (option == 'm') {
+            pool_mb = strtoul(optarg, NULL, 10);
+        } else if (option == 'f') {
+            flags = strtoul(optarg, NULL, 0);
+        } else {
+            optind = argc;  // Print the usage
+        }
+    }
+    if (optind != argc - 1 || (only != NULL && strcmp(only, "mm") != 0 && strcmp(only, "glibc") != 0)) {
+        fprintf(stderr, "Usage: %s [-b mm|glibc] [-m pool_mb] [-f flags] trace_file\n", argv[0]);
+        return 2;
+    }
+
+    replay r = { 0 };
+    if (!load_trace(argv[optind], &r)) {
+        return 1;
+    }
+    if (r.ops == 0) {
+        fprintf(stderr, "%s: nothing to replay\n", argv[optind]);
+        return 1;
+    }
+    size_t pool_size = pool_mb > 0 ? pool_mb << 20 : (r.peak_bytes * 2 + (1 << 20) - 1) & ~(size_t)((1 << 20) - 1);
+    if (pool_size < (16 << 20)) {
+        pool_size = 16 << 20;
+    }
+    printf("%zu ops in %zu threads, %u blocks, %zu records skipped, peak %.2f MiB in use\n",
+           r.ops, r.num_threads, r.num_blocks, r.skipped, r.peak_bytes / 1048576.0);
+    printf("%-8s %12s %8s %8s %8s %8s %10s %12s\n", "backend", "ops/s", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns",
+           "max ns", "peak MiB");
+
+    bool intact = true;
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (only == NULL || strcmp(only, backends[i].name) == 0) {
+            intact &= run_replay(&r, &backends[i], pool_size, flags);
+        }
+    }
+    for (size_t i = 0; i < r.num_threads; i++) {
+        free(r.threads[i].ops);
+        free(r.threads[i].latencies);
+    }
+    free(r.threads);
+    free(r.sizes);
+    return intact ? 0 : 1;
+}